@@ -31,12 +31,21 @@
 #include "elfldr_patch.h"
 #include "prsh.h"
 #include "ff.h"
+#include "diskio.h"
 
 #include "rednand.h"
 
 extern bool minute_on_slc;
 extern bool minute_on_sd;
 
+// Reads from a file are split into chunks this size, so hashing a chunk overlaps
+// with reading the next one.
+#define ANCAST_READ_CHUNK   (0x40000)
+
+// Raw sector boots read this many sectors per sdcard_read call, and report their
+// progress once per call.
+#define ANCAST_SECTOR_CHUNK (0x80)
+
 char sd_read_buffer[0x200] ALIGNED(0x20);
 const char wafel_core_fn[] = "wafel_core.ipx"; 
 
@@ -54,6 +63,23 @@ typedef struct {
 
 int ancast_fini(ancast_ctx* ctx);
 
+static void _ancast_sector_progress(ancast_ctx* ctx, u32 done, u32 total)
+{
+#ifdef MINUTE_BOOT1
+    static int led_alternate = 0;
+
+    (void)ctx;
+    (void)total;
+    serial_send_u32(done);
+    smc_set_notification_led(led_alternate ? LEDRAW_BLUE : LEDRAW_PURPLE);
+    led_alternate = !led_alternate;
+#else
+    u32 mib = 0x100000 / SDMMC_DEFAULT_BLOCKLEN;
+    if (done % mib == 0 || done == total)
+        printf("ancast: ...%08lx -> %08lx\n", done * SDMMC_DEFAULT_BLOCKLEN, (u32)ctx->load + done * SDMMC_DEFAULT_BLOCKLEN);
+#endif
+}
+
 int ancast_init(ancast_ctx* ctx, const char* path)
 {
     if(!ctx || !path) return -1;
@@ -223,10 +249,27 @@ int ancast_load(ancast_ctx* ctx)
 
     ctx->body = ctx->load + ctx->header_size;
 
+#ifndef MINUTE_BOOT1
+    u32 hash[SHA_HASH_WORDS] = {0};
+    int hashed = 0;
+#endif
+
     if (ctx->memory_load)
     {
         u32 total_size = ctx->header_size + ctx->header.body_size;
-        memcpy(ctx->load, ctx->memory_load, total_size);
+        aes_job copy;
+
+        dma_memcpy_start(&copy, ctx->load, ctx->memory_load, total_size);
+#ifndef MINUTE_BOOT1
+        // Hash the source while the AES engine copies it.
+        sha_hash((u8*)ctx->memory_load + ctx->header_size, hash, ctx->header.body_size);
+        hashed = 1;
+#endif
+        if (dma_memcpy_wait(&copy)) {
+            printf("ancast: failed to copy %s to %p.\n", ctx->path, ctx->load);
+            ancast_fini(ctx);
+            return -3;
+        }
     }
 #if !defined(MINUTE_BOOT1) || defined(ISFSHAX_STAGE2)
     else if (ctx->file)
@@ -235,22 +278,28 @@ int ancast_load(ancast_ctx* ctx)
         fseek(ctx->file, 0, SEEK_SET);
 
         u32 total_size = ctx->header_size + ctx->header.body_size;
+        disk_reset_stats();
 
 #ifdef MINUTE_BOOT1
         serial_send_u32(total_size);
         serial_send_u32(ctx->header.body_size);
 #endif
 
+#ifndef MINUTE_BOOT1
+        sha_ctx sha;
+        sha_init(&sha);
+#endif
+
 #if 1
         int led_alternate = 0;
-        for (u32 i = 0; i < total_size; i += 0x100000)
+        for (u32 i = 0; i < total_size; i += ANCAST_READ_CHUNK)
         {
             if (i % 0x100000 == 0)
             {
                 printf("ancast: ...%08x -> %08x\n", i, (u32)ctx->load + i);
             }
 
-            u32 to_read = 0x100000;
+            u32 to_read = ANCAST_READ_CHUNK;
             if (i + to_read > total_size) {
                 to_read = total_size - i;
             }
@@ -258,12 +307,27 @@ int ancast_load(ancast_ctx* ctx)
             int count = fread(ctx->load + i, to_read, 1, ctx->file);
             if(count != 1) {
                 printf("ancast: failed to read offs=%08x, %s (%d).\n", i, ctx->path, errno);
+#ifndef MINUTE_BOOT1
+                sha_end_update(&sha);
+#endif
                 ancast_fini(ctx);
                 return errno;
             }
+
+#ifndef MINUTE_BOOT1
+            // The SHA engine hashes this chunk while the next one is read.
+            u32 body_start = max(i, (u32)ctx->header_size);
+            if (i + to_read > body_start)
+                sha_start_update(&sha, ctx->load + body_start, i + to_read - body_start);
+#endif
         }
 #endif
 
+#ifndef MINUTE_BOOT1
+        sha_final(&sha, hash);
+        hashed = 1;
+#endif
+
 #if 0
         int count = fread(ctx->load, total_size, 1, ctx->file);
         if(count != 1) {
@@ -274,56 +338,64 @@ int ancast_load(ancast_ctx* ctx)
 #endif
         smc_set_notification_led(LEDRAW_PURPLE);
         
-        printf("ancast: done reading\n");
+        QWORD moved, bounced;
+        disk_get_stats(&moved, &bounced);
+        printf("ancast: done reading (%lu KiB from SD, %lu KiB bounced)\n", (u32)(moved >> 10), (u32)(bounced >> 10));
     }
 #endif
     else if (ctx->sector_idx)
     {
-        void* sdcard_dst = ctx->load;
-        u32 num_sectors = ctx->header_size + ctx->header.body_size;
-        num_sectors /= 0x200;
-        num_sectors += 1; // sloppy, but not the end of the world.
+        u32 total_size = ctx->header_size + ctx->header.body_size;
+        u32 num_sectors = (total_size + SDMMC_DEFAULT_BLOCKLEN - 1) / SDMMC_DEFAULT_BLOCKLEN;
 
 #ifdef MINUTE_BOOT1
         serial_send_u32(num_sectors);
         serial_send_u32(ctx->header.body_size);
 #endif
 
-        memset(sdcard_dst, 0, ctx->header_size + ctx->header.body_size);
+#ifndef MINUTE_BOOT1
+        sha_ctx sha;
+        sha_init(&sha);
+#endif
 
-        int led_alternate = 0;
-        for (int i = 0; i < num_sectors; i++)
+        // Multi-block reads straight to the load address, sdcard_read splits them
+        // up as far as the controller needs it.
+        for (u32 i = 0; i < num_sectors; i += ANCAST_SECTOR_CHUNK)
         {
-            sdcard_dst = (void*)((u32)ctx->load + (i*0x200));
-            //serial_send_u32(i);
+            u32 count = min(num_sectors - i, (u32)ANCAST_SECTOR_CHUNK);
+            void* sdcard_dst = ctx->load + i * SDMMC_DEFAULT_BLOCKLEN;
 
-#ifdef MINUTE_BOOT1
-            if (i % 0x10 == 0) {
-                serial_send_u32(i);
-                if (led_alternate) {
-                    smc_set_notification_led(LEDRAW_BLUE);
-                }
-                else {
-                    smc_set_notification_led(LEDRAW_PURPLE);
-                }
-                led_alternate = !led_alternate;
+            if (sdcard_read(ctx->sector_idx + i, count, sdcard_dst)) {
+                printf("ancast: failed to read sectors 0x%lx-0x%lx.\n", ctx->sector_idx + i, ctx->sector_idx + i + count - 1);
+#ifndef MINUTE_BOOT1
+                sha_end_update(&sha);
+#endif
+                ancast_fini(ctx);
+                return -4;
             }
+
+#ifndef MINUTE_BOOT1
+            // Same as for files, hashed while the next chunk is read.
+            u32 chunk_start = i * SDMMC_DEFAULT_BLOCKLEN;
+            u32 chunk_end = min((i + count) * SDMMC_DEFAULT_BLOCKLEN, total_size);
+            u32 body_start = max(chunk_start, (u32)ctx->header_size);
+            if (chunk_end > body_start)
+                sha_start_update(&sha, ctx->load + body_start, chunk_end - body_start);
 #endif
-            //serial_send_u32((u32)sdcard_dst);
-            sdcard_read(ctx->sector_idx + i, 1, sdcard_dst);
-            //serial_send_u32(*(u32*)sdcard_dst);
-            //sdcard_read(ctx->sector_idx + i, 1, sdcard_dst);
-            //serial_send_u32(*(u32*)sdcard_dst);
-            // TODO: why???
+
+            _ancast_sector_progress(ctx, i + count, num_sectors);
         }
 #ifdef MINUTE_BOOT1
         smc_set_notification_led(LEDRAW_PURPLE);
+#else
+        sha_final(&sha, hash);
+        hashed = 1;
 #endif
     }
 
 #ifndef MINUTE_BOOT1
-    u32 hash[SHA_HASH_WORDS] = {0};
-    sha_hash(ctx->body, hash, ctx->header.body_size);
+    if (!hashed)
+        sha_hash(ctx->body, hash, ctx->header.body_size);
 
     u32* h1 = ctx->header.body_hash;
     u32* h2 = hash;
@@ -816,7 +888,7 @@ u32 ancast_plugin_load(uintptr_t base, const char* fn_plugin, const char* plugin
     return (u32)base + ancast_plugin_size(base);
 }
 
-// Copy DATA segment into carveout from memory
+// Copy DATA segment into carveout from memory, returns 0 if the copy failed
 u32 ancast_plugin_data_copy(uintptr_t base, const uint8_t* p_data, uint32_t data_size)
 {
     u8* plugin_base = (u8*)base; // TODO dynamic
@@ -827,7 +899,10 @@ u32 ancast_plugin_data_copy(uintptr_t base, const uint8_t* p_data, uint32_t data
     write32(base, IPX_DATA_MAGIC);
     ehdr->e_entry = IPX_NORMAL_EHDR_SIZE;
 
-    memcpy(plugin_base + IPX_DATA_START, p_data, data_size);
+    if(dma_memcpy(plugin_base + IPX_DATA_START, p_data, data_size)) {
+        printf("ancast: failed to copy data to %08x\n", base);
+        return 0;
+    }
     write8(plugin_base + IPX_DATA_START + data_size, 0);
 
     printf("ancast: loading data to %08x\n", base);
@@ -886,6 +961,8 @@ static u32 ancast_load_red_partitions(uintptr_t plugin_base){
     }
 
     uintptr_t plugin_next = ancast_plugin_data_copy(plugin_base, (uint8_t*)&rednand, sizeof(rednand));
+    if(!plugin_next)
+        return 0;
     prsh_set_entry("rednand", (void*)(plugin_base+IPX_DATA_START), sizeof(rednand_config));
 
     return plugin_next;
@@ -953,6 +1030,8 @@ int ancast_plugins_load(const char* plugins_fpath, bool rednand)
             return -3;
         }
         ancast_plugin_next = ancast_plugin_data_copy(ancast_plugin_next, (u8*)o, sizeof(*o));
+        if(!ancast_plugin_next)
+            return -4;
         prsh_set_entry("otp", (void*)(config_plugin_base+IPX_DATA_START), sizeof(*o));
     }
 
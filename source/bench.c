@@ -0,0 +1,333 @@
+/*
+ *  minute - a port of the "mini" IOS replacement for the Wii U.
+ *
+ *  Copyright (C) 2016          SALT
+ *  Copyright (C) 2016          Daz Jones <daz@dazzozo.com>
+ *
+ *  This code is licensed to you under the terms of the GNU GPL, version 2;
+ *  see file COPYING or http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt
+ */
+
+#ifndef MINUTE_BOOT1
+
+#include "bench.h"
+#include "types.h"
+#include "utils.h"
+#include "gfx.h"
+#include "latte.h"
+#include "irq.h"
+#include "menu.h"
+#include "console.h"
+#include "crypto.h"
+#include "sha.h"
+#include "nand.h"
+#include "sdcard.h"
+#include "sdmmc.h"
+#include "mlc.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+
+// LT_TIMER ticks per second.
+#define BENCH_TICKS_PER_SEC     IRQ_ALARM_MS2REG(1000)
+
+// Every measurement moves about this much data, split into calls of the tested size.
+#define BENCH_RUN_BYTES         (0x200000)
+
+// Storage the benchmarks read. The SD card write benchmark writes back what it
+// read from there, so the card contents stay the same.
+#define BENCH_NAND_PAGE         (0x8000)
+#define BENCH_SD_SECTOR         (0x10000)
+#define BENCH_MLC_SECTOR        (0)
+
+typedef int (*bench_fn)(u8* buf, u32 size);
+
+static const u32 bench_default_sizes[] = { 0x1000, 0x10000, 0x100000 };
+
+static FILE* bench_csv = NULL;
+static u8 bench_ecc[ECC_BUFFER_ALLOC] ALIGNED(NAND_DATA_ALIGN);
+
+// NIST SP 800-38A F.2.1, CBC-AES128, first two blocks.
+static const u8 bench_aes_key[16] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+static const u8 bench_aes_iv[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+};
+static const u8 bench_aes_plain[32] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+};
+static const u8 bench_aes_cipher[32] = {
+    0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+    0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+};
+
+static void bench_report(const char* test, u32 size, u32 calls, u32 ticks, const char* result)
+{
+    u32 kib_s = 0;
+    if(ticks)
+        kib_s = (u32)(((u64)size * calls * BENCH_TICKS_PER_SEC) / ((u64)ticks * 1024));
+
+    printf("%-10s %8lu %6lu %10lu %8lu KiB/s  %s\n", test, size, calls, ticks, kib_s, result);
+    if(bench_csv)
+        fprintf(bench_csv, "%s,%lu,%lu,%lu,%lu,%s\n", test, size, calls, ticks, kib_s, result);
+}
+
+static void bench_aes_load(void)
+{
+    aes_reset();
+    aes_set_key((u8*)bench_aes_key);
+    aes_set_iv((u8*)bench_aes_iv);
+}
+
+// Known answers for all three AES modes, the chaining of the second block included.
+static int bench_kat_aes(void)
+{
+    static u8 buf[2][32] ALIGNED(64);
+
+    memcpy(buf[0], bench_aes_plain, sizeof(buf[0]));
+    bench_aes_load();
+    aes_encrypt(buf[0], buf[0], 2, 0);
+    if(memcmp(buf[0], bench_aes_cipher, sizeof(buf[0])))
+        return -1;
+
+    bench_aes_load();
+    aes_decrypt(buf[0], buf[0], 2, 0);
+    if(memcmp(buf[0], bench_aes_plain, sizeof(buf[0])))
+        return -2;
+
+    memset(buf[1], 0, sizeof(buf[1]));
+    aes_copy(buf[0], buf[1], 2);
+    if(memcmp(buf[1], bench_aes_plain, sizeof(buf[1])))
+        return -3;
+
+    return 0;
+}
+
+static int bench_aes_encrypt(u8* buf, u32 size)
+{
+    aes_encrypt(buf, buf, size / 16, 0);
+    return 0;
+}
+
+static int bench_aes_decrypt(u8* buf, u32 size)
+{
+    aes_decrypt(buf, buf, size / 16, 0);
+    return 0;
+}
+
+static int bench_aes_copy(u8* buf, u32 size)
+{
+    aes_copy(buf, buf, size / 16);
+    return 0;
+}
+
+static int bench_sha(u8* buf, u32 size)
+{
+    u8 hash[SHA_HASH_SIZE];
+    sha_hash(buf, hash, size);
+    return 0;
+}
+
+static int bench_nand_read(u8* buf, u32 size)
+{
+    for(u32 p = 0; p < size / PAGE_SIZE; p++) {
+        if(nand_read_page(BENCH_NAND_PAGE + p, buf + p * PAGE_SIZE, bench_ecc) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int bench_sd_read(u8* buf, u32 size)
+{
+    return sdcard_read(BENCH_SD_SECTOR, size / SDMMC_DEFAULT_BLOCKLEN, buf);
+}
+
+static int bench_sd_write(u8* buf, u32 size)
+{
+    return sdcard_write(BENCH_SD_SECTOR, size / SDMMC_DEFAULT_BLOCKLEN, buf);
+}
+
+static int bench_mlc_read(u8* buf, u32 size)
+{
+    return mlc_read(BENCH_MLC_SECTOR, size / SDMMC_DEFAULT_BLOCKLEN, buf);
+}
+
+// Calls fn with the same size until BENCH_RUN_BYTES went through.
+static int bench_time(const char* test, bench_fn fn, u8* buf, u32 size, u32 align)
+{
+    if(size % align) {
+        bench_report(test, size, 0, 0, "skipped");
+        return 0;
+    }
+
+    u32 calls = max(BENCH_RUN_BYTES / size, (u32)1);
+    u32 start = read32(LT_TIMER);
+    for(u32 i = 0; i < calls; i++) {
+        if(fn(buf, size)) {
+            bench_report(test, size, i, read32(LT_TIMER) - start, "error");
+            return -1;
+        }
+    }
+
+    bench_report(test, size, calls, read32(LT_TIMER) - start, "ok");
+    return 0;
+}
+
+static int bench_crypto(u8* buf, const u32* sizes, int count)
+{
+    int failed = 0;
+
+    int res = bench_kat_aes();
+    bench_report("aes-kat", 32, 1, 0, res ? "FAILED" : "passed");
+    if(res) {
+        failed++;
+    } else {
+        bench_aes_load();
+        for(int i = 0; i < count; i++)
+            failed += !!bench_time("aes-enc", bench_aes_encrypt, buf, sizes[i], 16);
+        for(int i = 0; i < count; i++)
+            failed += !!bench_time("aes-dec", bench_aes_decrypt, buf, sizes[i], 16);
+        for(int i = 0; i < count; i++)
+            failed += !!bench_time("aes-copy", bench_aes_copy, buf, sizes[i], 16);
+    }
+
+    res = sha_selftest();
+    bench_report("sha-kat", 0, 1, 0, res ? "FAILED" : "passed");
+    if(res) {
+        failed++;
+    } else {
+        for(int i = 0; i < count; i++)
+            failed += !!bench_time("sha1", bench_sha, buf, sizes[i], 1);
+    }
+
+    return failed;
+}
+
+static int bench_storage(u8* buf, const u32* sizes, int count)
+{
+    int failed = 0;
+
+    nand_initialize(NAND_BANK_SLC);
+    for(int i = 0; i < count; i++)
+        failed += !!bench_time("nand-read", bench_nand_read, buf, sizes[i], PAGE_SIZE);
+
+    if(sdcard_check_card() == SDMMC_NO_CARD) {
+        bench_report("sd", 0, 0, 0, "no card");
+    } else {
+        for(int i = 0; i < count; i++)
+            failed += !!bench_time("sd-read", bench_sd_read, buf, sizes[i], SDMMC_DEFAULT_BLOCKLEN);
+        for(int i = 0; i < count; i++) {
+            // Writes back what's there already.
+            if(sizes[i] % SDMMC_DEFAULT_BLOCKLEN == 0 && bench_sd_read(buf, sizes[i])) {
+                bench_report("sd-write", sizes[i], 0, 0, "error");
+                failed++;
+                continue;
+            }
+            failed += !!bench_time("sd-write", bench_sd_write, buf, sizes[i], SDMMC_DEFAULT_BLOCKLEN);
+        }
+    }
+
+    if(mlc_init()) {
+        bench_report("mlc", 0, 0, 0, "no MLC");
+    } else {
+        for(int i = 0; i < count; i++)
+            failed += !!bench_time("mlc-read", bench_mlc_read, buf, sizes[i], SDMMC_DEFAULT_BLOCKLEN);
+    }
+
+    return failed;
+}
+
+// Runs the known answer tests and benchmarks of the given groups for every size
+// (the defaults if count is 0). The results also go to BENCH_CSV_PATH. Returns
+// the number of failed tests.
+int bench_run(u32 groups, const u32* sizes, int count)
+{
+    u32 max_size = 0;
+    int failed = 0;
+
+    if(!count) {
+        sizes = bench_default_sizes;
+        count = sizeof(bench_default_sizes) / sizeof(bench_default_sizes[0]);
+    }
+    for(int i = 0; i < count; i++)
+        max_size = max(max_size, sizes[i]);
+
+    u8* buf = memalign(64, max(max_size, (u32)PAGE_SIZE));
+    if(!buf) {
+        printf("Out of memory.\n");
+        return -1;
+    }
+    memset(buf, 0x5A, max_size);
+
+    bench_csv = fopen(BENCH_CSV_PATH, "w");
+    if(bench_csv)
+        fprintf(bench_csv, "test,bytes,calls,ticks,kib_per_s,result\n");
+    else
+        printf("Failed to open %s, results are only shown here.\n", BENCH_CSV_PATH);
+
+    printf("test          bytes  calls      ticks    speed\n");
+    if(groups & BENCH_CRYPTO)
+        failed += bench_crypto(buf, sizes, count);
+    if(groups & BENCH_STORAGE)
+        failed += bench_storage(buf, sizes, count);
+
+    if(bench_csv) {
+        fclose(bench_csv);
+        bench_csv = NULL;
+        printf("Results written to %s.\n", BENCH_CSV_PATH);
+    }
+    free(buf);
+
+    if(failed)
+        printf("%d test(s) failed!\n", failed);
+    return failed;
+}
+
+static void bench_menu_run(u32 groups)
+{
+    gfx_clear(GFX_ALL, BLACK);
+    bench_run(groups, NULL, 0);
+    console_power_or_eject_to_return();
+}
+
+static void bench_menu_all(void)
+{
+    bench_menu_run(BENCH_ALL);
+}
+
+static void bench_menu_crypto(void)
+{
+    bench_menu_run(BENCH_CRYPTO);
+}
+
+static void bench_menu_storage(void)
+{
+    bench_menu_run(BENCH_STORAGE);
+}
+
+menu menu_bench = {
+    "minute", // title
+    {
+            "Benchmarks", // subtitles
+    },
+    1, // number of subtitles
+    {
+            {"Run all benchmarks", &bench_menu_all},
+            {"AES and SHA engines", &bench_menu_crypto},
+            {"NAND, SD card and MLC", &bench_menu_storage},
+            {"Return to Main Menu", &menu_close},
+    },
+    4, // number of options
+    0,
+    0
+};
+
+void bench_menu_show(void)
+{
+    menu_init(&menu_bench);
+}
+
+#endif // MINUTE_BOOT1
@@ -0,0 +1,26 @@
+/*
+ *  minute - a port of the "mini" IOS replacement for the Wii U.
+ *
+ *  Copyright (C) 2016          SALT
+ *  Copyright (C) 2016          Daz Jones <daz@dazzozo.com>
+ *
+ *  This code is licensed to you under the terms of the GNU GPL, version 2;
+ *  see file COPYING or http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include "types.h"
+
+#define BENCH_CRYPTO    (1 << 0) // AES and SHA engines
+#define BENCH_STORAGE   (1 << 1) // NAND, SD card and MLC
+#define BENCH_ALL       (BENCH_CRYPTO | BENCH_STORAGE)
+
+#define BENCH_CSV_PATH  "sdmc:/minute_bench.csv"
+
+int bench_run(u32 groups, const u32* sizes, int count);
+
+void bench_menu_show(void);
+
+#endif
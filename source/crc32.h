@@ -46,5 +46,7 @@
 #define __CRC32_H
 
 uint32_t crc32(const void *buf, size_t size);
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t size);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
 
 #endif // __CRC32_H
@@ -22,10 +22,10 @@
 #include "crc32.h"
 #include "serial.h"
 
-#define     AES_CMD_RESET   0
-#define     AES_CMD_DECRYPT 0x9800
-#define     AES_CMD_ENCRYPT 0x9000
-#define     AES_CMD_COPY    0x8000
+#define     AES_CMD_FLAG_IRQ 0x4000
+
+#define     AES_CTRL_EXEC   0x80000000
+#define     AES_CTRL_ERR    0x20000000
 
 otp_t otp;
 seeprom_t seeprom;
@@ -249,40 +249,192 @@ int crypto_encrypt_verify_seeprom_ptr(seeprom_t* pOut, seeprom_t* pSeeprom)
     return crypto_decrypt_verify_seeprom_ptr(&extra_verify, pOut);
 }
 
-static int _aes_irq = 0;
+// Jobs are queued here and run one after another. Each job is split into
+// commands of up to AES_MAX_BLOCKS (AES_MAX_COPY_BLOCKS when copying), aes_irq issues the next command and
+// starts the next job as soon as the current one completes.
+static aes_job *aes_queue_head = NULL;
+static aes_job *aes_queue_tail = NULL;
+
+static void __aes_write_key(const u8 *key)
+{
+    u32 key_tmp[4];
+    memcpy(key_tmp, key, 4*sizeof(u32));
+
+    for(int i = 0; i < 4; i++) {
+        write32(AES_KEY, key_tmp[i]);
+    }
+}
+
+static void __aes_write_iv(const u8 *iv)
+{
+    u32 iv_tmp[4];
+    memcpy(iv_tmp, iv, 4*sizeof(u32));
+
+    for(int i = 0; i < 4; i++) {
+        write32(AES_IV, iv_tmp[i]);
+    }
+}
+
+// Issues the next command of a job, the job's data is flushed already.
+static void __aes_issue(aes_job *job, u32 flags)
+{
+    u32 max_blocks = job->mode == AES_MODE_COPY ? AES_MAX_COPY_BLOCKS : AES_MAX_BLOCKS;
+    u32 blocks = min(job->blocks - job->done, max_blocks);
+    u32 chain = job->keep_iv || job->done;
+
+    if (!job->done) {
+        if (job->key) {
+            write32(AES_CTRL, 0);
+            while (read32(AES_CTRL) != 0);
+            __aes_write_key(job->key);
+        }
+        if (job->iv)
+            __aes_write_iv(job->iv);
+    }
+
+    write32(AES_SRC, dma_addr(job->src + job->done * 16));
+    write32(AES_DEST, dma_addr(job->dst + job->done * 16));
+    job->done += blocks;
+
+    write32(AES_CTRL, ((job->mode | flags) << 16) | (chain ? 0x1000 : 0) | ((blocks - 1) & 0xfff));
+}
+
+// Hands the buffers of a job back to the CPU.
+static void __aes_take(aes_job *job)
+{
+    u32 size = job->blocks * 16;
+
+    if (job->src != job->dst) {
+        dma_take(job->dst, size, DMA_FROM_DEVICE, WB_AES);
+        dma_take(job->src, size, DMA_TO_DEVICE, WB_NONE);
+    } else {
+        dma_take(job->dst, size, DMA_BIDIRECTIONAL, WB_AES);
+    }
+}
 
 void aes_irq(void)
 {
-    _aes_irq = 1;
+    aes_job *job = aes_queue_head;
+    if (!job)
+        return;
+
+    if (read32(AES_CTRL) & AES_CTRL_ERR)
+        job->status = -1;
+
+    if (job->done < job->blocks) {
+        __aes_issue(job, AES_CMD_FLAG_IRQ);
+        return;
+    }
+
+    __aes_take(job);
+
+    if (job->status == AES_JOB_PENDING)
+        job->status = 0;
+
+    aes_queue_head = job->next;
+    if (!aes_queue_head)
+        aes_queue_tail = NULL;
+    else
+        __aes_issue(aes_queue_head, AES_CMD_FLAG_IRQ);
 }
 
-static inline void aes_command(u16 cmd, u8 iv_keep, u32 blocks)
+// Queues a job and returns right away. src and dst have to stay untouched until
+// the job is done, key and iv (if set) until it has started. Jobs run in order,
+// so a job with keep_iv continues the CBC chain of the job before it.
+void aes_submit(aes_job *job)
 {
-    if (blocks != 0)
-        blocks--;
-    _aes_irq = 0;
-    write32(AES_CTRL, (cmd << 16) | (iv_keep ? 0x1000 : 0) | (blocks&0x7f));
-    while (read32(AES_CTRL) & 0x80000000);
+    u32 size = job->blocks * 16;
+
+    job->next = NULL;
+    job->done = 0;
+    job->status = AES_JOB_PENDING;
+
+    if (!job->blocks) {
+        job->status = 0;
+        return;
+    }
+
+    // Once per job: write back what the engine reads, and make sure no cache line of
+    // the destination is written back over the result.
+    if (job->src != job->dst) {
+        dma_give(job->dst, size, DMA_FROM_DEVICE, RB_NONE);
+        dma_give(job->src, size, DMA_TO_DEVICE, RB_AES);
+    } else {
+        dma_give(job->dst, size, DMA_BIDIRECTIONAL, RB_AES);
+    }
+
+#ifdef CAN_HAZ_IRQ
+    if (irq_active()) {
+        u32 cookie = irq_kill();
+        if (aes_queue_tail)
+            aes_queue_tail->next = job;
+        else
+            aes_queue_head = job;
+        aes_queue_tail = job;
+
+        irq_enable(IRQ_AES);
+        if (aes_queue_head == job)
+            __aes_issue(job, AES_CMD_FLAG_IRQ);
+        irq_restore(cookie);
+        return;
+    }
+#endif
+
+    while (job->done < job->blocks) {
+        __aes_issue(job, 0);
+        while (read32(AES_CTRL) & AES_CTRL_EXEC);
+        if (read32(AES_CTRL) & AES_CTRL_ERR)
+            job->status = -1;
+    }
+
+    __aes_take(job);
+
+    if (job->status == AES_JOB_PENDING)
+        job->status = 0;
+}
+
+int aes_poll(aes_job *job)
+{
+    return job->status != AES_JOB_PENDING;
+}
+
+int aes_wait(aes_job *job)
+{
+    while (job->status == AES_JOB_PENDING) {
+        u32 cookie = irq_kill();
+        if (job->status == AES_JOB_PENDING)
+            irq_wait();
+        irq_restore(cookie);
+    }
+    return job->status;
+}
+
+void aes_drain(void)
+{
+    while (aes_queue_head) {
+        u32 cookie = irq_kill();
+        if (aes_queue_head)
+            irq_wait();
+        irq_restore(cookie);
+    }
 }
 
 void aes_reset(void)
 {
+    aes_drain();
     write32(AES_CTRL, 0);
     while (read32(AES_CTRL) != 0);
 }
 
 void aes_set_iv(u8 *iv)
 {
-    u32 iv_tmp[4];
-    memcpy(iv_tmp, iv, 4*sizeof(u32));
-
-    for(int i = 0; i < 4; i++) {
-        write32(AES_IV, iv_tmp[i]);
-    }
+    aes_drain();
+    __aes_write_iv(iv);
 }
 
 void aes_empty_iv(void)
 {
+    aes_drain();
     for(int i = 0; i < 4; i++) {
         write32(AES_IV, 0);
     }
@@ -290,111 +442,80 @@ void aes_empty_iv(void)
 
 void aes_set_key(u8 *key)
 {
-    u32 key_tmp[4];
-    memcpy(key_tmp, key, 4*sizeof(u32));
+    aes_drain();
+    __aes_write_key(key);
+}
 
-    for(int i = 0; i < 4; i++) {
-        write32(AES_KEY, key_tmp[i]);
-    }
+// Synchronous wrappers, using the key and IV that are loaded already.
+static void __aes_run(u16 mode, u8 *src, u8 *dst, u32 blocks, u8 keep_iv)
+{
+    aes_job job = {
+        .src = src,
+        .dst = dst,
+        .blocks = blocks,
+        .mode = mode,
+        .keep_iv = keep_iv,
+    };
+
+    aes_submit(&job);
+    aes_wait(&job);
 }
 
 void aes_decrypt(u8 *src, u8 *dst, u32 blocks, u8 keep_iv)
 {
-    // Kinda have to do both flush/invalidate on both because if you crypt
-    // 1 block, an invalidate will corrupt the periphery memory in the cache
-    // line.
-    dc_flushrange(src, blocks * 16);
-    dc_invalidaterange(src, blocks * 16);
-    dc_flushrange(dst, blocks * 16);
-    dc_invalidaterange(dst, blocks * 16);
-    ahb_flush_to(RB_AES);
-
-    int this_blocks = 0;
-    while(blocks > 0) {
-        this_blocks = blocks;
-        if (this_blocks > 0x80)
-            this_blocks = 0x80;
-
-        write32(AES_SRC, dma_addr(src));
-        write32(AES_DEST, dma_addr(dst));
-
-        aes_command(AES_CMD_DECRYPT, keep_iv, this_blocks);
-
-        blocks -= this_blocks;
-        src += this_blocks<<4;
-        dst += this_blocks<<4;
-        keep_iv = 1;
-    }
-
-    ahb_flush_from(WB_AES);
-    ahb_flush_to(RB_IOD);
-    //dc_flushrange(dst, blocks * 16);
-    //dc_invalidaterange(dst, blocks * 16);
+    __aes_run(AES_MODE_DECRYPT, src, dst, blocks, keep_iv);
 }
 
 void aes_encrypt(u8 *src, u8 *dst, u32 blocks, u8 keep_iv)
 {
-    // Kinda have to do both flush/invalidate on both because if you crypt
-    // 1 block, an invalidate will corrupt the periphery memory in the cache
-    // line.
-    dc_flushrange(src, blocks * 16);
-    dc_invalidaterange(src, blocks * 16);
-    dc_flushrange(dst, blocks * 16);
-    dc_invalidaterange(dst, blocks * 16);
-    ahb_flush_to(RB_AES);
-
-    int this_blocks = 0;
-    while(blocks > 0) {
-        this_blocks = blocks;
-        if (this_blocks > 0x80)
-            this_blocks = 0x80;
-
-        write32(AES_SRC, dma_addr(src));
-        write32(AES_DEST, dma_addr(dst));
-
-        aes_command(AES_CMD_ENCRYPT, keep_iv, this_blocks);
-
-        blocks -= this_blocks;
-        src += this_blocks<<4;
-        dst += this_blocks<<4;
-        keep_iv = 1;
-    }
-
-    ahb_flush_from(WB_AES);
-    ahb_flush_to(RB_IOD);
-    //dc_flushrange(dst, blocks * 16);
-    //dc_invalidaterange(dst, blocks * 16);
+    __aes_run(AES_MODE_ENCRYPT, src, dst, blocks, keep_iv);
 }
 
 void aes_copy(u8 *src, u8 *dst, u32 blocks)
 {
-    // Kinda have to do both flush/invalidate on both because if you crypt
-    // 1 block, an invalidate will corrupt the periphery memory in the cache
-    // line.
-    dc_flushrange(src, blocks * 16);
-    dc_invalidaterange(src, blocks * 16);
-    dc_flushrange(dst, blocks * 16);
-    dc_invalidaterange(dst, blocks * 16);
-    ahb_flush_to(RB_AES);
-
-    int this_blocks = 0;
-    while(blocks > 0) {
-        this_blocks = blocks;
-        if (this_blocks > 0xFFF)
-            this_blocks = 0xFFF;
-
-        write32(AES_SRC, dma_addr(src));
-        write32(AES_DEST, dma_addr(dst));
-
-        aes_command(AES_CMD_COPY, false, this_blocks);
-
-        blocks -= this_blocks;
-        src += this_blocks<<4;
-        dst += this_blocks<<4;
+    __aes_run(AES_MODE_COPY, src, dst, blocks, false);
+}
+
+// Starts copying len bytes with the engine in COPY mode, the CPU is free until
+// dma_memcpy_wait. The engine moves 16 byte blocks between 16 byte aligned
+// addresses, the CPU copies the ends that don't fit that right away. Copies
+// shorter than DMA_MEMCPY_MIN, with src and dst aligned differently or
+// overlapping are done by the CPU completely. Until the copy is done, dst must
+// not be touched and src not be changed.
+void dma_memcpy_start(aes_job *job, void *dst, const void *src, u32 len)
+{
+    u8 *d = dst;
+    const u8 *s = src;
+
+    memset(job, 0, sizeof(*job));
+    job->mode = AES_MODE_COPY;
+
+    if (len >= DMA_MEMCPY_MIN && !(((u32)d ^ (u32)s) & 15) && (d + len <= s || s + len <= d)) {
+        u32 head = -(u32)d & 15;
+        u32 tail = head + ((len - head) & ~15);
+
+        memcpy(d, s, head);
+        memcpy(d + tail, s + tail, len - tail);
+
+        job->src = (u8*)s + head;
+        job->dst = d + head;
+        job->blocks = (tail - head) / 16;
+    } else {
+        memcpy(d, s, len);
     }
 
-    ahb_flush_from(WB_AES);
-    ahb_flush_to(RB_IOD);
-    //dc_flushrange(dst, blocks * 16);
-    //dc_invalidaterange(dst, blocks * 16);
+    aes_submit(job);
+}
+
+int dma_memcpy_wait(aes_job *job)
+{
+    return aes_wait(job);
+}
+
+int dma_memcpy(void *dst, const void *src, u32 len)
+{
+    aes_job job;
+
+    dma_memcpy_start(&job, dst, src, len);
+    return dma_memcpy_wait(&job);
 }
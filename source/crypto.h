@@ -259,6 +259,36 @@ void crypto_decrypt_seeprom(void);
 int crypto_decrypt_verify_seeprom_ptr(seeprom_t* pOut, seeprom_t* pSeeprom);
 int crypto_encrypt_verify_seeprom_ptr(seeprom_t* pOut, seeprom_t* pSeeprom);
 
+// Blocks per AES command. COPY mode can use the whole 12 bit count field.
+#define AES_MAX_BLOCKS      (0x80)
+#define AES_MAX_COPY_BLOCKS (0x1000)
+
+#define AES_MODE_DECRYPT    0x9800
+#define AES_MODE_ENCRYPT    0x9000
+#define AES_MODE_COPY       0x8000
+
+#define AES_JOB_PENDING     1
+
+/* asynchronous jobs, see aes_submit() */
+typedef struct aes_job {
+    struct aes_job *next;
+    u8 *src;
+    u8 *dst;
+    u32 blocks;
+    const u8 *key;  // loaded (after a reset) before the job if set
+    const u8 *iv;   // loaded before the job if set
+    u16 mode;
+    bool keep_iv;   // continue the chain of the previous job instead of using the IV
+    u32 done;
+    volatile int status;
+} aes_job;
+
+void aes_irq(void);
+void aes_submit(aes_job *job);
+int aes_poll(aes_job *job);
+int aes_wait(aes_job *job);
+void aes_drain(void);
+
 void aes_reset(void);
 void aes_set_iv(u8 *iv);
 void aes_empty_iv();
@@ -267,5 +297,12 @@ void aes_decrypt(u8 *src, u8 *dst, u32 blocks, u8 keep_iv);
 void aes_encrypt(u8 *src, u8 *dst, u32 blocks, u8 keep_iv);
 void aes_copy(u8 *src, u8 *dst, u32 blocks);
 
+/* memcpy through the AES engine, see dma_memcpy_start() */
+#define DMA_MEMCPY_MIN  (0x1000)
+
+void dma_memcpy_start(aes_job *job, void *dst, const void *src, u32 len);
+int dma_memcpy_wait(aes_job *job);
+int dma_memcpy(void *dst, const void *src, u32 len);
+
 #endif
 
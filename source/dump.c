@@ -14,7 +14,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <malloc.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
 
@@ -30,6 +32,7 @@
 #include "ancast.h"
 #include "seeprom.h"
 #include "crc32.h"
+#include "manifest.h"
 #include "mbr.h"
 #include "rednand.h"
 #include "ppc.h"
@@ -64,6 +67,9 @@ void dump_set_sata_type_8(void);
 static u8 nand_page_buf[PAGE_SIZE + PAGE_SPARE_SIZE] ALIGNED(NAND_DATA_ALIGN);
 static u8 nand_ecc_buf[ECC_BUFFER_ALLOC] ALIGNED(NAND_DATA_ALIGN);
 
+// Manifest of the image that is being dumped or restored (see manifest.h).
+static manifest dump_mft;
+
 menu menu_dump = {
     "minute", // title
     {
@@ -81,6 +87,8 @@ menu menu_dump = {
             {"Dump factory log", &dump_factory_log},
             {"Dump sys crash logs", &dump_logs_slc},
             {"Dump sys crash logs from redslc", &dump_logs_redslc},
+            {"Restore sys crash logs", &dump_restore_logs_slc},
+            {"Restore sys crash logs to redslc", &dump_restore_logs_redslc},
             {"Format redNAND", &dump_format_rednand},
             {"Restore SLC.RAW", &dump_restore_slc_raw},
             {"Restore SLCCMPT.RAW", &dump_restore_slccmpt_raw},
@@ -94,13 +102,14 @@ menu menu_dump = {
             {"Delete SLCCMPT scfm.img", &_dump_delete_scfm_slccmpt},
             {"Delete redNAND scfm.img", &_dump_delete_scfm_rednand},
             {"Restore redNAND MLC", &dump_restore_rednand},
+            {"Resume redNAND clone/restore", &dump_resume_rednand},
             {"Sync SEEPROM boot1 versions with NAND", &dump_sync_seeprom_boot1_versions},
             {"Set SEEPROM SATA device type", &dump_set_sata_type},
             {"Test SLC and Restore SLC.RAW", &dump_restore_test_slc_raw},
             {"Print SLC superblocks", &dump_print_slc_superblocks},
             {"Return to Main Menu", &menu_close},
     },
-    28, // number of options
+    31, // number of options
     0,
     0
 };
@@ -210,6 +219,19 @@ close_ret:
     console_power_or_eject_to_return();
 }
 
+// Writes the manifest for a small dump file, path is the sdmc:/ path of the file.
+static void _dump_write_manifest(const char* path, const void* data, u32 len)
+{
+    char mft_path[64];
+
+    if(!strncmp(path, "sdmc:/", 6))
+        path += 6;
+    snprintf(mft_path, sizeof(mft_path), "%s.manifest", path);
+
+    if(manifest_write(mft_path, data, len))
+        printf("Failed to write %s.\n", mft_path);
+}
+
 int mandatory_seeprom_otp_backups()
 {
     char tmp[128];
@@ -291,6 +313,7 @@ void dump_seeprom_otp(void)
     }
     fwrite(&otp, 1, sizeof(otp_t), f_otp);
     fclose(f_otp);
+    _dump_write_manifest(otp_path, &otp, sizeof(otp_t));
 
     printf("Dumping SEEPROM to `sdmc:/seeprom.bin`...\n");
     FILE* f_eep = fopen("sdmc:/seeprom.bin", "wb");
@@ -301,6 +324,7 @@ void dump_seeprom_otp(void)
     }
     fwrite(&seeprom, 1, sizeof(seeprom_t), f_eep);
     fclose(f_eep);
+    _dump_write_manifest("sdmc:/seeprom.bin", &seeprom, sizeof(seeprom_t));
 
     if (memcmp(&seeprom, &seeprom_decrypted, sizeof(seeprom)))
     {
@@ -313,6 +337,7 @@ void dump_seeprom_otp(void)
         }
         fwrite(&seeprom_decrypted, 1, sizeof(seeprom_t), f_eep);
         fclose(f_eep);
+        _dump_write_manifest("sdmc:/seeprom_decrypted.bin", &seeprom_decrypted, sizeof(seeprom_t));
     }
 
     printf("\nDone!\n");
@@ -770,88 +795,154 @@ ret:
     console_power_or_eject_to_return();
 }
 
-int _dump_mlc(u32 base)
+// Sectors per command for the MLC <-> SD card copy loops. SDMA is limited to
+// SDHC_BLOCK_COUNT_MAX blocks per command, with ADMA2 on both controllers we can
+// move a lot more per command. Always a power of two, so it divides TOTAL_SECTORS.
+#define MLC_CHUNK_MAX 0x800
+
+static u32 _dump_mlc_chunk(void)
 {
-    sdcard_ack_card();
-    if(sdcard_check_card() != SDMMC_INSERTED) {
-        printf("SD card is not initialized.\n");
+    u32 chunk = min(sdcard_get_max_blocks(), mlc_get_max_blocks());
+    return min(chunk, MLC_CHUNK_MAX);
+}
+
+// Progress journal for the long redNAND operations. It lives on the FAT partition
+// and is updated every few seconds, so an interrupted clone or restore can pick up
+// from the last checkpoint instead of starting over.
+#define JOURNAL_PATH        "rednand.jnl"
+#define JOURNAL_MAGIC       (0x524A4E4C) // RJNL
+#define JOURNAL_OP_CLONE    (1)
+#define JOURNAL_OP_RESTORE  (2)
+#define JOURNAL_SLC         (0)
+#define JOURNAL_SLCCMPT     (1)
+#define JOURNAL_MLC         (2)
+
+#define JOURNAL_SPARSE      (1 << 0)
+#define JOURNAL_VERIFY      (1 << 1)
+
+// How often a failed SD/MLC command is retried before the operation is aborted.
+#define DUMP_MAX_RETRIES    (16)
+
+// Granularity of the empty space detection in sparse mode, in sectors (128 KiB).
+#define SPARSE_CHUNK        (0x100)
+
+typedef struct {
+    u32 sd_base;
+    u32 total;  // in sectors, 0 if not part of the operation
+    u32 done;   // everything below this sector has been copied
+} journal_source;
+
+typedef struct {
+    u32 magic;
+    u32 op;
+    u32 flags;
+    journal_source src[3];
+    u32 crc;
+} rednand_journal;
+
+static rednand_journal journal;
+
+static int _journal_save(void)
+{
+    FIL file;
+    UINT bw = 0;
+
+    journal.magic = JOURNAL_MAGIC;
+    journal.crc = crc32(&journal, offsetof(rednand_journal, crc));
+
+    FRESULT fres = f_open(&file, JOURNAL_PATH, FA_WRITE | FA_OPEN_ALWAYS);
+    if(fres == FR_OK) {
+        fres = f_write(&file, &journal, sizeof(journal), &bw);
+        FRESULT cres = f_close(&file);
+        if(fres == FR_OK) fres = cres;
+    }
+    if(fres != FR_OK || bw != sizeof(journal)) {
+        printf("Failed to update %s (%d).\n", JOURNAL_PATH, fres);
         return -1;
     }
 
-    if(mlc_init())
+    return 0;
+}
+
+static int _journal_load(void)
+{
+    FIL file;
+    UINT br = 0;
+
+    if(f_open(&file, JOURNAL_PATH, FA_READ) != FR_OK)
         return -1;
+    FRESULT fres = f_read(&file, &journal, sizeof(journal), &br);
+    f_close(&file);
 
-    int res = 0, mres = 0, sres = 0;
-    if(base == 0) return -2;
+    if(fres != FR_OK || br != sizeof(journal))
+        return -2;
+    if(journal.magic != JOURNAL_MAGIC || journal.crc != crc32(&journal, offsetof(rednand_journal, crc)))
+        return -3;
+    if(journal.op != JOURNAL_OP_CLONE && journal.op != JOURNAL_OP_RESTORE)
+        return -3;
 
-    // This uses "async" read/write functions, combined with double buffering to achieve a
-    // much faster dump. This works because these are two separate host controllers using DMA.
-    // Instead of running a single command and waiting for completion, we queue both commands
-    // and then wait for them both to complete at the end of each iteration.
-    struct sdmmc_command mlc_cmd = {0}, sdcard_cmd = {0};
+    return 0;
+}
 
-    u8* sector_buf1 = memalign(32, SDMMC_DEFAULT_BLOCKLEN * SDHC_BLOCK_COUNT_MAX);
-    u8* sector_buf2 = memalign(32, SDMMC_DEFAULT_BLOCKLEN * SDHC_BLOCK_COUNT_MAX);
+static void _journal_clear(void)
+{
+    memset(&journal, 0, sizeof(journal));
+    f_unlink(JOURNAL_PATH);
+}
 
-    u8* mlc_buf = sector_buf2;
-    u8* sdcard_buf = sector_buf1;
+int _dump_mlc(u32 base)
+{
+    if(base == 0) return -2;
 
-    // Fill one of the buffers in advance, so SD card has something to work with.
-    do res = mlc_read(0, SDHC_BLOCK_COUNT_MAX, sdcard_buf);
-    while(res);
+    return _dump_copy_rednand(0, 0, base, false);
+}
 
-    // Do one less iteration than we need, due to having to special case the start and end.
-    u32 sdcard_sector = base;
-    for(u32 sector = SDHC_BLOCK_COUNT_MAX; sector < TOTAL_SECTORS; sector += SDHC_BLOCK_COUNT_MAX)
-    {
-        int complete = 0;
-        // Make sure to retry until the command succeeded, probably superfluous but harmless...
-        while(complete != 0b11) {
-            // Issue commands if we didn't already complete them.
-            if(!(complete & 0b01))
-                mres = mlc_start_read(sector, SDHC_BLOCK_COUNT_MAX, mlc_buf, &mlc_cmd);
-            if(!(complete & 0b10))
-                sres = sdcard_start_write(sdcard_sector, SDHC_BLOCK_COUNT_MAX, sdcard_buf, &sdcard_cmd);
+// True if len bytes (a multiple of 32) all equal value.
+static bool _dump_is_uniform(const void* data, u32 len, u8 value)
+{
+    const u32* words = data;
+    const u32 pattern = value * 0x01010101;
 
-            // Only end the command if starting it succeeded.
-            // If starting and ending the command succeeds, mark it as complete.
-            if(!(complete & 0b01) && mres == 0) {
-                mres = mlc_end_read(&mlc_cmd);
-                if(mres == 0) complete |= 0b01;
-            }
-            if(!(complete & 0b10) && sres == 0) {
-                sres = sdcard_end_write(&sdcard_cmd);
-                if(sres == 0) complete |= 0b10;
-            }
-        }
+    for(u32 i = 0; i < len / sizeof(u32); i += 8) {
+        if((words[i] ^ pattern) | (words[i + 1] ^ pattern) | (words[i + 2] ^ pattern) | (words[i + 3] ^ pattern) |
+           (words[i + 4] ^ pattern) | (words[i + 5] ^ pattern) | (words[i + 6] ^ pattern) | (words[i + 7] ^ pattern))
+            return false;
+    }
 
-        // Swap buffers.
-        if(mlc_buf == sector_buf1) {
-            mlc_buf = sector_buf2;
-            sdcard_buf = sector_buf1;
-        } else {
-            mlc_buf = sector_buf1;
-            sdcard_buf = sector_buf2;
-        }
+    return true;
+}
 
-        sdcard_sector += SDHC_BLOCK_COUNT_MAX;
+// Makes [start, end) of the MLC read back as erased. Whole erase groups are erased,
+// the unaligned edges are written with the erased pattern.
+static int _dump_mlc_clear(u32 start, u32 end, u8* fill_buf, u32 chunk)
+{
+    int res = 0;
+    u32 group = mlc_get_erase_group();
+    u32 a = end, b = end;
 
-        if((sector % 0x10000) == 0) {
-            printf("MLC: Sector 0x%08lX completed\n", sector);
-        }
+    if(group) {
+        a = ((start + group - 1) / group) * group;
+        b = (end / group) * group;
+        if(a >= b || mlc_erase_range(a, b - a))
+            a = b = end;
     }
 
-    // Finish up the last iteration.
-    do res = sdcard_write(sdcard_sector, SDHC_BLOCK_COUNT_MAX, sdcard_buf);
-    while(res);
-
-    free(sector_buf1);
-    free(sector_buf2);
+    for(u32 sector = start; sector < end && !res; ) {
+        if(sector == a) {
+            sector = b;
+            continue;
+        }
+        u32 count = min(chunk, (sector < a ? a : end) - sector);
+        int retries = 0;
+        do res = mlc_write(sector, count, fill_buf);
+        while(res && ++retries < DUMP_MAX_RETRIES);
+        sector += count;
+    }
 
-    return 0;
+    return res;
 }
 
-int _dump_restore_mlc(u32 base)
+static int _dump_restore_mlc_from(u32 base, u32 start, bool sparse, bool verify)
 {
     sdcard_ack_card();
     if(sdcard_check_card() != SDMMC_INSERTED) {
@@ -865,62 +956,151 @@ int _dump_restore_mlc(u32 base)
     int res = 0, mres = 0, sres = 0;
     if(base == 0) return -2;
 
+    u32 chunk = _dump_mlc_chunk();
+    start -= start % MANIFEST_CHUNK_SECTORS; // also a multiple of chunk
+
+    memset(&dump_mft, 0, sizeof(dump_mft));
+    if(verify && manifest_verify(&dump_mft, "rednand_mlc.manifest", (u64)TOTAL_SECTORS * SDMMC_DEFAULT_BLOCKLEN,
+                                 (u64)start * SDMMC_DEFAULT_BLOCKLEN)) {
+        printf("MLC: No usable rednand_mlc.manifest, restoring without verification.\n");
+        verify = false;
+    }
+
+    // A manifest chunk is only checked once all of it went through manifest_update,
+    // so each one has to be in a single buffer before any of it is written. Without
+    // ADMA that's more than one command, which the start functions do synchronously.
+    if(verify)
+        chunk = MANIFEST_CHUNK_SECTORS;
+
     // This uses "async" read/write functions, combined with double buffering to achieve a
     // much faster dump. This works because these are two separate host controllers using DMA.
     // Instead of running a single command and waiting for completion, we queue both commands
     // and then wait for them both to complete at the end of each iteration.
     struct sdmmc_command mlc_cmd = {0}, sdcard_cmd = {0};
 
-    u8* sector_buf1 = memalign(32, SDMMC_DEFAULT_BLOCKLEN * SDHC_BLOCK_COUNT_MAX);
-    u8* sector_buf2 = memalign(32, SDMMC_DEFAULT_BLOCKLEN * SDHC_BLOCK_COUNT_MAX);
+    u8* sector_buf1 = memalign(32, SDMMC_DEFAULT_BLOCKLEN * chunk);
+    u8* sector_buf2 = memalign(32, SDMMC_DEFAULT_BLOCKLEN * chunk);
+    u8* fill_buf = NULL;
+    if(!sector_buf1 || !sector_buf2) {
+        printf("Out of memory.\n");
+        res = -8;
+        goto restore_out;
+    }
 
     u8* mlc_buf = sector_buf2;
     u8* sdcard_buf = sector_buf1;
 
+    // In sparse mode, chunks that look like erased MLC space are collected into an
+    // extent [erase_start, erase_end) that gets erased instead of written.
+    u8 erased = mlc_get_erased_value();
+    u32 erase_start = 0, erase_end = 0;
+    u32 skipped = 0;
+    if(sparse) {
+        fill_buf = memalign(32, SDMMC_DEFAULT_BLOCKLEN * chunk);
+        if(fill_buf)
+            memset(fill_buf, erased, SDMMC_DEFAULT_BLOCKLEN * chunk);
+        else
+            sparse = false;
+    }
+
     // Fill one of the buffers in advance, so SD card has something to work with.
-    do res = sdcard_read(base, SDHC_BLOCK_COUNT_MAX, mlc_buf);
-    while(res);
+    int retries = 0;
+    do res = sdcard_read(base + start, chunk, mlc_buf);
+    while(res && ++retries < DUMP_MAX_RETRIES);
+    if(res) {
+        res = -5;
+        goto restore_out;
+    }
 
-    // Read first block from MLC to compare against for safety checks.
-    do res = mlc_read(0, SDHC_BLOCK_COUNT_MAX, sdcard_buf);
-    while(res);
+    if(start == 0) {
+        // Read first block from MLC to compare against for safety checks.
+        retries = 0;
+        do res = mlc_read(0, chunk, sdcard_buf);
+        while(res && ++retries < DUMP_MAX_RETRIES);
+        if(res) {
+            res = -5;
+            goto restore_out;
+        }
 
-    bool allzero = true;
-    for(size_t i = 0; i < SDMMC_DEFAULT_BLOCKLEN * SDHC_BLOCK_COUNT_MAX; i++){
-        if(mlc_buf[i]){
-            allzero = false;
-            break;
+        bool allzero = true;
+        for(size_t i = 0; i < SDMMC_DEFAULT_BLOCKLEN * chunk; i++){
+            if(mlc_buf[i]){
+                allzero = false;
+                break;
+            }
         }
-    }
-    // Check to see if the first block matches, if so, ask the user if they want to continue.
-    if(allzero){
-        printf("MLC: First block is empty, continue restoring?\n");
-    } else if(memcmp(sdcard_buf, mlc_buf, SDMMC_DEFAULT_BLOCKLEN * SDHC_BLOCK_COUNT_MAX) == 0) {
-        printf("MLC: First blocks match, continue restoring?\n");
+        // Check to see if the first block matches, if so, ask the user if they want to continue.
+        if(allzero){
+            printf("MLC: First block is empty, continue restoring?\n");
+        } else if(memcmp(sdcard_buf, mlc_buf, SDMMC_DEFAULT_BLOCKLEN * chunk) == 0) {
+            printf("MLC: First blocks match, continue restoring?\n");
+        } else {
+            printf("MLC: First blocks do not match!\n");
+            printf("MLC: Aborting restore.\n");
+            res = -3;
+            goto restore_out;
+        }
+        if(console_abort_confirmation_power_no_eject_yes()) {
+            res = -4;
+            goto restore_out;
+        }
+        printf("MLC: Continuing restore...\n");
     } else {
-        printf("MLC: First blocks do not match!\n");
-        printf("MLC: Aborting restore.\n");
-        return -3;
+        printf("MLC: Resuming restore at sector 0x%08lX\n", start);
     }
-    if(console_abort_confirmation_power_no_eject_yes()) 
-        return -4;
-    printf("MLC: Continuing restore...\n");
+
+    memset(&journal, 0, sizeof(journal));
+    journal.op = JOURNAL_OP_RESTORE;
+    journal.flags = (sparse ? JOURNAL_SPARSE : 0) | (verify ? JOURNAL_VERIFY : 0);
+    journal.src[JOURNAL_MLC] = (journal_source){ .sd_base = base, .total = TOTAL_SECTORS, .done = start };
+    _journal_save();
 
     // Do one less iteration than we need, due to having to special case the start and end.
-    u32 sdcard_sector = base + SDHC_BLOCK_COUNT_MAX;
-    u32 mlc_sector = 0;
+    u32 sdcard_sector = base + start + chunk;
+    u32 mlc_sector = start;
 
-    while(mlc_sector < (TOTAL_SECTORS - SDHC_BLOCK_COUNT_MAX))
+    while(mlc_sector < (TOTAL_SECTORS - chunk))
     {
         int complete = 0;
-        int retries = 0;
-        // Make sure to retry until the command succeeded, probably superfluous but harmless...
+        int failures = 0;
+        retries = 0;
+
+        if(sparse) {
+            if(_dump_is_uniform(mlc_buf, SDMMC_DEFAULT_BLOCKLEN * chunk, erased)) {
+                if(erase_start == erase_end)
+                    erase_start = erase_end = mlc_sector;
+                erase_end += chunk;
+                skipped += chunk;
+                complete |= 0b10;
+            } else if(erase_start != erase_end) {
+                if(_dump_mlc_clear(erase_start, erase_end, fill_buf, chunk)) {
+                    printf("MLC: Failed to clear 0x%08lX-0x%08lX\n", erase_start, erase_end);
+                    res = -6;
+                    goto restore_out;
+                }
+                erase_start = erase_end = 0;
+            }
+        }
+
+        // Retry until both commands succeeded, but give up on a device that keeps failing.
         while(complete != 0b11) {
             // Issue commands if we didn't already complete them.
             if(!(complete & 0b01))
-                sres = sdcard_start_read(sdcard_sector, SDHC_BLOCK_COUNT_MAX, sdcard_buf, &sdcard_cmd);
+                sres = sdcard_start_read(sdcard_sector, chunk, sdcard_buf, &sdcard_cmd);
+
+            // Check the chunk against the manifest while the SD card reads the next one,
+            // a corrupt chunk must not make it to the MLC. It is a whole manifest chunk
+            // when verifying, so it's checked completely here.
+            if(!failures && manifest_update(&dump_mft, mlc_buf, SDMMC_DEFAULT_BLOCKLEN * chunk)) {
+                if(!(complete & 0b01) && sres == 0)
+                    sdcard_end_read(&sdcard_cmd);
+                printf("MLC: Backup is corrupt at sector 0x%08lX, aborting restore.\n", mlc_sector);
+                res = -7;
+                goto restore_out;
+            }
+
             if(!(complete & 0b10))
-                mres = mlc_start_write(mlc_sector, SDHC_BLOCK_COUNT_MAX, mlc_buf, &mlc_cmd);
+                mres = mlc_start_write(mlc_sector, chunk, mlc_buf, &mlc_cmd);
 
             // Only end the command if starting it succeeded.
             // If starting and ending the command succeeds, mark it as complete.
@@ -933,6 +1113,12 @@ int _dump_restore_mlc(u32 base)
                 if(mres == 0) complete |= 0b10;
             }
 
+            if(complete != 0b11 && ++failures >= DUMP_MAX_RETRIES) {
+                printf("MLC: Giving up on sector 0x%08lX (SD %d, MLC %d)\n", mlc_sector, sres, mres);
+                res = -6;
+                goto restore_out;
+            }
+
             if (retries > 9999999) {
                 printf("MLC: Still working on sector 0x%08lX\n", mlc_sector);
                 retries = 0;
@@ -950,30 +1136,194 @@ int _dump_restore_mlc(u32 base)
             sdcard_buf = sector_buf2;
         }
 
+        sdcard_sector += chunk;
+        mlc_sector += chunk;
+
         if((mlc_sector % 0x10000) == 0) {
             printf("MLC: Sector 0x%08lX written\n", mlc_sector);
+            // A pending extent isn't erased yet.
+            journal.src[JOURNAL_MLC].done = (erase_start != erase_end) ? erase_start : mlc_sector;
+            _journal_save();
         }
-
-        sdcard_sector += SDHC_BLOCK_COUNT_MAX;
-        mlc_sector += SDHC_BLOCK_COUNT_MAX;
     }
 
     // Finish up the last iteration.
-    do res = mlc_write(mlc_sector, SDHC_BLOCK_COUNT_MAX, mlc_buf);
-    while(res);
+    retries = 0;
+    if(manifest_update(&dump_mft, mlc_buf, SDMMC_DEFAULT_BLOCKLEN * chunk)) {
+        printf("MLC: Backup is corrupt at sector 0x%08lX, aborting restore.\n", mlc_sector);
+        res = -7;
+        goto restore_out;
+    }
+    if(sparse && _dump_is_uniform(mlc_buf, SDMMC_DEFAULT_BLOCKLEN * chunk, erased)) {
+        if(erase_start == erase_end)
+            erase_start = erase_end = mlc_sector;
+        erase_end += chunk;
+        skipped += chunk;
+        res = 0;
+    } else {
+        do res = mlc_write(mlc_sector, chunk, mlc_buf);
+        while(res && ++retries < DUMP_MAX_RETRIES);
+    }
+    if(!res && erase_start != erase_end)
+        res = _dump_mlc_clear(erase_start, erase_end, fill_buf, chunk);
+    if(res) {
+        res = -6;
+        goto restore_out;
+    }
+
+    if(sparse)
+        printf("MLC: %lu MiB of empty space erased instead of written\n", skipped / 2048);
+
+    _journal_clear();
 
+restore_out:
+    if(manifest_close(&dump_mft) && !res) {
+        printf("MLC: Restored image doesn't match the manifest!\n");
+        res = -7;
+    }
     free(sector_buf1);
     free(sector_buf2);
+    free(fill_buf);
+
+    return res;
+}
+
+int _dump_restore_mlc(u32 base, bool sparse, bool verify)
+{
+    return _dump_restore_mlc_from(base, 0, sparse, verify);
+}
+
+// A dump file that is written straight to its clusters on the SD card. The file is
+// grown to its final size up front, preferably as one contiguous block, after which
+// the FatFs fast seek link map gives us the LBA of every cluster, so the data area
+// can be filled with large async SD commands instead of going through f_write.
+typedef struct {
+    FIL file;
+    DWORD* clmt;
+} dump_stream;
+
+static int _dump_stream_open(dump_stream* stream, const char* path, u32 size)
+{
+    FRESULT fres;
+    DWORD probe = 1;
+
+    memset(stream, 0, sizeof(*stream));
+
+    fres = f_open(&stream->file, path, FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
+    if(fres != FR_OK) {
+        printf("Failed to open %s (%d).\n", path, fres);
+        return -1;
+    }
+
+    // Reserve a contiguous run of clusters, so there are no FAT updates in the middle
+    // of the stream. If the card is too fragmented for that, seeking past the end in
+    // write mode allocates the cluster chain wherever there is space.
+    fres = f_expand(&stream->file, size, 1);
+    if(fres == FR_DENIED) {
+        printf("No contiguous space for %s, file will be fragmented.\n", path);
+        fres = f_lseek(&stream->file, size);
+        if(fres == FR_OK && f_tell(&stream->file) != size)
+            fres = FR_DENIED;
+    }
+    if(fres == FR_OK)
+        fres = f_sync(&stream->file);
+    if(fres != FR_OK) {
+        f_close(&stream->file);
+        printf("Failed to allocate %s (%d).\n", path, fres);
+        return -2;
+    }
+
+    // Ask for the size of the link map first, then build it.
+    stream->file.cltbl = &probe;
+    f_lseek(&stream->file, CREATE_LINKMAP);
+    stream->clmt = malloc(probe * sizeof(DWORD));
+    if(!stream->clmt) {
+        f_close(&stream->file);
+        return -2;
+    }
+    stream->clmt[0] = probe;
+    stream->file.cltbl = stream->clmt;
+    fres = f_lseek(&stream->file, CREATE_LINKMAP);
+    if(fres != FR_OK) {
+        f_close(&stream->file);
+        free(stream->clmt);
+        printf("Failed to map %s (%d).\n", path, fres);
+        return -2;
+    }
 
     return 0;
 }
 
+static int _dump_stream_close(dump_stream* stream)
+{
+    FRESULT fres = f_close(&stream->file);
+    free(stream->clmt);
+    stream->clmt = NULL;
+
+    return fres;
+}
+
+// Returns the LBA of a file sector and how many sectors follow it contiguously.
+static u32 _dump_stream_lba(dump_stream* stream, u32 sector, u32* run)
+{
+    FATFS* fs = stream->file.fs;
+    u32 cluster = sector / fs->csize;
+    u32 offset = sector % fs->csize;
+
+    for(DWORD* tbl = &stream->clmt[1]; tbl[0]; tbl += 2) {
+        if(cluster < tbl[0]) {
+            *run = (tbl[0] - cluster) * fs->csize - offset;
+            return fs->database + (tbl[1] + cluster - 2) * fs->csize + offset;
+        }
+        cluster -= tbl[0];
+    }
+
+    return 0;
+}
+
+// Starts an async write of count (<= sdcard_get_max_blocks()) file sectors. If the
+// range crosses a fragment boundary, the leading part is written synchronously.
+static int _dump_stream_start_write(dump_stream* stream, u32 sector, u32 count, u8* data, struct sdmmc_command* cmd)
+{
+    while(count) {
+        u32 run = 0;
+        u32 lba = _dump_stream_lba(stream, sector, &run);
+        if(!lba) return -1;
+
+        if(run >= count)
+            return sdcard_start_write(lba, count, data, cmd);
+
+        int res = sdcard_write(lba, run, data);
+        if(res) return res;
+
+        sector += run;
+        count -= run;
+        data += run * SDMMC_DEFAULT_BLOCKLEN;
+    }
+
+    return -1;
+}
+
+static void _dump_slc_read_pages(u32 page_base, u32 page_count, u8* data)
+{
+    for(u32 page = 0; page < page_count; page++)
+    {
+        nand_read_page(page_base + page, nand_page_buf, nand_ecc_buf);
+        nand_correct(page_base + page, nand_page_buf, nand_ecc_buf);
+
+        memcpy(data, nand_page_buf, PAGE_SIZE);
+        memcpy(data + PAGE_SIZE, nand_ecc_buf, PAGE_SPARE_SIZE);
+        data += PAGE_SIZE + PAGE_SPARE_SIZE;
+    }
+}
+
 int _dump_slc_raw(u32 bank, int boot1_only)
 {
-    #define PAGES_PER_ITERATION (0x10)
+    u32 pages_per_iteration;
+    #define PAGES_PER_ITERATION (pages_per_iteration)
     #define TOTAL_ITERATIONS ((boot1_only ? BOOT1_MAX_PAGE : NAND_MAX_PAGE) / PAGES_PER_ITERATION)
-
-    static u8 file_buf[PAGES_PER_ITERATION][PAGE_SIZE + PAGE_SPARE_SIZE];
+    #define ITERATION_SIZE (PAGES_PER_ITERATION * (PAGE_SIZE + PAGE_SPARE_SIZE))
+    #define ITERATION_SECTORS (ITERATION_SIZE / SDMMC_DEFAULT_BLOCKLEN)
 
     sdcard_ack_card();
     if(sdcard_check_card() != SDMMC_INSERTED) {
@@ -981,6 +1331,12 @@ int _dump_slc_raw(u32 bank, int boot1_only)
         return -1;
     }
 
+    // A whole NAND block per SD command if the SD host can take it (ADMA2), the file
+    // is contiguous in most cases so these go out as single large writes.
+    pages_per_iteration = BLOCK_PAGES;
+    if(sdcard_get_max_blocks() < BLOCK_PAGES * (PAGE_SIZE + PAGE_SPARE_SIZE) / SDMMC_DEFAULT_BLOCKLEN)
+        pages_per_iteration = 0x10;
+
     const char* name = NULL;
     switch(bank) {
         case NAND_BANK_SLC: name = "SLC"; break;
@@ -996,50 +1352,96 @@ int _dump_slc_raw(u32 bank, int boot1_only)
         sprintf(path, "BOOT1_%s.RAW", name);
     }
 
-    FIL file = {0}; FRESULT fres = 0; UINT btx = 0;
-    fres = f_open(&file, path, FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
-    if(fres != FR_OK) {
-        printf("Failed to open %s (%d).\n", path, fres);
+    // Both buffers are SD DMA targets, there's no dumping without them.
+    u8* file_buf1 = memalign(32, ITERATION_SIZE);
+    u8* file_buf2 = memalign(32, ITERATION_SIZE);
+    if(!file_buf1 || !file_buf2) {
+        printf("Out of memory.\n");
+        free(file_buf1);
+        free(file_buf2);
+        return -7;
+    }
+
+    dump_stream stream;
+    if(_dump_stream_open(&stream, path, TOTAL_ITERATIONS * ITERATION_SIZE)) {
+        free(file_buf1);
+        free(file_buf2);
         return -3;
     }
 
+    char mft_path[64];
+    sprintf(mft_path, "%s.manifest", path);
+    if(manifest_create(&dump_mft, mft_path, TOTAL_ITERATIONS * ITERATION_SIZE, 0))
+        printf("Failed to create %s, dumping without it.\n", mft_path);
+
     printf("Initializing %s...\n", name);
     nand_initialize(bank);
 
+    // Same double buffering as _dump_mlc: while the SD host writes one buffer,
+    // the NAND controller fills the other one.
+    struct sdmmc_command sdcard_cmd = {0};
+
+    u8* nand_buf = file_buf2;
+    u8* sdcard_buf = file_buf1;
+
+    int res = 0;
+    _dump_slc_read_pages(0, PAGES_PER_ITERATION, sdcard_buf);
+
     for(u32 i = 0; i < TOTAL_ITERATIONS; i++)
     {
         u32 page_base = i * PAGES_PER_ITERATION;
-        for(u32 page = 0; page < PAGES_PER_ITERATION; page++)
-        {
-            nand_read_page(page_base + page, nand_page_buf, nand_ecc_buf);
-            nand_correct(page_base + page, nand_page_buf, nand_ecc_buf);
+        u32 sector = i * ITERATION_SECTORS;
+
+        int sres = _dump_stream_start_write(&stream, sector, ITERATION_SECTORS, sdcard_buf, &sdcard_cmd);
+        manifest_update(&dump_mft, sdcard_buf, ITERATION_SIZE);
 
-            memcpy(file_buf[page], nand_page_buf, PAGE_SIZE);
-            memcpy(file_buf[page] + PAGE_SIZE, nand_ecc_buf, PAGE_SPARE_SIZE);
+        if(i + 1 < TOTAL_ITERATIONS)
+            _dump_slc_read_pages(page_base + PAGES_PER_ITERATION, PAGES_PER_ITERATION, nand_buf);
+
+        if(sres == 0)
+            sres = sdcard_end_write(&sdcard_cmd);
+
+        for(int retry = 0; sres && retry < 3; retry++) {
+            sres = _dump_stream_start_write(&stream, sector, ITERATION_SECTORS, sdcard_buf, &sdcard_cmd);
+            if(sres == 0)
+                sres = sdcard_end_write(&sdcard_cmd);
         }
 
-        fres = f_write(&file, file_buf, sizeof(file_buf), &btx);
-        if(fres != FR_OK || btx != sizeof(file_buf)) {
-            f_close(&file);
-            printf("Failed to write %s (%d).\n", path, fres);
-            return -4;
+        if(sres) {
+            printf("Failed to write %s (%d).\n", path, sres);
+            res = -4;
+            break;
         }
 
-        if((i % 0x100) == 0) {
+        // Swap buffers.
+        u8* tmp = nand_buf;
+        nand_buf = sdcard_buf;
+        sdcard_buf = tmp;
+
+        if((page_base % 0x1000) == 0) {
             printf("%s-RAW: Page 0x%05lX / 0x%05lX completed\n", name, page_base, PAGES_PER_ITERATION * TOTAL_ITERATIONS);
         }
     }
 
-    fres = f_close(&file);
-    if(fres != FR_OK) {
-        printf("Failed to close %s (%d).\n", path, fres);
-        return -5;
+    free(file_buf1);
+    free(file_buf2);
+
+    if(manifest_close(&dump_mft) && !res) {
+        printf("Failed to write %s.\n", mft_path);
+        res = -6;
     }
 
-    return 0;
+    if(_dump_stream_close(&stream) != FR_OK && !res) {
+        printf("Failed to close %s.\n", path);
+        res = -5;
+    }
+
+    return res;
 
     #undef PAGES_PER_ITERATION
     #undef TOTAL_ITERATIONS
+    #undef ITERATION_SIZE
+    #undef ITERATION_SECTORS
 }
 
 void _dump_print_superblocks(int volume){
@@ -1106,6 +1508,43 @@ static u8* dump_get_new_super(FIL *f, isfs_ctx *ctx, bool *same_slots){
     return file_ctx.super;
 }
 
+// Checks all of an image against its manifest. A mismatch only shows once its
+// manifest chunk is complete, several NAND blocks later, so restores do this
+// before they write anything. Returns 1 if there's no usable manifest.
+static int _dump_verify_file(FIL* file, const char* path, u64 size, u8* buf, u32 buf_size)
+{
+    char mft_path[64];
+    sprintf(mft_path, "%s.manifest", path);
+    if(manifest_verify(&dump_mft, mft_path, size, 0)) {
+        printf("No usable %s, restoring without verification.\n", mft_path);
+        return 1;
+    }
+
+    printf("Verifying %s...\n", path);
+    for(u64 pos = 0; pos < size; pos += buf_size) {
+        UINT btx = 0;
+        u32 len = (size - pos < buf_size) ? (u32)(size - pos) : buf_size;
+        FRESULT fres = f_read(file, buf, len, &btx);
+        if(fres != FR_OK || btx != len) {
+            printf("Failed to read %s (%d).\n", path, fres);
+            manifest_close(&dump_mft);
+            return -1;
+        }
+        if(manifest_update(&dump_mft, buf, len)) {
+            printf("%s is corrupt at 0x%llX.\n", path, pos);
+            manifest_close(&dump_mft);
+            return -2;
+        }
+    }
+
+    if(manifest_close(&dump_mft)) {
+        printf("%s doesn't match %s!\n", path, mft_path);
+        return -2;
+    }
+
+    return f_rewind(file) == FR_OK ? 0 : -1;
+}
+
 int _dump_restore_slc_raw(u32 bank, int boot1_only, bool nand_test)
 {
     int ret = 0;
@@ -1193,6 +1632,12 @@ int _dump_restore_slc_raw(u32 bank, int boot1_only, bool nand_test)
 
     u32 total_pages = boot1_only ?(boot1_is_half ? BOOT1_MAX_PAGE/2 : BOOT1_MAX_PAGE) : NAND_MAX_PAGE;
 
+    if(_dump_verify_file(&file, path, nand_file_size, file_buf, FILE_BUF_SIZE) < 0) {
+        f_close(&file);
+        printf("Aborting restore, nothing was written.\n");
+        return -7;
+    }
+
     if(!protect_isfshax){
         printf("Unmounting ISFSs\n");
         isfs_fini();
@@ -1487,7 +1932,8 @@ int _dump_slc_to_sdcard_sectors(u32 base, u32 bank)
     // the number of SD transfer iterations required to complete the SLC dump (0x800)
     #define TOTAL_ITERATIONS (NAND_MAX_PAGE / PAGES_PER_ITERATION)
 
-    static u8 page_buf[PAGES_PER_ITERATION][PAGE_SIZE] ALIGNED(NAND_DATA_ALIGN);
+    static u8 ecc_buf[PAGES_PER_ITERATION][ALIGN_FORWARD(ECC_BUFFER_ALLOC, NAND_DATA_ALIGN)] ALIGNED(NAND_DATA_ALIGN);
+    static nand_request nand_req[PAGES_PER_ITERATION];
 
     sdcard_ack_card();
     if(sdcard_check_card() != SDMMC_INSERTED) {
@@ -1505,21 +1951,63 @@ int _dump_slc_to_sdcard_sectors(u32 base, u32 bank)
         default: return -3;
     }
 
+    // The page reads for the next iteration are queued before the SD write of the
+    // current one, so the NAND controller keeps reading (IRQ driven) while we wait on SD.
+    u8 (*page_buf1)[PAGE_SIZE] = memalign(NAND_DATA_ALIGN, PAGES_PER_ITERATION * PAGE_SIZE);
+    u8 (*page_buf2)[PAGE_SIZE] = memalign(NAND_DATA_ALIGN, PAGES_PER_ITERATION * PAGE_SIZE);
+    if(!page_buf1 || !page_buf2) {
+        printf("Out of memory.\n");
+        free(page_buf1);
+        free(page_buf2);
+        return -4;
+    }
+
+    if(manifest_create(&dump_mft, bank == NAND_BANK_SLC ? "rednand_slc.manifest" : "rednand_slccmpt.manifest",
+                       (u64)NAND_MAX_PAGE * PAGE_SIZE, 0))
+        printf("Failed to create the %s manifest, dumping without it.\n", name);
+
     printf("Initializing %s...\n", name);
     nand_initialize(bank);
 
+    u8 (*nand_buf)[PAGE_SIZE] = page_buf1;
+    u8 (*sdcard_buf)[PAGE_SIZE] = page_buf2;
+
+    for(u32 page = 0; page < PAGES_PER_ITERATION; page++)
+        nand_start_read(page, nand_buf[page], ecc_buf[page], &nand_req[page]);
+
     u32 sdcard_sector = base;
     for(u32 i = 0; i < TOTAL_ITERATIONS; i++)
     {
         u32 page_base = i * PAGES_PER_ITERATION;
         for(u32 page = 0; page < PAGES_PER_ITERATION; page++)
         {
-            nand_read_page(page_base + page, page_buf[page], nand_ecc_buf);
-            nand_correct(page_base + page, page_buf[page], nand_ecc_buf);
+            nand_end_read(&nand_req[page]);
+            nand_correct(page_base + page, nand_buf[page], ecc_buf[page]);
+        }
+
+        // Swap buffers.
+        u8 (*tmp)[PAGE_SIZE] = sdcard_buf;
+        sdcard_buf = nand_buf;
+        nand_buf = tmp;
+
+        if(i + 1 < TOTAL_ITERATIONS) {
+            for(u32 page = 0; page < PAGES_PER_ITERATION; page++)
+                nand_start_read(page_base + PAGES_PER_ITERATION + page, nand_buf[page], ecc_buf[page], &nand_req[page]);
         }
 
-        do res = sdcard_write(sdcard_sector, SECTORS_PER_ITERATION, page_buf);
-        while(res);
+        manifest_update(&dump_mft, sdcard_buf, PAGES_PER_ITERATION * PAGE_SIZE);
+
+        int retries = 0;
+        do res = sdcard_write(sdcard_sector, SECTORS_PER_ITERATION, sdcard_buf);
+        while(res && ++retries < DUMP_MAX_RETRIES);
+
+        if(res) {
+            printf("%s: Failed to write sector 0x%08lX (%d).\n", name, sdcard_sector, res);
+            // the reads of the next iteration are still queued
+            nand_drain();
+            res = -5;
+            break;
+        }
 
         sdcard_sector += SECTORS_PER_ITERATION;
 
@@ -1528,7 +2016,13 @@ int _dump_slc_to_sdcard_sectors(u32 base, u32 bank)
         }
     }
 
-    return 0;
+    free(page_buf1);
+    free(page_buf2);
+
+    if(manifest_close(&dump_mft))
+        printf("Failed to write the %s manifest.\n", name);
+
+    return res;
 
     #undef SECTORS_PER_PAGE
     #undef SECTORS_PER_ITERATION
@@ -1536,7 +2030,294 @@ int _dump_slc_to_sdcard_sectors(u32 base, u32 bank)
     #undef TOTAL_ITERATIONS
 }
 
-int _dump_copy_rednand(u32 slc_base, u32 slccmpt_base, u32 mlc_base)
+// redNAND clone engine. The NAND controller and the MLC host are independent DMA
+// masters, so both keep reading into their own double buffers while the SD host
+// writes out whichever buffer is ready. A finished NAND batch always goes first, so
+// the NAND controller never sits idle; the MLC fills the SD host in between. SLC and
+// SLCCMPT share the NAND controller and are read one after the other.
+
+#define CLONE_NAND_PAGES        (0x40)
+#define CLONE_SECTORS_PER_PAGE  (PAGE_SIZE / SDMMC_DEFAULT_BLOCKLEN)
+#define CLONE_REPORT_TICKS      (10 * 1900000) // ~10 seconds of LT_TIMER
+
+typedef struct {
+    const char* name;
+    u32 bank;
+    u32 sd_base;    // first SD sector of the redNAND partition
+    u32 total;      // in sectors
+    u32 issued;     // sectors whose read has been started
+    u32 written;    // sectors written to the SD card
+    u32 resumed;    // sectors already done by an earlier run
+    u32 skipped;    // sectors left to the pre-erased SD card
+    u64 start;
+    u64 end;
+    manifest* mft;
+} clone_source;
+
+typedef struct {
+    clone_source* src[2];   // SLC, SLCCMPT
+    clone_source* active;   // source the NAND controller is set up for
+    int cur;
+    u8 (*buf[2])[PAGE_SIZE];
+    clone_source* batch_src[2];
+    u32 batch_page[2];
+    int busy[2];
+    int next;               // batches complete in order
+} clone_nand_lane;
+
+typedef struct {
+    clone_source* src;
+    struct sdmmc_command cmd;
+    u8* buf[2];
+    u32 chunk;
+    u32 sector;
+    int fill;
+    int busy;
+    bool sparse;    // skip chunks that match the erased SD card
+    u8 erased;
+    u8* check;      // read back of skipped chunks, SPARSE_CHUNK sectors
+} clone_mlc_lane;
+
+static nand_request clone_nand_req[2][CLONE_NAND_PAGES];
+static u8 clone_nand_ecc[2][CLONE_NAND_PAGES][ALIGN_FORWARD(ECC_BUFFER_ALLOC, NAND_DATA_ALIGN)] ALIGNED(NAND_DATA_ALIGN);
+
+static u64 clone_clock;
+static u32 clone_last_tick;
+
+static manifest clone_mft[3];
+static const char* clone_mft_paths[3] = { "rednand_slc.manifest", "rednand_slccmpt.manifest", "rednand_mlc.manifest" };
+
+// LT_TIMER wraps after ~37 minutes, a full clone takes longer than that.
+static u64 _clone_ticks(void)
+{
+    u32 now = read32(LT_TIMER);
+    clone_clock += now - clone_last_tick;
+    clone_last_tick = now;
+    return clone_clock;
+}
+
+static u32 _clone_kib_per_sec(u32 sectors, u64 ticks)
+{
+    if(!ticks) return 0;
+    return (u32)(((u64)sectors / 2) * 1900000 / ticks);
+}
+
+static int _clone_sd_write(clone_source* src, u32 offset, u32 count, void* data)
+{
+    int res, retries = 0;
+
+    do res = sdcard_write(src->sd_base + offset, count, data);
+    while(res && ++retries < DUMP_MAX_RETRIES);
+
+    if(res)
+        printf("%s: Failed to write SD sector 0x%08lX (%d)\n", src->name, src->sd_base + offset, res);
+
+    return res;
+}
+
+static void _clone_account(clone_source* src, u32 count)
+{
+    src->written += count;
+    if(src->written == src->total) {
+        u32 copied = src->total - src->resumed;
+        src->end = _clone_ticks();
+        printf("%s: done, %lu MiB in %lu s (%lu KiB/s)\n", src->name, copied / 2048,
+               (u32)((src->end - src->start) / 1900000), _clone_kib_per_sec(copied, src->end - src->start));
+        if(src->skipped)
+            printf("%s: %lu MiB of empty space skipped\n", src->name, src->skipped / 2048);
+    }
+}
+
+static int _clone_write(clone_source* src, u32 offset, u32 count, void* data)
+{
+    // The other lanes keep reading while the CPU hashes.
+    manifest_update(src->mft, data, count * SDMMC_DEFAULT_BLOCKLEN);
+
+    int res = _clone_sd_write(src, offset, count, data);
+    if(!res)
+        _clone_account(src, count);
+
+    return res;
+}
+
+// The manifest hashes what was read from the NAND, so a card that didn't erase
+// everything would go unnoticed. Skipped sectors are read back instead.
+static bool _clone_sd_erased(clone_source* src, u32 offset, u32 count, u8* check, u8 erased)
+{
+    return sdcard_read(src->sd_base + offset, count, check) == 0 &&
+           _dump_is_uniform(check, count * SDMMC_DEFAULT_BLOCKLEN, erased);
+}
+
+// Like _clone_write, but only writes the parts that differ from the erased SD card.
+static int _clone_write_sparse(clone_source* src, u32 offset, u32 count, u8* data, u8 erased, u8* check)
+{
+    u32 step = min((u32)SPARSE_CHUNK, count);
+    u32 run = 0, run_len = 0;
+
+    manifest_update(src->mft, data, count * SDMMC_DEFAULT_BLOCKLEN);
+
+    for(u32 i = 0; i < count; i += step) {
+        u32 len = min(step, count - i);
+        if(!_dump_is_uniform(data + i * SDMMC_DEFAULT_BLOCKLEN, len * SDMMC_DEFAULT_BLOCKLEN, erased) ||
+           !_clone_sd_erased(src, offset + i, len, check, erased)) {
+            if(!run_len)
+                run = i;
+            run_len += len;
+            continue;
+        }
+
+        src->skipped += len;
+        if(run_len) {
+            int res = _clone_sd_write(src, offset + run, run_len, data + run * SDMMC_DEFAULT_BLOCKLEN);
+            if(res) return res;
+            run_len = 0;
+        }
+    }
+
+    if(run_len) {
+        int res = _clone_sd_write(src, offset + run, run_len, data + run * SDMMC_DEFAULT_BLOCKLEN);
+        if(res) return res;
+    }
+
+    _clone_account(src, count);
+    return 0;
+}
+
+static void _clone_report(clone_source* srcs, int count)
+{
+    u64 now = _clone_ticks();
+    int active = 0;
+
+    for(int i = 0; i < count; i++) {
+        clone_source* src = &srcs[i];
+        if(!src->total || !src->written || src->written == src->total)
+            continue;
+
+        printf("%s: %3lu%% (%lu KiB/s)  ", src->name, (u32)((u64)src->written * 100 / src->total),
+               _clone_kib_per_sec(src->written - src->resumed, now - src->start));
+        active++;
+    }
+    if(active)
+        printf("\n");
+}
+
+static void _clone_nand_issue(clone_nand_lane* lane, int slot)
+{
+    while(lane->cur < 2 && (!lane->src[lane->cur] || lane->src[lane->cur]->issued == lane->src[lane->cur]->total))
+        lane->cur++;
+    if(lane->cur >= 2)
+        return;
+
+    clone_source* src = lane->src[lane->cur];
+    if(lane->active != src) {
+        printf("Initializing %s...\n", src->name);
+        nand_initialize(src->bank);
+        src->start = _clone_ticks();
+        lane->active = src;
+    }
+
+    u32 page_base = src->issued / CLONE_SECTORS_PER_PAGE;
+    for(u32 page = 0; page < CLONE_NAND_PAGES; page++)
+        nand_start_read(page_base + page, lane->buf[slot][page], clone_nand_ecc[slot][page], &clone_nand_req[slot][page]);
+
+    lane->batch_src[slot] = src;
+    lane->batch_page[slot] = page_base;
+    lane->busy[slot] = 1;
+    src->issued += CLONE_NAND_PAGES * CLONE_SECTORS_PER_PAGE;
+}
+
+static int _clone_nand_ready(clone_nand_lane* lane)
+{
+    int slot = lane->next;
+    if(!lane->busy[slot])
+        return 0;
+
+    for(u32 page = 0; page < CLONE_NAND_PAGES; page++)
+        if(clone_nand_req[slot][page].status == NAND_REQ_PENDING)
+            return 0;
+
+    return 1;
+}
+
+static int _clone_nand_write(clone_nand_lane* lane)
+{
+    int slot = lane->next;
+    u32 page_base = lane->batch_page[slot];
+
+    for(u32 page = 0; page < CLONE_NAND_PAGES; page++) {
+        nand_end_read(&clone_nand_req[slot][page]);
+        nand_correct(page_base + page, lane->buf[slot][page], clone_nand_ecc[slot][page]);
+    }
+
+    // The other batch keeps the NAND controller busy during the SD write.
+    int res = _clone_write(lane->batch_src[slot], page_base * CLONE_SECTORS_PER_PAGE,
+                           CLONE_NAND_PAGES * CLONE_SECTORS_PER_PAGE, lane->buf[slot]);
+
+    lane->busy[slot] = 0;
+    lane->next ^= 1;
+    if(res)
+        return res;
+
+    _clone_nand_issue(lane, slot);
+    return 0;
+}
+
+static void _clone_mlc_issue(clone_mlc_lane* lane)
+{
+    clone_source* src = lane->src;
+    if(!src || lane->busy || src->issued == src->total)
+        return;
+
+    if(src->issued == src->resumed)
+        src->start = _clone_ticks();
+
+    // A failed start is retried by _clone_mlc_write.
+    lane->sector = src->issued;
+    mlc_start_read(lane->sector, lane->chunk, lane->buf[lane->fill], &lane->cmd);
+
+    lane->busy = 1;
+    src->issued += lane->chunk;
+}
+
+static int _clone_mlc_write(clone_mlc_lane* lane)
+{
+    int res = mlc_end_read(&lane->cmd);
+    for(int retries = 0; res && retries < DUMP_MAX_RETRIES; retries++) {
+        res = mlc_start_read(lane->sector, lane->chunk, lane->buf[lane->fill], &lane->cmd);
+        if(!res)
+            res = mlc_end_read(&lane->cmd);
+    }
+
+    lane->busy = 0;
+    if(res) {
+        printf("MLC: Failed to read sector 0x%08lX (%d)\n", lane->sector, res);
+        return res;
+    }
+
+    u8* data = lane->buf[lane->fill];
+    u32 sector = lane->sector;
+
+    // Start reading the next chunk before the SD write of this one.
+    lane->fill ^= 1;
+    _clone_mlc_issue(lane);
+
+    if(lane->sparse)
+        return _clone_write_sparse(lane->src, sector, lane->chunk, data, lane->erased, lane->check);
+
+    return _clone_write(lane->src, sector, lane->chunk, data);
+}
+
+static void _clone_checkpoint(clone_source* srcs)
+{
+    for(int i = 0; i < 3; i++) {
+        journal.src[i].done = srcs[i].written;
+        manifest_sync(srcs[i].mft);
+    }
+    _journal_save();
+}
+
+// Runs (or resumes) the clone described by the journal.
+static int _dump_clone(void)
 {
     sdcard_ack_card();
     if(sdcard_check_card() != SDMMC_INSERTED) {
@@ -1544,26 +2325,165 @@ int _dump_copy_rednand(u32 slc_base, u32 slccmpt_base, u32 mlc_base)
         return -1;
     }
 
-    if(slc_base == 0 && slccmpt_base == 0 && mlc_base == 0) {
-        return -2;
+    if(journal.src[JOURNAL_MLC].total && mlc_init())
+        return -3;
+
+    const char* names[3] = { "SLC", "SLCCMPT", "MLC" };
+    const u32 banks[3] = { NAND_BANK_SLC, NAND_BANK_SLCCMPT, 0 };
+    clone_source srcs[3] = {0};
+
+    clone_nand_lane nand = {0};
+    clone_mlc_lane mlc = {0};
+    mlc.chunk = _dump_mlc_chunk();
+
+    for(int i = 0; i < 3; i++) {
+        journal_source* j = &journal.src[i];
+        // Resume on a manifest chunk, which is a multiple of both batch sizes.
+        u32 align = (i == JOURNAL_MLC) ? mlc.chunk : CLONE_NAND_PAGES * CLONE_SECTORS_PER_PAGE;
+        align = max(align, (u32)MANIFEST_CHUNK_SECTORS);
+
+        srcs[i].name = names[i];
+        srcs[i].bank = banks[i];
+        srcs[i].sd_base = j->sd_base;
+        srcs[i].total = j->total;
+        srcs[i].resumed = j->done - (j->done % align);
+        srcs[i].issued = srcs[i].written = srcs[i].resumed;
+        srcs[i].mft = &clone_mft[i];
+
+        memset(&clone_mft[i], 0, sizeof(manifest));
+        if(srcs[i].total && manifest_create(&clone_mft[i], clone_mft_paths[i], (u64)srcs[i].total * SDMMC_DEFAULT_BLOCKLEN,
+                                            (u64)srcs[i].resumed * SDMMC_DEFAULT_BLOCKLEN))
+            printf("%s: no manifest for this clone.\n", names[i]);
+
+        if(srcs[i].resumed)
+            printf("%s: resuming at sector 0x%08lX\n", names[i], srcs[i].resumed);
     }
 
-    // Dump SLC.
-    if(slc_base != 0) {
-        _dump_slc_to_sdcard_sectors(slc_base, NAND_BANK_SLC);
+    if(srcs[JOURNAL_SLC].total) nand.src[0] = &srcs[JOURNAL_SLC];
+    if(srcs[JOURNAL_SLCCMPT].total) nand.src[1] = &srcs[JOURNAL_SLCCMPT];
+    if(srcs[JOURNAL_MLC].total) mlc.src = &srcs[JOURNAL_MLC];
+
+    int res = 0;
+    for(int i = 0; i < 2; i++) {
+        nand.buf[i] = memalign(NAND_DATA_ALIGN, CLONE_NAND_PAGES * PAGE_SIZE);
+        if(!nand.buf[i]) res = -4;
     }
 
-    // Dump SLCCMPT.
-    if(slccmpt_base != 0) {
-        _dump_slc_to_sdcard_sectors(slccmpt_base, NAND_BANK_SLCCMPT);
+    for(int i = 0; i < 2 && mlc.src; i++) {
+        mlc.buf[i] = memalign(32, mlc.chunk * SDMMC_DEFAULT_BLOCKLEN);
+        if(!mlc.buf[i]) res = -4;
     }
 
-    // Dump MLC.
-    if(mlc_base != 0) {
-        _dump_mlc(mlc_base);
+    if(res) {
+        printf("Out of memory.\n");
+        goto out;
     }
 
-    return 0;
+    // In sparse mode the rest of the MLC partition is erased up front, so empty
+    // chunks don't have to be written at all.
+    if(mlc.src && (journal.flags & JOURNAL_SPARSE)) {
+        clone_source* src = mlc.src;
+        printf("MLC: Erasing redNAND partition...\n");
+
+        mlc.check = memalign(32, SPARSE_CHUNK * SDMMC_DEFAULT_BLOCKLEN);
+        mlc.sparse = mlc.check != NULL;
+        for(u32 sector = src->resumed; sector < src->total && mlc.sparse; sector += 0x100000) {
+            if(sdcard_erase(src->sd_base + sector, min(0x100000u, src->total - sector)))
+                mlc.sparse = false;
+        }
+
+        // Cards either read back zeroes or ones after an erase.
+        if(mlc.sparse && src->resumed < src->total &&
+           sdcard_read(src->sd_base + src->resumed, 1, mlc.buf[0]) == 0 &&
+           _dump_is_uniform(mlc.buf[0], SDMMC_DEFAULT_BLOCKLEN, mlc.buf[0][0])) {
+            mlc.erased = mlc.buf[0][0];
+        } else {
+            mlc.sparse = false;
+        }
+
+        if(!mlc.sparse)
+            printf("MLC: SD card erase not usable, copying everything.\n");
+    }
+
+    clone_clock = 0;
+    clone_last_tick = read32(LT_TIMER);
+    u64 last_report = 0;
+
+    _clone_nand_issue(&nand, 0);
+    _clone_nand_issue(&nand, 1);
+    _clone_mlc_issue(&mlc);
+
+    while(nand.busy[0] || nand.busy[1] || mlc.busy)
+    {
+        if(_clone_nand_ready(&nand) || (!mlc.busy && nand.busy[nand.next]))
+            res = _clone_nand_write(&nand);
+        else if(mlc.busy)
+            res = _clone_mlc_write(&mlc);
+
+        if(res)
+            break;
+
+        if(_clone_ticks() - last_report >= CLONE_REPORT_TICKS) {
+            last_report = clone_clock;
+            _clone_report(srcs, 3);
+            _clone_checkpoint(srcs);
+        }
+    }
+
+    if(res) {
+        // Let queued reads finish before their buffers go away.
+        nand_drain();
+        if(mlc.busy)
+            mlc_end_read(&mlc.cmd);
+        _clone_checkpoint(srcs);
+        printf("redNAND clone interrupted, it can be resumed from the menu.\n");
+        res = -5;
+        goto out;
+    }
+
+    u64 total_ticks = _clone_ticks();
+    u32 total_sectors = 0;
+    for(int i = 0; i < 3; i++)
+        total_sectors += srcs[i].total - srcs[i].resumed;
+    printf("redNAND: cloned %lu MiB in %lu s (%lu KiB/s)\n", total_sectors / 2048,
+           (u32)(total_ticks / 1900000), _clone_kib_per_sec(total_sectors, total_ticks));
+
+    _journal_clear();
+
+out:
+    for(int i = 0; i < 3; i++) {
+        if(manifest_close(&clone_mft[i]) && !res) {
+            printf("Failed to write %s.\n", clone_mft_paths[i]);
+            res = -6;
+        }
+    }
+
+    for(int i = 0; i < 2; i++) {
+        free(nand.buf[i]);
+        free(mlc.buf[i]);
+    }
+    free(mlc.check);
+
+    return res;
+}
+
+int _dump_copy_rednand(u32 slc_base, u32 slccmpt_base, u32 mlc_base, bool sparse)
+{
+    if(slc_base == 0 && slccmpt_base == 0 && mlc_base == 0) {
+        return -2;
+    }
+
+    const u32 slc_sectors = NAND_MAX_PAGE * CLONE_SECTORS_PER_PAGE;
+
+    memset(&journal, 0, sizeof(journal));
+    journal.op = JOURNAL_OP_CLONE;
+    journal.flags = sparse ? JOURNAL_SPARSE : 0;
+    journal.src[JOURNAL_SLC] = (journal_source){ .sd_base = slc_base, .total = slc_base ? slc_sectors : 0 };
+    journal.src[JOURNAL_SLCCMPT] = (journal_source){ .sd_base = slccmpt_base, .total = slccmpt_base ? slc_sectors : 0 };
+    journal.src[JOURNAL_MLC] = (journal_source){ .sd_base = mlc_base, .total = mlc_base ? TOTAL_SECTORS : 0 };
+    _journal_save();
+
+    return _dump_clone();
 }
 
 int _dump_partition_rednand(void)
@@ -1938,8 +2858,13 @@ void dump_format_rednand(void)
     u32 slc_base = LD_DWORD(mbr.partition[2].lba_start);
     u32 slccmpt_base = LD_DWORD(mbr.partition[3].lba_start);
 
+    smc_get_events(); // Eat all existing events
+    printf("Skip empty MLC space? The SD card partition gets erased first and\n");
+    printf("only used areas are copied, which is much faster on a mostly empty MLC.\n");
+    bool sparse = !console_abort_confirmation_power_no_eject_yes();
+
     printf("Dumping redNAND...\n");
-    res = _dump_copy_rednand(slc_base, slccmpt_base, mlc_base);
+    res = _dump_copy_rednand(slc_base, slccmpt_base, mlc_base, sparse);
     if(res) {
         printf("Failed to dump redNAND (%d)!\n", res);
         goto format_exit;
@@ -1994,9 +2919,17 @@ void dump_restore_rednand(void)
     }
 
     smc_get_events(); // Eat all existing events
+    printf("Erase empty space instead of writing it? This is much faster on a mostly\n");
+    printf("empty redNAND, but relies on the MLC erase reading back as empty.\n");
+    bool sparse = !console_abort_confirmation_power_no_eject_yes();
+
+    smc_get_events(); // Eat all existing events
+    printf("Verify against rednand_mlc.manifest? Only do this if redNAND wasn't\n");
+    printf("booted since it was cloned, otherwise the changed data fails to verify.\n");
+    bool verify = !console_abort_confirmation_power_no_eject_yes();
 
     printf("Restoring MLC...\n");
-    res = _dump_restore_mlc(rednand.mlc.lba_start);
+    res = _dump_restore_mlc(rednand.mlc.lba_start, sparse, verify);
     if(res) {
         printf("Failed to restore MLC (%d)!\n", res);
         goto restore_exit;
@@ -2011,6 +2944,84 @@ restore_exit:
     console_power_to_exit();
 }
 
+void dump_resume_rednand(void)
+{
+    int res = 0;
+
+    gfx_clear(GFX_ALL, BLACK);
+    printf("Resuming redNAND...\n");
+
+    res = _journal_load();
+    if(res) {
+        printf("No interrupted redNAND clone or restore found (%d).\n", res);
+        goto resume_exit;
+    }
+
+    const char* names[3] = { "SLC", "SLCCMPT", "MLC" };
+    printf("Interrupted %s:\n", journal.op == JOURNAL_OP_CLONE ? "clone" : "restore");
+    for(int i = 0; i < 3; i++) {
+        if(!journal.src[i].total) continue;
+        printf("  %s: 0x%08lX / 0x%08lX sectors\n", names[i], journal.src[i].done, journal.src[i].total);
+    }
+
+    if(journal.op == JOURNAL_OP_RESTORE) {
+        res = rednand_load_mbr();
+        if(res < 0 || rednand.mlc.lba_start != journal.src[JOURNAL_MLC].sd_base) {
+            printf("redNAND MLC partition doesn't match the journal!\n");
+            goto restore_exit;
+        }
+
+        if(!isfs_slc_has_isfshax_installed() && !crypto_otp_is_de_Fused){
+            printf("MLC restore not allowed!\nNeither ISFShax nor defuse is detected\nMLC restore would brick the consolse.");
+            goto restore_exit;
+        }
+
+        smc_get_events(); // Eat all existing events
+        printf("Continue restoring MLC?\n");
+        if(console_abort_confirmation_power_no_eject_yes())
+            goto restore_exit;
+
+        res = _dump_restore_mlc_from(journal.src[JOURNAL_MLC].sd_base, journal.src[JOURNAL_MLC].done,
+                                     journal.flags & JOURNAL_SPARSE, journal.flags & JOURNAL_VERIFY);
+        if(res)
+            printf("Failed to restore MLC (%d)!\n", res);
+        else
+            printf("redNAND restore complete!\n");
+
+restore_exit:
+        clear_rednand();
+        goto resume_exit;
+    }
+
+    mbr_sector mbr ALIGNED(32) = {0};
+    res = sdcard_read(0, 1, &mbr);
+    if(res) {
+        printf("Failed to read MBR (%d)!\n", res);
+        goto resume_exit;
+    }
+
+    // The partitions are the ones _dump_partition_rednand created.
+    const int partitions[3] = { 2, 3, 1 };
+    for(int i = 0; i < 3; i++) {
+        if(journal.src[i].total && LD_DWORD(mbr.partition[partitions[i]].lba_start) != journal.src[i].sd_base) {
+            printf("redNAND %s partition doesn't match the journal!\n", names[i]);
+            goto resume_exit;
+        }
+    }
+
+    smc_get_events(); // Eat all existing events
+    printf("Continue cloning redNAND?\n");
+    if(console_abort_confirmation_power_no_eject_yes())
+        goto resume_exit;
+
+    res = _dump_clone();
+    if(res)
+        printf("Failed to dump redNAND (%d)!\n", res);
+
+resume_exit:
+    console_power_to_exit();
+}
+
 void dump_otp_via_prshhax(void)
 {
     const u8 key_prod[16] = {0xB5, 0xD8, 0xAB, 0x06, 0xED, 0x7F, 0x6C, 0xFC, 0x52, 0x9F, 0x2C, 0xE1, 0xB4, 0xEA, 0x32, 0xFD};
@@ -2239,11 +3250,15 @@ static void _dump_delete_scfm_rednand(void){
     _dump_delete("redslc:/scfm.img");
 }
 
+#define COPY_BUF_SIZE (0x10000)
+
 int copy_file(const char* from, const char* to){
     int fd_to, fd_from;
-    char buf[4096];
+    // Large and cache line aligned, so the SD side sees multi-sector DMA writes.
+    static char buf[COPY_BUF_SIZE] ALIGNED(32);
     ssize_t nread;
     int saved_errno;
+    struct stat st;
 
     fd_from = open(from, O_RDONLY);
     if (fd_from < 0)
@@ -2253,6 +3268,11 @@ int copy_file(const char* from, const char* to){
     if (fd_to < 0)
         goto out_error;
 
+    // Preallocate the destination, this gets it a contiguous cluster run on sdmc.
+    // On ISFS growing a file writes it, so the data would go to the NAND twice.
+    if (!strncmp(to, "sdmc:", 5) && stat(from, &st) == 0 && st.st_size > 0)
+        ftruncate(fd_to, st.st_size);
+
     while (nread = read(fd_from, buf, sizeof buf), nread > 0)
     {
         char *out_ptr = buf;
@@ -2335,6 +3355,67 @@ static void _copy_dir(const char* dir, const char* dest){
 
 }
 
+// Copies the files in dir over the ones in dest on an ISFS volume. They're
+// committed together, if one of them fails nothing is written.
+static int _restore_dir(const char* dir, const char* dest, int volume){
+    printf("Restoring %s\n", dest);
+
+    DIR *dfd = opendir(dir);
+    if(!dfd){
+        printf("ERROR opening %s: %i\n", dir, errno);
+        return -1;
+    }
+
+    int res = isfs_transaction_begin(volume);
+    if(res){
+        printf("ERROR starting transaction: %i\n", res);
+        closedir(dfd);
+        return -2;
+    }
+
+    if(mkdir(dest, 777) && errno != EEXIST) {
+        printf("ERROR creating %s: %i\n", dest, errno);
+        res = -3;
+    }
+
+    struct dirent *dp;
+    while(!res && (dp = readdir(dfd))){
+        if(dp->d_type == DT_DIR)
+            continue;
+
+        char src_pathbuf[255];
+        snprintf(src_pathbuf, 254, "%s/%s", dir, dp->d_name);
+        char dst_pathbuf[255];
+        snprintf(dst_pathbuf, 254, "%s/%s", dest, dp->d_name);
+
+        printf("Restoring %s\n", dst_pathbuf);
+        if(unlink(dst_pathbuf) && errno != ENOENT) {
+            printf("ERROR deleting %s: %i\n", dst_pathbuf, errno);
+            res = -4;
+        } else if(copy_file(src_pathbuf, dst_pathbuf)) {
+            printf("ERROR copying %s: %i\n", src_pathbuf, errno);
+            res = -5;
+        }
+    }
+
+    closedir(dfd);
+
+    if(res) {
+        isfs_transaction_abort(volume);
+        printf("Nothing was restored.\n");
+        return res;
+    }
+
+    res = isfs_transaction_end(volume);
+    if(res) {
+        printf("ERROR committing %s: %i\n", dest, res);
+        return -6;
+    }
+
+    printf("Restore complete!\n");
+    return 0;
+}
+
 void dump_logs_slc(void){
     gfx_clear(GFX_ALL, BLACK);
     if(isfs_init(ISFSVOL_SLC)<0){
@@ -2366,5 +3447,43 @@ void dump_logs_redslc(void){
     console_power_or_eject_to_return();
 }
 
+void dump_restore_logs_slc(void){
+    gfx_clear(GFX_ALL, BLACK);
+    if(!isfs_slc_has_isfshax_installed() && !crypto_otp_is_de_Fused){
+        printf("SLC write not allowed!\nNeither ISFShax nor defuse is detected\nWriting the SLC could brick the console.\n");
+        console_power_to_continue();
+        return;
+    }
+    if(isfs_init(ISFSVOL_SLC)<0){
+        console_power_to_continue();
+        return;
+    }
+    if (console_abort_confirmation_power_no_eject_yes())
+        return;
+    _restore_dir("sdmc:/logs", "slc:/sys/logs", ISFSVOL_SLC);
+    console_power_or_eject_to_return();
+}
+
+void dump_restore_logs_redslc(void){
+    gfx_clear(GFX_ALL, BLACK);
+    int error = init_rednand();
+    if(error<0){
+        console_power_to_continue();
+        return;
+    }
+    if(!rednand.slc.lba_length){
+        printf("redslc not configured\n");
+        console_power_to_continue();
+        return;
+    }
+
+    if(isfs_init(ISFSVOL_REDSLC)<0){
+        console_power_to_continue();
+        return;
+    }
+    _restore_dir("sdmc:/redlogs", "redslc:/sys/logs", ISFSVOL_REDSLC);
+    console_power_or_eject_to_return();
+}
+
 #endif // FASTBOOT
 #endif // MINUTE_BOOT1
@@ -21,10 +21,10 @@ int _dump_mlc(u32 base);
 int _dump_slc(u32 base, u32 bank);
 int _dump_slc_raw(u32 bank, int boot1_only);
 void dump_erase_mlc(void);
-int _dump_restore_mlc(u32 base);
+int _dump_restore_mlc(u32 base, bool sparse, bool verify);
 
 int _dump_partition_rednand(void);
-int _dump_copy_rednand(u32 slc_base, u32 slccmpt_base, u32 mlc_base);
+int _dump_copy_rednand(u32 slc_base, u32 slccmpt_base, u32 mlc_base, bool sparse);
 
 void dump_slc_raw(void);
 void dump_slccmpt_raw(void);
@@ -42,11 +42,14 @@ void dump_restore_boot1_vwii_img(void);
 void dump_slc(void);
 void dump_format_rednand(void);
 void dump_restore_rednand(void);
+void dump_resume_rednand(void);
 void dump_seeprom_otp(void);
 void dump_espresso(void);
 void dump_factory_log(void);
 void dump_logs_slc(void);
 void dump_logs_redslc(void);
+void dump_restore_logs_slc(void);
+void dump_restore_logs_redslc(void);
 
 void dump_otp_via_prshhax(void);
 
@@ -16,9 +16,41 @@
 #include "sdcard.h"
 #include "sdhc.h"
 #include "utils.h"
+#include "memory.h"
+#include "crypto.h"
 
+// Only used for buffers the SD controller can't DMA to (unaligned or in SRAM),
+// everything else is transferred in place.
 static u8 buffer[SDMMC_DEFAULT_BLOCKLEN * SDHC_BLOCK_COUNT_MAX] ALIGNED(32);
 
+// The bounce copies go through the AES engine only where it is known to reach,
+// the memory the SD controller can DMA to. SRAM and everything in boot1 is
+// copied by the CPU.
+static int disk_copy(void* dst, const void* src, u32 len)
+{
+    if(!can_sdcard_dma_addr((void*)ALIGN_BACKWARD(dst, 32)) ||
+       !can_sdcard_dma_addr((void*)ALIGN_BACKWARD(src, 32))) {
+        memcpy(dst, src, len);
+        return 0;
+    }
+    return dma_memcpy(dst, src, len);
+}
+
+static QWORD bytes_moved = 0;
+static QWORD bytes_bounced = 0;
+
+void disk_get_stats(QWORD* moved, QWORD* bounced)
+{
+    if(moved) *moved = bytes_moved;
+    if(bounced) *bounced = bytes_bounced;
+}
+
+void disk_reset_stats(void)
+{
+    bytes_moved = 0;
+    bytes_bounced = 0;
+}
+
 /*-----------------------------------------------------------------------*/
 /* Get Disk Status                                                       */
 /*-----------------------------------------------------------------------*/
@@ -71,13 +103,24 @@ DRESULT disk_read (
 {
     (void)pdrv;
 
+    bytes_moved += count * SDMMC_DEFAULT_BLOCKLEN;
+
+    if(can_sdcard_dma_addr(buff)) {
+        if(sdcard_read(sector, count, buff) != 0)
+            return RES_ERROR;
+        return RES_OK;
+    }
+
+    bytes_bounced += count * SDMMC_DEFAULT_BLOCKLEN;
+
     while(count) {
         u32 work = min(count, SDHC_BLOCK_COUNT_MAX);
 
         if(sdcard_read(sector, work, buffer) != 0)
             return RES_ERROR;
 
-        memcpy(buff, buffer, work * SDMMC_DEFAULT_BLOCKLEN);
+        if(disk_copy(buff, buffer, work * SDMMC_DEFAULT_BLOCKLEN))
+            return RES_ERROR;
 
         sector += work;
         count -= work;
@@ -103,10 +146,21 @@ DRESULT disk_write (
 {
     (void)pdrv;
 
+    bytes_moved += count * SDMMC_DEFAULT_BLOCKLEN;
+
+    if(can_sdcard_dma_addr((void*)buff)) {
+        if(sdcard_write(sector, count, (void*)buff) != 0)
+            return RES_ERROR;
+        return RES_OK;
+    }
+
+    bytes_bounced += count * SDMMC_DEFAULT_BLOCKLEN;
+
     while(count) {
         u32 work = min(count, SDHC_BLOCK_COUNT_MAX);
 
-        memcpy(buffer, buff, work * SDMMC_DEFAULT_BLOCKLEN);
+        if(disk_copy(buffer, buff, work * SDMMC_DEFAULT_BLOCKLEN))
+            return RES_ERROR;
 
         if(sdcard_write(sector, work, buffer) != 0)
             return RES_ERROR;
@@ -37,6 +37,10 @@ DRESULT disk_read (BYTE pdrv, BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 
+/* Transfer statistics (minute) */
+void disk_get_stats (QWORD* moved, QWORD* bounced);
+void disk_reset_stats (void);
+
 
 /* Disk Status Bits (DSTATUS) */
 
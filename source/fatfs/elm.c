@@ -662,6 +662,14 @@ int _ELM_ftruncate_r(struct _reent* r, void* fd, off_t len)
     FIL* fp = (FIL*) fd;
     int ptr = fp->fptr;
 
+#if _USE_EXPAND
+    // Growing an empty file, try to get a contiguous block for it.
+    if (fp->fsize == 0 && len > 0 && f_expand(fp, len, 1) == FR_OK) {
+        fp->fptr = 0;
+        return 0;
+    }
+#endif
+
     elm_error = f_lseek(fp, len);
 
     if (elm_error != FR_OK)
@@ -216,6 +216,7 @@ FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);    /* Write dat
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf); /* Forward data to the stream */
 FRESULT f_lseek (FIL* fp, DWORD ofs);                               /* Move file pointer of a file object */
 FRESULT f_truncate (FIL* fp);                                       /* Truncate file */
+FRESULT f_expand (FIL* fp, DWORD fsz, BYTE opt);                    /* Allocate a contiguous block to the file */
 FRESULT f_sync (FIL* fp);                                           /* Flush cached data of a writing file */
 FRESULT f_opendir (FDIR* dp, const TCHAR* path);                    /* Open a directory */
 FRESULT f_closedir (FDIR* dp);                                      /* Close an open directory */
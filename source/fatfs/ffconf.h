@@ -15,6 +15,7 @@
 #define _USE_FIND       0
 #define _USE_MKFS       0
 #define _USE_FASTSEEK   1
+#define _USE_EXPAND     0
 #define _USE_LABEL      0
 #define _USE_FORWARD    0
 #define _CODE_PAGE  932
@@ -81,6 +82,11 @@
 /* This option switches fast seek feature. (0:Disable or 1:Enable) */
 
 
+#define _USE_EXPAND     1
+/* This option switches f_expand() function. (0:Disable or 1:Enable)
+/  Backported from R0.12, used to preallocate contiguous dump files. */
+
+
 #define _USE_LABEL      0
 /* This option switches volume label functions, f_getlabel() and f_setlabel().
 /  (0:Disable or 1:Enable) */
@@ -28,6 +28,9 @@ typedef unsigned int    UINT;
 typedef long            LONG;
 typedef unsigned long   DWORD;
 
+/* This type MUST be 64-bit */
+typedef unsigned long long QWORD;
+
 #endif
 
 #endif
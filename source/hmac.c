@@ -6,22 +6,45 @@
 #define HMAC_IPAD   0x36
 #define HMAC_OPAD   0x5C
 
-void hmac_init(hmac_ctx* ctx, const u8* key, int size)
+void hmac_key_init(hmac_key* key_state, const u8* key, int size)
 {
+    u8 pad[SHA_BLOCK_SIZE];
     int i;
 
-    memset(ctx->key, 0, sizeof(ctx->key));
+    memset(pad, 0, sizeof(pad));
 
-    if (size > sizeof(ctx->key))
-        sha_hash(key, ctx->key, size);
+    if (size > sizeof(pad))
+        sha_hash(key, pad, size);
     else
-        memcpy(ctx->key, key, size);
+        memcpy(pad, key, size);
+
+    for (i = 0; i < sizeof(pad); i++)
+        pad[i] ^= HMAC_IPAD;
+
+    sha_init(&key_state->inner);
+    sha_update(&key_state->inner, pad, sizeof(pad));
+
+    for (i = 0; i < sizeof(pad); i++)
+        pad[i] ^= HMAC_IPAD ^ HMAC_OPAD;
+
+    sha_init(&key_state->outer);
+    sha_update(&key_state->outer, pad, sizeof(pad));
+
+    memset(pad, 0, sizeof(pad));
+}
 
-    for (i = 0; i < sizeof(ctx->key); i++)
-        ctx->key[i] ^= HMAC_IPAD;
+void hmac_init_key(hmac_ctx* ctx, const hmac_key* key_state)
+{
+    ctx->hash_ctx = key_state->inner;
+    ctx->outer = key_state->outer;
+}
 
-    sha_init(&ctx->hash_ctx);
-    sha_update(&ctx->hash_ctx, ctx->key, sizeof(ctx->key));
+void hmac_init(hmac_ctx* ctx, const u8* key, int size)
+{
+    hmac_key key_state;
+
+    hmac_key_init(&key_state, key, size);
+    hmac_init_key(ctx, &key_state);
 }
 
 void hmac_update(hmac_ctx* ctx, const void* data, int size)
@@ -32,15 +55,10 @@ void hmac_update(hmac_ctx* ctx, const void* data, int size)
 void hmac_final(hmac_ctx* ctx, u8* hmac)
 {
     u8 hash[SHA_HASH_SIZE];
-    int i;
 
     sha_final(&ctx->hash_ctx, hash);
 
-    for (i = 0; i < sizeof(ctx->key); i++)
-        ctx->key[i] ^= HMAC_IPAD ^ HMAC_OPAD;
-
-    sha_init(&ctx->hash_ctx);
-    sha_update(&ctx->hash_ctx, ctx->key, sizeof(ctx->key));
-    sha_update(&ctx->hash_ctx, hash, sizeof(hash));
-    sha_final(&ctx->hash_ctx, hmac);
+    // The opad block is already in the outer state, only the inner hash is left.
+    sha_update(&ctx->outer, hash, sizeof(hash));
+    sha_final(&ctx->outer, hmac);
 }
@@ -6,11 +6,21 @@
 
 #define HMAC_SIZE   (SHA_HASH_SIZE)
 
+// SHA-1 states after the ipad and opad blocks of a key. They only depend on
+// the key, so they can be computed once and reused for every MAC.
+typedef struct {
+	sha_ctx inner;
+	sha_ctx outer;
+} hmac_key;
+
 typedef struct {
-	u8 key[SHA_BLOCK_SIZE];
 	sha_ctx hash_ctx;
+	sha_ctx outer;
 } hmac_ctx;
 
+void hmac_key_init(hmac_key* key_state, const u8* key, int size);
+void hmac_init_key(hmac_ctx* ctx, const hmac_key* key_state);
+
 void hmac_init(hmac_ctx* ctx, const u8* key, int size);
 void hmac_update(hmac_ctx* ctx, const void* data, int size);
 void hmac_final(hmac_ctx *ctx, u8 *hmac); 
@@ -24,8 +24,11 @@
 #include "ancast.h"
 #include "utils.h"
 #include "sha.h"
+#include "latte.h"
+#include "memory.h"
 #include "asic.h"
 #include "ppc.h"
+#include "bench.h"
 
 #define INTCON_HISTORY_DEPTH (64)
 #define INTCON_COMMAND_MAX_LEN (256)
@@ -103,7 +106,7 @@ void intcon_delete()
 
 void intcon_show_help(void)
 {
-    printf("Valid commands: exit, quit, reset, restart, shutdown, smc, peek, poke, set, clear, help, ?\n");
+    printf("Valid commands: exit, quit, reset, restart, shutdown, smc, peek, poke, set, clear, sha, dma, bench, help, ?\n");
 }
 
 void intcon_smc_cmd(int argc, char** argv)
@@ -502,6 +505,87 @@ void intcon_memory_cmd(int argc, char** argv)
     }
 }
 
+// Checks both SHA-1 paths and times them, to pick the software/engine threshold.
+void intcon_sha_cmd(int argc, char** argv)
+{
+    if (argc >= 3 && !strcmp(argv[1], "threshold")) {
+        u32 old = sha_set_hw_threshold(strtoul(argv[2], NULL, 0));
+        printf("SHA-1 engine threshold: %lu -> %lu blocks\n", old, strtoul(argv[2], NULL, 0));
+        return;
+    }
+
+    printf("SHA-1 self test: %s\n", sha_selftest() ? "FAILED" : "passed");
+
+    const u32 sizes[] = { 64, 256, 1024, 4096, 16384, 65536 };
+    const u32 max_size = 65536;
+    u8* buf = memalign(64, max_size);
+    u8 hash[SHA_HASH_SIZE];
+    if (!buf) {
+        printf("Out of memory.\n");
+        return;
+    }
+    memset(buf, 0x5A, max_size);
+
+    printf("   bytes   engine ticks  software ticks\n");
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        u32 ticks[2];
+        for (int sw = 0; sw < 2; sw++) {
+            u32 old = sha_set_hw_threshold(sw ? ~0 : 0);
+            u32 start = read32(LT_TIMER);
+            for (int rep = 0; rep < 16; rep++)
+                sha_hash(buf, hash, sizes[i]);
+            ticks[sw] = (read32(LT_TIMER) - start) / 16;
+            sha_set_hw_threshold(old);
+        }
+        printf("%8lu  %13lu  %14lu\n", sizes[i], ticks[0], ticks[1]);
+    }
+
+    free(buf);
+}
+
+// Shows how much cache maintenance the DMA users did since the last reset.
+void intcon_dma_cmd(int argc, char** argv)
+{
+    if (argc >= 2 && !strcmp(argv[1], "reset")) {
+        dma_stats_reset();
+        return;
+    }
+
+    printf("gives %lu, takes %lu\n", dma_counters.gives, dma_counters.takes);
+    printf("cleaned %lu bytes, invalidated %lu bytes, skipped %lu bytes\n",
+           dma_counters.clean_bytes, dma_counters.inval_bytes, dma_counters.skipped_bytes);
+    printf("whole cache flushes %lu, AHB flushes %lu\n", dma_counters.full_flushes, dma_counters.ahb_flushes);
+}
+
+// bench [all|crypto|storage] [sizes...], the sizes default to 4K, 64K and 1M.
+void intcon_bench_cmd(int argc, char** argv)
+{
+    u32 groups = BENCH_ALL;
+    u32 sizes[16];
+    int count = 0;
+    int i = 1;
+
+    if (argc >= 2) {
+        if (!strcmp(argv[1], "all"))
+            i++;
+        else if (!strcmp(argv[1], "crypto"))
+            groups = BENCH_CRYPTO, i++;
+        else if (!strcmp(argv[1], "storage"))
+            groups = BENCH_STORAGE, i++;
+    }
+
+    for (; i < argc && count < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        sizes[count] = strtoul(argv[i], NULL, 0);
+        if (!sizes[count]) {
+            printf("Usage: bench [all|crypto|storage] [sizes...]\n");
+            return;
+        }
+        count++;
+    }
+
+    bench_run(groups, sizes, count);
+}
+
 int intcon_upload(const char* fpath)
 {
     u8 serial_tmp[256];
@@ -706,6 +790,15 @@ void intcon_handle_cmd(const char* pCmd)
              || !strcmp(cmd, "abifr") || !strcmp(cmd, "abifw")) {
         intcon_memory_cmd(argc, argv);
     }
+    else if (!strcmp(cmd, "sha")) {
+        intcon_sha_cmd(argc, argv);
+    }
+    else if (!strcmp(cmd, "dma")) {
+        intcon_dma_cmd(argc, argv);
+    }
+    else if (!strcmp(cmd, "bench")) {
+        intcon_bench_cmd(argc, argv);
+    }
     else if (!strcmp(cmd, "ppctest")) {
         if (argc < 2) {
             printf("Usage: ppctest <mask>\n");
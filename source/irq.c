@@ -20,9 +20,11 @@
 #include "nand.h"
 #include "sdcard.h"
 #include "mlc.h"
+#include "sha.h"
 #include "serial.h"
 
 static u32 _alarm_frequency = 0;
+static int _irq_active = 0;
 
 void irq_setup_stack(void);
 
@@ -41,10 +43,12 @@ void irq_initialize(void)
     write32(LT_ERROR_MASK, 0);
 
     write32(LT_ALARM, 0);
+    _irq_active = 1;
 }
 
 void irq_shutdown(void)
 {
+    _irq_active = 0;
     write32(LT_INTMR_AHBALL_ARM, 0);
     write32(LT_INTSR_AHBALL_ARM, 0xffffffff);
     write32(LT_INTMR_AHBLT_ARM, 0);
@@ -52,6 +56,12 @@ void irq_shutdown(void)
     irq_kill();
 }
 
+// Whether IRQs are set up, drivers fall back to polling otherwise.
+int irq_active(void)
+{
+    return _irq_active;
+}
+
 void irq_handler(void)
 {
 #ifdef MINUTE_BOOT1
@@ -98,12 +108,14 @@ void irq_handler(void)
         write32(LT_INTSR_AHBALL_ARM, IRQF_RESET);
     }*/
     if(all_mask & IRQF_SHA1) {
-        printf("IRQ: SHA1\n");
+//      printf("IRQ: SHA1\n");
         write32(LT_INTSR_AHBALL_ARM, IRQF_SHA1);
+        sha_irq();
     }
     if(all_mask & IRQF_AES) {
 //      printf("IRQ: AES\n");
         write32(LT_INTSR_AHBALL_ARM, IRQF_AES);
+        aes_irq();
     }
     if(all_mask & IRQF_SD0) {
 //      printf("IRQ: SD0\n");
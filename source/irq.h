@@ -62,6 +62,7 @@
 
 void irq_initialize(void);
 void irq_shutdown(void);
+int irq_active(void);
 
 void irq_enable(u32 irq);
 void irq_disable(u32 irq);
@@ -40,6 +40,10 @@
 static u8 slc_cluster_buf[CLUSTER_SIZE] ALIGNED(NAND_DATA_ALIGN);
 static u8 ecc_buf[ECC_BUFFER_ALLOC] ALIGNED(NAND_DATA_ALIGN);
 
+// two clusters worth of queued page reads, see isfs_read_volume
+static nand_request isfs_nand_req[2][CLUSTER_PAGES];
+static u8 isfs_ecc_bufs[2][CLUSTER_PAGES][ALIGN_FORWARD(ECC_BUFFER_ALLOC, NAND_DATA_ALIGN)] ALIGNED(NAND_DATA_ALIGN);
+
 static bool initialized = false;
 
 isfs_ctx isfs[4] = {
@@ -108,11 +112,24 @@ static int _isfs_super_check_slot(isfs_ctx *ctx, u32 index)
     return 0;
 }
 
-static int _isfs_decrypt_cluster(const isfs_ctx* ctx, u8 *cluster_data){
-    aes_reset();
-    aes_set_key((u8*)ctx->aes);
-    aes_empty_iv();
-    aes_decrypt(cluster_data, cluster_data, CLUSTER_SIZE / ISFSAES_BLOCK_SIZE, 0);  
+static const u8 isfs_aes_iv[ISFSAES_BLOCK_SIZE] ALIGNED(4) = {0};
+
+// Queues the en- or decryption of count bytes, every cluster is its own CBC chain.
+static void _isfs_start_crypt(const isfs_ctx* ctx, u16 mode, u8 *src, u8 *dst, u32 count, bool new_cluster, aes_job *job){
+    *job = (aes_job) {
+        .src = src,
+        .dst = dst,
+        .blocks = count / ISFSAES_BLOCK_SIZE,
+        .key = new_cluster ? (const u8*)ctx->aes : NULL,
+        .iv = new_cluster ? isfs_aes_iv : NULL,
+        .mode = mode,
+        .keep_iv = !new_cluster,
+    };
+    aes_submit(job);
+}
+
+static void _isfs_start_decrypt(const isfs_ctx* ctx, u8 *data, u32 count, bool new_cluster, aes_job *job){
+    _isfs_start_crypt(ctx, AES_MODE_DECRYPT, data, data, count, new_cluster, job);
 }
 
 static int _isfs_read_sd(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count, u32 flags, void *data){
@@ -130,9 +147,15 @@ static int _isfs_read_sd(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_cou
         return -1;
 
     if(flags & ISFSVOL_FLAG_ENCRYPTED){
-        for (int p = 0; p < cluster_count; p++){
-            _isfs_decrypt_cluster(ctx, data + p * CLUSTER_SIZE);
+        // queue all clusters at once, the engine goes through them back to back
+        static aes_job jobs[8];
+        for (u32 p = 0; p < cluster_count; p++){
+            aes_job *job = &jobs[p % 8];
+            if (p >= 8)
+                aes_wait(job);
+            _isfs_start_decrypt(ctx, data + p * CLUSTER_SIZE, CLUSTER_SIZE, true, job);
         }
+        aes_drain();
     }
     return 0;
 }
@@ -160,6 +183,127 @@ static int _nand_read_page_rawfile(u32 pageno, void *data, void *ecc, FIL* file)
 #endif //MINUTE_BOOT1
 }
 
+static void _isfs_start_cluster_read(u32 cluster, u8 *cluster_data, int slot)
+{
+    for (u32 p = 0; p < CLUSTER_PAGES; p++)
+    {
+        // make sure ECC fails, if read did nothing
+        memset(isfs_ecc_bufs[slot][p], 0, ECC_BUFFER_ALLOC);
+        nand_start_read(cluster * CLUSTER_PAGES + p, &cluster_data[p * PAGE_SIZE],
+                isfs_ecc_bufs[slot][p], &isfs_nand_req[slot][p]);
+    }
+}
+
+// Decrypted file clusters, keyed by volume and cluster. Sequential reads fetch
+// the next clusters of the FAT chain ahead, as long as they are contiguous, so
+// they come in with one isfs_read_volume.
+#define ISFS_CACHE_CLUSTERS     16
+#define ISFS_CACHE_READAHEAD    4
+
+static struct {
+    int volume; // -1 if unused
+    u16 cluster;
+    u32 used;   // isfs_cache_tick of the last hit, 0 if unused
+} isfs_cache[ISFS_CACHE_CLUSTERS];
+static u8* isfs_cache_data = NULL;
+static u32 isfs_cache_tick = 0;
+
+static void _isfs_cache_drop(int i)
+{
+    isfs_cache[i].volume = -1;
+    isfs_cache[i].used = 0;
+}
+
+// Forgets the cached clusters of a volume in [start, start + count), or all of
+// them if count is 0.
+static void _isfs_cache_invalidate(int volume, u32 start, u32 count)
+{
+    if(!isfs_cache_data)
+        return;
+
+    for(int i = 0; i < ISFS_CACHE_CLUSTERS; i++) {
+        if(isfs_cache[i].volume != volume)
+            continue;
+        if(!count || (isfs_cache[i].cluster >= start && isfs_cache[i].cluster < start + count))
+            _isfs_cache_drop(i);
+    }
+}
+
+static int _isfs_cache_find(int volume, u16 cluster)
+{
+    for(int i = 0; i < ISFS_CACHE_CLUSTERS; i++)
+        if(isfs_cache[i].volume == volume && isfs_cache[i].cluster == cluster)
+            return i;
+    return -1;
+}
+
+// Picks count neighbouring slots for a run of clusters, the ones whose newest
+// entry was used longest ago.
+static int _isfs_cache_victims(u32 count)
+{
+    int best = 0;
+    u32 best_used = ~0;
+
+    for(int i = 0; i + count <= ISFS_CACHE_CLUSTERS; i++) {
+        u32 used = 0;
+        for(u32 j = 0; j < count; j++)
+            used = max(used, isfs_cache[i + j].used);
+        if(used < best_used) {
+            best_used = used;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Returns the decrypted cluster, reading it (and with readahead the clusters that
+// follow it on the NAND and in the chain) on a miss. The data stays valid until
+// the next call.
+static u8* _isfs_cache_get(isfs_ctx* ctx, u16 cluster, bool readahead)
+{
+    if(!isfs_cache_data) {
+        isfs_cache_data = memalign(NAND_DATA_ALIGN, ISFS_CACHE_CLUSTERS * CLUSTER_SIZE);
+        for(int i = 0; i < ISFS_CACHE_CLUSTERS; i++)
+            _isfs_cache_drop(i);
+    }
+
+    if(!isfs_cache_data) {
+        if(isfs_read_volume(ctx, cluster, 1, ISFSVOL_FLAG_ENCRYPTED, NULL, slc_cluster_buf) < 0)
+            return NULL;
+        return slc_cluster_buf;
+    }
+
+    int i = _isfs_cache_find(ctx->volume, cluster);
+    if(i < 0) {
+        u16* fat = _isfs_get_fat(ctx);
+        u32 count = 1;
+
+        if(readahead) {
+            while(count < ISFS_CACHE_READAHEAD && fat[cluster + count - 1] == cluster + count &&
+                  _isfs_cache_find(ctx->volume, cluster + count) < 0)
+                count++;
+        }
+
+        i = _isfs_cache_victims(count);
+        for(u32 j = 0; j < count; j++)
+            _isfs_cache_drop(i + j);
+
+        if(isfs_read_volume(ctx, cluster, count, ISFSVOL_FLAG_ENCRYPTED, NULL, isfs_cache_data + i * CLUSTER_SIZE) < 0)
+            return NULL;
+
+        for(u32 j = 0; j < count; j++) {
+            isfs_cache[i + j].volume = ctx->volume;
+            isfs_cache[i + j].cluster = cluster + j;
+            // the read ahead ones go first, unless they are used
+            isfs_cache[i + j].used = j ? 1 : ++isfs_cache_tick;
+        }
+    } else {
+        isfs_cache[i].used = ++isfs_cache_tick;
+    }
+
+    return isfs_cache_data + i * CLUSTER_SIZE;
+}
+
 int isfs_read_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count, u32 flags, void *hmac_seed, void *data)
 {
     if(ctx->bank & 0x80000000) {
@@ -179,25 +323,48 @@ int isfs_read_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count,
     bool hmac_partial = false;
     bool nand_error = false;
 
-    /* read all requested clusters */
+    bool encrypted = flags & ISFSVOL_FLAG_ENCRYPTED;
+    bool check_hmac = flags & ISFSVOL_FLAG_HMAC;
+    hmac_ctx calc_hmac;
+    aes_job aes_page;
+    u8 *decrypting = NULL;
+
+    if (check_hmac) {
+        hmac_init_key(&calc_hmac, &ctx->hmac_key);
+        hmac_update(&calc_hmac, (const u8 *)hmac_seed, SHA_BLOCK_SIZE);
+    }
+
+    /* queue the first cluster, the next one is queued while this one is processed */
+    if(!ctx->file)
+        _isfs_start_cluster_read(start_cluster, data, 0);
+
+    /* read all requested clusters. Pages go through a pipeline: while the AES engine
+     * decrypts page N, the SHA engine hashes page N-1 and the NAND fetches ahead. */
     for (i = 0; i < cluster_count; i++)
     {
         u32 cluster = start_cluster + i;
         u8 *cluster_data = (u8 *)data + i * CLUSTER_SIZE;
         u32 cluster_start = cluster * CLUSTER_PAGES;
+        int slot = i & 1;
+
+        if (!ctx->file && i + 1 < cluster_count)
+            _isfs_start_cluster_read(cluster + 1, cluster_data + CLUSTER_SIZE, slot ^ 1);
 
         /* read cluster pages */
         for (p = 0; p < CLUSTER_PAGES; p++)
         {
-            // make sure ECC fails, if read did nothing
-            memset(ecc_buf, 0, ECC_BUFFER_ALLOC);
+            u8 *page_data = &cluster_data[p * PAGE_SIZE];
+            u8 *ecc = ecc_buf;
             /* attempt to read the page (and correct ecc errors) */
-            int nand_error;
+            int res;
             if(ctx->file){
-                nand_error = _nand_read_page_rawfile(cluster_start + p, &cluster_data[p * PAGE_SIZE], ecc_buf, ctx->file);
+                // make sure ECC fails, if read did nothing
+                memset(ecc_buf, 0, ECC_BUFFER_ALLOC);
+                res = _nand_read_page_rawfile(cluster_start + p, page_data, ecc_buf, ctx->file);
             } else {
-                nand_error = nand_read_page(cluster_start + p, &cluster_data[p * PAGE_SIZE], ecc_buf);
-                int correct = nand_correct(cluster_start + p, &cluster_data[p * PAGE_SIZE], ecc_buf);
+                ecc = isfs_ecc_bufs[slot][p];
+                res = nand_end_read(&isfs_nand_req[slot][p]);
+                int correct = nand_correct(cluster_start + p, page_data, ecc);
                 /* uncorrectable ecc error or other issues */
                 if (correct < 0) {
                     ISFS_debug("Uncorrectable ECC ERROR\n");
@@ -211,7 +378,7 @@ int isfs_read_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count,
                 }
             }
                 
-            if(nand_error){
+            if(res){
                 ISFS_debug("NAND ERROR on read\n");
                 nand_error = true;
             }
@@ -219,19 +386,37 @@ int isfs_read_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count,
             /* page 6 and 7 store the hmac */
             if (p == 6)
             {
-                memcpy(saved_hmacs[0], &ecc_buf[1], 20);
-                memcpy(saved_hmacs[1], &ecc_buf[21], 12);
+                memcpy(saved_hmacs[0], &ecc[1], 20);
+                memcpy(saved_hmacs[1], &ecc[21], 12);
             }
             if (p == 7)
-                memcpy(&saved_hmacs[1][12], &ecc_buf[1], 8);
-        }
+                memcpy(&saved_hmacs[1][12], &ecc[1], 8);
+
+            /* hand the previous page from the AES to the SHA engine, this one goes to the AES */
+            u8 *hash_page = page_data;
+            if (encrypted) {
+                hash_page = decrypting;
+                if (decrypting)
+                    aes_wait(&aes_page);
+                _isfs_start_decrypt(ctx, page_data, PAGE_SIZE, p == 0, &aes_page);
+                decrypting = page_data;
+            }
 
-        /* decrypt cluster */
-        if (flags & ISFSVOL_FLAG_ENCRYPTED)
-            _isfs_decrypt_cluster(ctx, cluster_data);
+            if (check_hmac && hash_page)
+                sha_start_update(&calc_hmac.hash_ctx, hash_page, PAGE_SIZE);
+        }
+    }
 
+    if (decrypting) {
+        aes_wait(&aes_page);
+        if (check_hmac)
+            sha_start_update(&calc_hmac.hash_ctx, decrypting, PAGE_SIZE);
     }
 
+    /* always finish the hash, the SHA engine may still be working on calc_hmac */
+    if (check_hmac)
+        hmac_final(&calc_hmac, hmac);
+
     if(nand_error)
         return ISFSVOL_ERROR_READ; 
 
@@ -239,17 +424,10 @@ int isfs_read_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count,
         return ISFSVOL_ERROR_ECC;
 
     /* verify hmac */
-    if (flags & ISFSVOL_FLAG_HMAC)
+    if (check_hmac)
     {
-        hmac_ctx calc_hmac;
         int matched = 0;
 
-        /* compute clusters hmac */
-        hmac_init(&calc_hmac, ctx->hmac, 20);
-        hmac_update(&calc_hmac, (const u8 *)hmac_seed, SHA_BLOCK_SIZE);
-        hmac_update(&calc_hmac, (const u8 *)data, cluster_count * CLUSTER_SIZE);
-        hmac_final(&calc_hmac, hmac);
-
         /* ensure at least one of the saved hmacs matches */
         matched += !memcmp(saved_hmacs[0], hmac, sizeof(hmac));
         matched += !memcmp(saved_hmacs[1], hmac, sizeof(hmac));
@@ -284,47 +462,60 @@ static int _isfs_write_sd(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_co
     if(!redpart.lba_length)
         return -1;
 
+    // The card gets the encrypted clusters, the caller gets its data back
+    // unchanged afterwards.
+    static aes_job jobs[8];
+    if(flags & ISFSVOL_FLAG_ENCRYPTED){
+        for (u32 p = 0; p < cluster_count; p++){
+            aes_job *job = &jobs[p % 8];
+            if (p >= 8)
+                aes_wait(job);
+            u8 *cluster = data + p * CLUSTER_SIZE;
+            _isfs_start_crypt(ctx, AES_MODE_ENCRYPT, cluster, cluster, CLUSTER_SIZE, true, job);
+        }
+        aes_drain();
+    }
+
+    int res = 0;
     if(sdcard_write(redpart.lba_start + make_sector(start_cluster), make_sector(cluster_count), data))
-        return -1;
+        res = -1;
 
     if(flags & ISFSVOL_FLAG_ENCRYPTED){
-        for (int p = 0; p < cluster_count; p++){
-            _isfs_decrypt_cluster(ctx, data + p * CLUSTER_SIZE);
+        for (u32 p = 0; p < cluster_count; p++){
+            aes_job *job = &jobs[p % 8];
+            if (p >= 8)
+                aes_wait(job);
+            _isfs_start_decrypt(ctx, data + p * CLUSTER_SIZE, CLUSTER_SIZE, true, job);
         }
+        aes_drain();
     }
-    return 0;
+    return res;
 }
 
-int isfs_write_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count, u32 flags, void *hmac_seed, void *data)
+// Writes the clusters with one HMAC per hmac_stride bytes of hmacs, or the same
+// HMAC for all of them if hmac_stride is 0.
+static int _isfs_write_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count, u32 flags, const u8 *hmacs, u32 hmac_stride, void *data)
 {
+    _isfs_cache_invalidate(ctx->volume, start_cluster, cluster_count);
+
     if(ctx->bank & 0x80000000) {
         return _isfs_write_sd(ctx, start_cluster, cluster_count, flags, data);
     }
 
     static u8 blockpg[BLOCK_PAGES][PAGE_SIZE] ALIGNED(NAND_DATA_ALIGN), blocksp[BLOCK_PAGES][PAGE_SPARE_SIZE];
-    static u8 pgbuf[PAGE_SIZE] ALIGNED(NAND_DATA_ALIGN);
-    u8 hmac[20] = {0};
+    static u8 pgbuf[2][PAGE_SIZE] ALIGNED(NAND_DATA_ALIGN);
+    static u8 pgecc[2][ALIGN_FORWARD(ECC_BUFFER_ALLOC, NAND_DATA_ALIGN)] ALIGNED(NAND_DATA_ALIGN);
+    static nand_request write_req[BLOCK_PAGES], read_req[2];
+    static const u8 no_hmac[20] = {0};
     u32 b, p;
 
     /* enable slc or slccmpt bank */
     nand_initialize(ctx->bank);
 
-    /* compute clusters hmac */
-    if (flags & ISFSVOL_FLAG_HMAC)
-    {
-        hmac_ctx calc_hmac;
-        hmac_init(&calc_hmac, ctx->hmac, 20);
-        hmac_update(&calc_hmac, (const u8 *)hmac_seed, SHA_BLOCK_SIZE);
-        hmac_update(&calc_hmac, (const u8 *)data, cluster_count * CLUSTER_SIZE);
-        hmac_final(&calc_hmac, hmac);
-    }
-
-    /* setup clusters encryption */
-    if (flags & ISFSVOL_FLAG_ENCRYPTED)
+    if (!(flags & ISFSVOL_FLAG_HMAC))
     {
-        aes_reset();
-        aes_set_key((u8*)ctx->aes);
-        aes_empty_iv();
+        hmacs = no_hmac;
+        hmac_stride = 0;
     }
 
     bool ecc_corrected = false;
@@ -358,6 +549,7 @@ int isfs_write_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count,
             }
 
             /* place hmac in page 6 and 7 of a cluster */
+            const u8 *hmac = hmacs + (curpage - startpage) / CLUSTER_PAGES * hmac_stride;
             memset(blocksp[p], 0, PAGE_SPARE_SIZE);
             switch (clusidx)
             {
@@ -370,10 +562,14 @@ int isfs_write_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count,
                 break;
             }
 
-            /* encrypt or copy the data */
+            /* encrypt or copy the data, the pages of a cluster are one CBC chain */
             u8 *srcdata = (u8*)data + (curpage - startpage) * PAGE_SIZE;
             if (flags & ISFSVOL_FLAG_ENCRYPTED)
-                aes_encrypt(blockpg[p], srcdata, PAGE_SIZE / ISFSAES_BLOCK_SIZE, clusidx > 0);
+            {
+                aes_job job;
+                _isfs_start_crypt(ctx, AES_MODE_ENCRYPT, srcdata, blockpg[p], PAGE_SIZE, clusidx == 0, &job);
+                aes_wait(&job);
+            }
             else
                 memcpy(blockpg[p], srcdata, PAGE_SIZE);
         }
@@ -384,9 +580,11 @@ int isfs_write_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count,
 
         int write_error = 0;
         ISFS_debug("Writing\n");
-        /* write block */
+        /* write block, the pages are queued and programmed back to back */
         for (p = 0; p < BLOCK_PAGES; p++)
-            if (nand_write_page(firstblockpage + p, blockpg[p], blocksp[p]) < 0){
+            nand_start_write(firstblockpage + p, blockpg[p], blocksp[p], &write_req[p]);
+        for (p = 0; p < BLOCK_PAGES; p++)
+            if (nand_end_write(&write_req[p]) < 0){
                 printf("ISFS: Error writing page\n");
                 write_error = ISFSVOL_ERROR_WRITE;
             }
@@ -398,36 +596,70 @@ int isfs_write_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count,
             continue;
 
         ISFS_debug("Reading back\n");
-        /* read back pages */
+        /* read back pages, the next page is fetched while the current one is compared */
+        int read_error = 0;
+        memset(pgecc[0], 0xDEADBEEF, ECC_BUFFER_ALLOC);
+        nand_start_read(firstblockpage, pgbuf[0], pgecc[0], &read_req[0]);
         for (p = 0; p < BLOCK_PAGES; p++)
         {
-            memset(ecc_buf, 0xDEADBEEF, ECC_BUFFER_ALLOC);
-            if(nand_read_page(firstblockpage + p, pgbuf, ecc_buf) < 0){
+            int slot = p & 1;
+            if (p + 1 < BLOCK_PAGES) {
+                memset(pgecc[slot ^ 1], 0xDEADBEEF, ECC_BUFFER_ALLOC);
+                nand_start_read(firstblockpage + p + 1, pgbuf[slot ^ 1], pgecc[slot ^ 1], &read_req[slot ^ 1]);
+            }
+
+            if(nand_end_read(&read_req[slot]) < 0){
                 printf("ISFS: Error reading back\n");
-                return ISFSVOL_ERROR_READ;
+                read_error = ISFSVOL_ERROR_READ;
+                break;
+            }
+            int res = nand_correct(firstblockpage + p, pgbuf[slot], pgecc[slot]);
+            if(res<0){
+                read_error = ISFSVOL_ERROR_READ;
+                break;
             }
-            int res = nand_correct(firstblockpage + p, pgbuf, ecc_buf);
-            if(res<0)
-                return ISFSVOL_ERROR_READ;
             if(res>0)
                 ecc_corrected = true;
 
             /* page content doesn't match */
-            if (memcmp(blockpg[p], pgbuf, PAGE_SIZE)){
+            if (memcmp(blockpg[p], pgbuf[slot], PAGE_SIZE)){
                 printf("ISFS: Read back data doesn't match\n");
-                return ISFSVOL_ERROR_READBACK;
+                read_error = ISFSVOL_ERROR_READBACK;
+                break;
             }
-            if (memcmp(&blocksp[p][1], &ecc_buf[1], 0x20)){
+            if (memcmp(&blocksp[p][1], &pgecc[slot][1], 0x20)){
                 printf("ISFS: Read back spare doesn't match\n");
-                return ISFSVOL_ERROR_READBACK;
+                read_error = ISFSVOL_ERROR_READBACK;
+                break;
             }
         }
+        /* don't leave a prefetch behind */
+        nand_drain();
+        if(read_error)
+            return read_error;
     }
 
     if(ecc_corrected)
         return ISFSVOL_ECC_CORRECTED;
     return ISFSVOL_OK;
 }
+
+int isfs_write_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count, u32 flags, void *hmac_seed, void *data)
+{
+    u8 hmac[20] = {0};
+
+    /* compute clusters hmac */
+    if (flags & ISFSVOL_FLAG_HMAC)
+    {
+        hmac_ctx calc_hmac;
+        hmac_init_key(&calc_hmac, &ctx->hmac_key);
+        hmac_update(&calc_hmac, (const u8 *)hmac_seed, SHA_BLOCK_SIZE);
+        hmac_update(&calc_hmac, (const u8 *)data, cluster_count * CLUSTER_SIZE);
+        hmac_final(&calc_hmac, hmac);
+    }
+
+    return _isfs_write_volume(ctx, start_cluster, cluster_count, flags, hmac, 0, data);
+}
 #endif
 
 static int _isfs_get_super_version(void* buffer)
@@ -470,6 +702,8 @@ int isfs_load_keys(isfs_ctx* ctx)
             return -1;
     }
 
+    hmac_key_init(&ctx->hmac_key, ctx->hmac, sizeof(ctx->hmac));
+
     return 0;
 }
 
@@ -524,7 +758,124 @@ static bool _isfs_fst_is_dir(const isfs_fst* fst)
     return _isfs_fst_get_type(fst) == 2;
 }
 
+// Hash table from parent index and name to FST index, built on the first lookup
+// after a mount or a change of the FST.
+#define ISFS_FST_COUNT          ((ISFSSUPER_SIZE - 0x1000C) / sizeof(isfs_fst))
+#define ISFS_FST_INDEX_SIZE     0x2000 // power of two above ISFS_FST_COUNT
+#define ISFS_FST_NONE           0xFFFF
+
+static u32 _isfs_name_hash(u16 parent, const char* name, size_t len)
+{
+    // FNV-1a
+    u32 hash = (2166136261u ^ parent) * 16777619u;
+    for(size_t i = 0; i < len; i++)
+        hash = (hash ^ (u8)name[i]) * 16777619u;
+    return hash & (ISFS_FST_INDEX_SIZE - 1);
+}
+
+static size_t _isfs_name_len(const isfs_fst* fst)
+{
+    size_t len = 0;
+    while(len < sizeof(fst->name) && fst->name[len])
+        len++;
+    return len;
+}
+
+static bool _isfs_name_equal(const isfs_fst* fst, const char* name, size_t len)
+{
+    return len <= sizeof(fst->name) && !memcmp(fst->name, name, len) &&
+           (len == sizeof(fst->name) || !fst->name[len]);
+}
+
+static void _isfs_index_invalidate(isfs_ctx* ctx)
+{
+    ctx->fst_index_super = NULL;
+}
+
+static bool _isfs_index_fst(isfs_ctx* ctx)
+{
+    if(ctx->fst_index && ctx->fst_index_super == ctx->super &&
+       ctx->fst_index_generation == _isfs_get_hdr(ctx)->generation)
+        return true;
+
+    if(!ctx->fst_index)
+        ctx->fst_index = malloc(ISFS_FST_INDEX_SIZE * sizeof(isfs_fst_slot));
+    if(!ctx->fst_index)
+        return false;
+    memset(ctx->fst_index, 0xFF, ISFS_FST_INDEX_SIZE * sizeof(isfs_fst_slot));
+
+    isfs_fst* root = _isfs_get_fst(ctx);
+    u32 used = 0;
+
+    // Every entry is in the sibling chain of its directory. The step limit keeps
+    // a broken FST from looping forever.
+    for(u32 dir = 0; dir < ISFS_FST_COUNT; dir++) {
+        if(!_isfs_fst_is_dir(&root[dir]))
+            continue;
+
+        u32 steps = 0;
+        for(u16 child = root[dir].sub; child < ISFS_FST_COUNT && steps++ < ISFS_FST_COUNT; child = root[child].sib) {
+            if(used == ISFS_FST_INDEX_SIZE - 1)
+                return false;
+
+            u32 h = _isfs_name_hash(dir, root[child].name, _isfs_name_len(&root[child]));
+            while(ctx->fst_index[h].fst != ISFS_FST_NONE)
+                h = (h + 1) & (ISFS_FST_INDEX_SIZE - 1);
+            ctx->fst_index[h].parent = dir;
+            ctx->fst_index[h].fst = child;
+            used++;
+        }
+    }
+
+    ctx->fst_index_super = ctx->super;
+    ctx->fst_index_generation = _isfs_get_hdr(ctx)->generation;
+    return true;
+}
+
+static u16 _isfs_index_lookup(isfs_ctx* ctx, u16 parent, const char* name, size_t len)
+{
+    isfs_fst* root = _isfs_get_fst(ctx);
+    u32 h = _isfs_name_hash(parent, name, len);
+
+    for(u32 n = 0; n < ISFS_FST_INDEX_SIZE; n++, h = (h + 1) & (ISFS_FST_INDEX_SIZE - 1)) {
+        isfs_fst_slot* slot = &ctx->fst_index[h];
+        if(slot->fst == ISFS_FST_NONE)
+            break;
+        if(slot->parent == parent && _isfs_name_equal(&root[slot->fst], name, len))
+            return slot->fst;
+    }
+    return ISFS_FST_NONE;
+}
+
+static isfs_fst* _isfs_find_fst_indexed(isfs_ctx* ctx, const char* path)
+{
+    isfs_fst* root = _isfs_get_fst(ctx);
+    u16 dir = 0;
+
+    while(true) {
+        while(*path == '/') path++;
+        const char* remaining = strchr(path, '/');
+        size_t size = remaining ? remaining - path : strlen(path);
+
+        u16 next = _isfs_index_lookup(ctx, dir, path, size);
+        if(next == ISFS_FST_NONE)
+            return NULL;
+        if(!remaining)
+            return &root[next];
+        if(!_isfs_fst_is_dir(&root[next]))
+            return NULL;
+
+        dir = next;
+        path = remaining;
+    }
+}
+
 static isfs_fst* _isfs_find_fst(isfs_ctx* ctx, const char* path, void** parent){
+    // The table doesn't know the link that points to an entry, callers that need
+    // it walk the directories.
+    if(!parent && _isfs_index_fst(ctx))
+        return _isfs_find_fst_indexed(ctx, path);
+
     isfs_fst* root = _isfs_get_fst(ctx);
     if(parent)
         *parent = &root->sub;
@@ -704,6 +1055,9 @@ bool isfs_is_isfshax_super(isfs_ctx* ctx, u8 index){
 
 int isfs_commit_super(isfs_ctx* ctx)
 {
+    // A new superblock can come with a raw restore of the rest of the NAND.
+    _isfs_cache_invalidate(ctx->volume, 0, 0);
+
     _isfs_get_hdr(ctx)->generation++;
 
     for(int i = 1; i <= ctx->super_count; i++)
@@ -717,8 +1071,12 @@ int isfs_commit_super(isfs_ctx* ctx)
         if (_isfs_super_check_slot(ctx, index) < 0)
             continue;
 
-        if (isfs_write_super(ctx, ctx->super, index) >= 0)
+        if (isfs_write_super(ctx, ctx->super, index) >= 0) {
+            // The next commit goes to the slot after this one.
+            ctx->index = index;
+            ctx->generation = _isfs_get_hdr(ctx)->generation;
             return 0;
+        }
 
         isfs_super_mark_slot(ctx, index, FAT_CLUSTER_BAD);
         _isfs_get_hdr(ctx)->generation++;
@@ -737,42 +1095,6 @@ isfs_fst* isfs_stat(const char* path)
     return _isfs_find_fst(ctx, path, NULL);
 }
 
-#ifdef NAND_WRITE_ENABLED
-int isfs_unlink(const char* path){
-    if(!path)
-        return -1;
-    isfs_ctx* ctx = NULL;
-    path = _isfs_do_volume(path, &ctx);
-    ISFS_debug("volume found: %p\n", ctx);
-    if(!ctx)return -ENOENT;
-
-    void *parent;
-    isfs_fst* fst = _isfs_find_fst(ctx, path, &parent);
-    ISFS_debug("fst found: %p\n", fst);
-    if(!fst) return -ENOENT;
-
-    if(!_isfs_fst_is_file(fst)) return -EISDIR;
-
-    //parent might be unaligned
-    memcpy(parent, &fst->sib, sizeof(fst->sib)); //remove from directory
-
-    u16* fat = _isfs_get_fat(ctx);
-    u16 cluster = fst->sub;
-    while(cluster < 0xFFFB) {  
-        u16 next_cluster = fat[cluster];
-        fat[cluster] = 0xFFFE;
-        cluster = next_cluster;
-    }
-
-    memset(fst, 0, sizeof(isfs_fst));
-
-    int res = isfs_commit_super(ctx);
-    if(res)
-        return -EIO;
-    return 0;
-}
-#endif //NAND_WRITE_ENABLED
-
 int isfs_open(isfs_file* file, const char* path)
 {
     if(!file || !path) return -1;
@@ -801,9 +1123,40 @@ int isfs_open(isfs_file* file, const char* path)
 int isfs_close(isfs_file* file)
 {
     if(!file) return -1;
+
+    int res = 0;
+#ifdef NAND_WRITE_ENABLED
+    res = isfs_sync(file);
+#endif
+
+    if(file->index)
+        free(file->index);
     memset(file, 0, sizeof(isfs_file));
 
-    return 0;
+    return res;
+}
+
+// Walks the chain of a file once, so seeks can look their cluster up. The
+// index has room for capacity clusters, so writes can extend it.
+static u16* _isfs_build_index(isfs_ctx* ctx, const isfs_fst* fst, u32 nclusters, u32 capacity)
+{
+    u16* fat = _isfs_get_fat(ctx);
+    u16* index = malloc(max(capacity, (u32)1) * sizeof(u16));
+    if(!index)
+        return NULL;
+
+    u16 cluster = fst->sub;
+    for(u32 i = 0; i < nclusters; i++) {
+        if(cluster >= FAT_CLUSTER_LAST) {
+            printf("ISFS: chain of %.12s ends after %lu clusters, expected %lu.\n", fst->name, i, nclusters);
+            free(index);
+            return NULL;
+        }
+        index[i] = cluster;
+        cluster = fat[cluster];
+    }
+
+    return index;
 }
 
 int isfs_seek(isfs_file* file, s32 offset, int whence)
@@ -834,15 +1187,26 @@ int isfs_seek(isfs_file* file, s32 offset, int whence)
             break;
     }
 
-    u16 sub = fst->sub;
-    size_t size = file->offset;
+    u32 nclusters = (fst->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    u32 n = file->offset / CLUSTER_SIZE;
 
-    while(size > 8 * PAGE_SIZE) {
-        sub = _isfs_get_fat(ctx)[sub];
-        size -= 8 * PAGE_SIZE;
+    // At the end of a file that fills its last cluster, there's no cluster to go to.
+    if(n >= nclusters) {
+        file->cluster = FAT_CLUSTER_LAST;
+        return 0;
     }
 
-    file->cluster = sub;
+    if(!file->index)
+        file->index = _isfs_build_index(ctx, fst, nclusters, nclusters);
+
+    if(file->index) {
+        file->cluster = file->index[n];
+    } else {
+        u16 sub = fst->sub;
+        while(n-- && sub < FAT_CLUSTER_LAST)
+            sub = _isfs_get_fat(ctx)[sub];
+        file->cluster = sub;
+    }
 
     return 0;
 }
@@ -865,9 +1229,29 @@ int isfs_read(isfs_file* file, void* buffer, size_t size, size_t* bytes_read)
         size_t copy = CLUSTER_SIZE - pos;
         if(copy > size) copy = size;
 
-        if (isfs_read_volume(ctx, file->cluster, 1, ISFSVOL_FLAG_ENCRYPTED, NULL, slc_cluster_buf) < 0)
+        // Whole clusters go straight to an aligned buffer, as many at once as
+        // follow each other on the NAND.
+        if(pos == 0 && size >= CLUSTER_SIZE && !((u32)buffer & (NAND_DATA_ALIGN - 1))) {
+            u16* fat = _isfs_get_fat(ctx);
+            u32 count = 1;
+            while((count + 1) * CLUSTER_SIZE <= size && fat[file->cluster + count - 1] == file->cluster + count)
+                count++;
+
+            if (isfs_read_volume(ctx, file->cluster, count, ISFSVOL_FLAG_ENCRYPTED, NULL, buffer) < 0)
+                return -4;
+
+            file->offset += count * CLUSTER_SIZE;
+            buffer += count * CLUSTER_SIZE;
+            size -= count * CLUSTER_SIZE;
+            file->cluster = fat[file->cluster + count - 1];
+            continue;
+        }
+
+        // entering a cluster at its start is most likely a sequential read
+        u8* data = _isfs_cache_get(ctx, file->cluster, pos == 0);
+        if (!data)
             return -4;
-        memcpy(buffer, slc_cluster_buf + pos, copy);
+        memcpy(buffer, data + pos, copy);
 
         file->offset += copy;
         buffer += copy;
@@ -881,67 +1265,737 @@ int isfs_read(isfs_file* file, void* buffer, size_t size, size_t* bytes_read)
     return 0;
 }
 
-int isfs_diropen(isfs_dir* dir, const char* path)
-{
-    if(!dir || !path) return -1;
-
-    isfs_ctx* ctx = NULL;
-    path = _isfs_do_volume(path, &ctx);
-    if(!ctx) return -2;
-
-    isfs_fst* fst = _isfs_find_fst(ctx, path, NULL);
-    if(!fst) return -3;
+#ifdef NAND_WRITE_ENABLED
+// Changes stay in ctx->super until they're committed, so the committed
+// superblock must stay intact until then: data always goes to free clusters.
+// If the newest superblock turns out to be unreadable, mounting falls back to
+// the one before it, so a freed cluster is only handed out again after two
+// more commits. Outside a transaction, metadata changes are committed right
+// away and file writes when the file is closed or synced.
 
-    if(!_isfs_fst_is_dir(fst)) return -4;
-    if(fst->sub == 0xFFFF) return -2;
+#define ISFS_FST_TYPE_FILE      1
+#define ISFS_FST_TYPE_DIR       2
 
-    isfs_fst* root = _isfs_get_fst(ctx);
+#define ISFS_WRITE_RETRIES      4
 
-    memset(dir, 0, sizeof(isfs_dir));
-    dir->volume = ctx->volume;
-    dir->dir = fst;
-    dir->child = &root[fst->sub];
+// pending_free holds one bitmap of freed clusters per commit they are kept for,
+// the first one for the changes that aren't committed yet.
+#define ISFS_HELD_COMMITS       2
+#define ISFS_HELD_BITMAP        (CLUSTER_COUNT / 8)
 
-    return 0;
-}
+static u8* isfs_write_buf = NULL;
 
-int isfs_dirread(isfs_dir* dir, isfs_fst** info)
+// The superblock before the mounted one was committed before this mount, hold
+// the clusters it still uses like the ones the last commit freed.
+static int _isfs_hold_fallback(isfs_ctx* ctx)
 {
-    if(!dir) return -1;
-
-    isfs_ctx* ctx = isfs_get_volume(dir->volume);
-    isfs_fst* fst = dir->dir;
-    if(!ctx || !fst) return -2;
-
-    isfs_fst* root = _isfs_get_fst(ctx);
+    u8* prev = memalign(NAND_DATA_ALIGN, 0x80 * PAGE_SIZE);
+    if(!prev)
+        return -ENOMEM;
+
+    u32 generation = ctx->generation, version;
+    int index;
+    while((index = isfs_find_super(ctx, 0, generation, &generation, &version)) >= 0) {
+        if(version != ctx->version || isfs_read_super(ctx, prev, index) < 0)
+            continue;
 
-    if(!info) {
-        dir->child = &root[fst->sub];
-        return 0;
+        u16* fat = _isfs_get_fat(ctx);
+        u16* prev_fat = (u16*)&prev[0x0C];
+        u8* held = ctx->pending_free + ISFS_HELD_BITMAP;
+        for(u32 c = 0; c < CLUSTER_COUNT; c++)
+            if(fat[c] == FAT_CLUSTER_EMPTY && prev_fat[c] != FAT_CLUSTER_EMPTY)
+                held[c / 8] |= 1 << (c % 8);
+        break;
     }
 
-    *info = dir->child;
+    free(prev);
+    return 0;
+}
 
-    if(dir->child != NULL) {
-        if(dir->child->sib == 0xFFFF)
-            dir->child = NULL;
-        else
-            dir->child = &root[dir->child->sib];
+static int _isfs_prepare_write(isfs_ctx* ctx)
+{
+    if(!isfs_write_buf)
+        isfs_write_buf = memalign(NAND_DATA_ALIGN, BLOCK_CLUSTERS * CLUSTER_SIZE);
+    if(!isfs_write_buf)
+        return -ENOMEM;
+
+    if(!ctx->pending_free) {
+        ctx->pending_free = calloc(ISFS_HELD_COMMITS * ISFS_HELD_BITMAP, 1);
+        if(!ctx->pending_free)
+            return -ENOMEM;
+        if(_isfs_hold_fallback(ctx)) {
+            free(ctx->pending_free);
+            ctx->pending_free = NULL;
+            return -ENOMEM;
+        }
     }
-
     return 0;
 }
 
-int isfs_dirreset(isfs_dir* dir)
+static void _isfs_hold_cluster(isfs_ctx* ctx, u16 cluster)
 {
-    return isfs_dirread(dir, NULL);
+    ctx->pending_free[cluster / 8] |= 1 << (cluster % 8);
 }
 
-int isfs_dirclose(isfs_dir* dir)
+static bool _isfs_cluster_held(isfs_ctx* ctx, u32 cluster)
 {
-    if(!dir) return -1;
-    memset(dir, 0, sizeof(isfs_dir));
-
+    for(int i = 0; i < ISFS_HELD_COMMITS; i++)
+        if(ctx->pending_free[i * ISFS_HELD_BITMAP + cluster / 8] & (1 << (cluster % 8)))
+            return true;
+    return false;
+}
+
+static bool _isfs_cluster_free(isfs_ctx* ctx, u32 cluster)
+{
+    return _isfs_get_fat(ctx)[cluster] == FAT_CLUSTER_EMPTY && !_isfs_cluster_held(ctx, cluster);
+}
+
+static void _isfs_free_chain(isfs_ctx* ctx, u16 cluster)
+{
+    u16* fat = _isfs_get_fat(ctx);
+    for(u32 i = 0; cluster < FAT_CLUSTER_LAST && i < CLUSTER_COUNT; i++) {
+        u16 next = fat[cluster];
+        fat[cluster] = FAT_CLUSTER_EMPTY;
+        _isfs_hold_cluster(ctx, cluster);
+        cluster = next;
+    }
+}
+
+static int _isfs_commit(isfs_ctx* ctx)
+{
+    if(!ctx->dirty)
+        return 0;
+    if(isfs_commit_super(ctx))
+        return -EIO;
+
+    ctx->dirty = false;
+    memmove(ctx->pending_free + ISFS_HELD_BITMAP, ctx->pending_free, (ISFS_HELD_COMMITS - 1) * ISFS_HELD_BITMAP);
+    memset(ctx->pending_free, 0, ISFS_HELD_BITMAP);
+    return 0;
+}
+
+// Goes back to the committed superblock. A change that failed halfway may not
+// have marked the volume dirty yet, so it is always loaded again.
+static int _isfs_revert(isfs_ctx* ctx)
+{
+    int res = 0;
+    if(isfs_load_super(ctx))
+        res = -EIO;
+
+    ctx->dirty = false;
+    if(ctx->pending_free)
+        memset(ctx->pending_free, 0, ISFS_HELD_BITMAP);
+    _isfs_index_invalidate(ctx);
+    return res;
+}
+
+// Finishes a change. One that failed halfway is undone, unless a transaction
+// collects the changes and its owner decides what happens with them.
+static int _isfs_done(isfs_ctx* ctx, int res)
+{
+    if(res < 0) {
+        if(!ctx->transaction)
+            _isfs_revert(ctx);
+        return res;
+    }
+
+    ctx->dirty = true;
+    if(ctx->transaction)
+        return 0;
+    return _isfs_commit(ctx);
+}
+
+static u32 _isfs_fst_num(isfs_ctx* ctx, const isfs_fst* fst)
+{
+    return fst - _isfs_get_fst(ctx);
+}
+
+static void _isfs_data_hmac(isfs_ctx* ctx, const isfs_fst* fst, u32 iblk, const u8* data, u8* hmac)
+{
+    isfs_hmac_data seed = {
+        .x1 = fst->x1,
+        .uid = fst->uid,
+        .iblk = iblk,
+        .ifst = _isfs_fst_num(ctx, fst),
+        .x3 = fst->x3,
+    };
+    memcpy(seed.name, fst->name, sizeof(seed.name));
+
+    hmac_ctx calc_hmac;
+    hmac_init_key(&calc_hmac, &ctx->hmac_key);
+    hmac_update(&calc_hmac, (const u8 *)&seed, sizeof(seed));
+    hmac_update(&calc_hmac, data, CLUSTER_SIZE);
+    hmac_final(&calc_hmac, hmac);
+}
+
+// Finds up to count free clusters in a row within one NAND block. Writing a
+// cluster erases its whole block and programs the rest of it again as it was
+// read, so only blocks without live clusters are used, the others in it must
+// be free or held back. Blocks nothing else uses come first.
+static int _isfs_alloc_clusters(isfs_ctx* ctx, u32 count, u32* got)
+{
+    u16* fat = _isfs_get_fat(ctx);
+    int best = -ENOSPC;
+    u32 best_len = 0;
+
+    for(u32 b = 0; b < CLUSTER_COUNT; b += BLOCK_CLUSTERS) {
+        u32 empty = b;
+        while(empty < b + BLOCK_CLUSTERS && fat[empty] == FAT_CLUSTER_EMPTY)
+            empty++;
+        if(empty < b + BLOCK_CLUSTERS)
+            continue;
+
+        u32 start = b, run = 0;
+        for(u32 c = b; c < b + BLOCK_CLUSTERS; c++) {
+            if(!_isfs_cluster_free(ctx, c)) {
+                start = c + 1;
+                run = 0;
+                continue;
+            }
+            run++;
+            if(run > best_len && best_len < count) {
+                best = start;
+                best_len = run;
+            }
+        }
+        if(run == BLOCK_CLUSTERS) {
+            *got = min(count, (u32)BLOCK_CLUSTERS);
+            return b;
+        }
+    }
+
+    *got = min(best_len, count);
+    return best;
+}
+
+// Writes count clusters of data as clusters n and up of a file, n being at most
+// length, the number of clusters it has. They go to new clusters, which take
+// the place of the old ones in chain. Returns the new length.
+static int _isfs_write_file_clusters(isfs_ctx* ctx, isfs_fst* fst, u16* chain, u32 length, u32 n, u32 count, u8* data)
+{
+    static u8 hmacs[BLOCK_CLUSTERS][20];
+    u16* fat = _isfs_get_fat(ctx);
+    int tries = 0;
+
+    while(count) {
+        u32 got;
+        int start = _isfs_alloc_clusters(ctx, min(count, (u32)BLOCK_CLUSTERS), &got);
+        if(start < 0)
+            return start;
+
+        for(u32 i = 0; i < got; i++)
+            _isfs_data_hmac(ctx, fst, n + i, data + i * CLUSTER_SIZE, hmacs[i]);
+
+        int res = _isfs_write_volume(ctx, start, got, ISFSVOL_FLAG_ENCRYPTED | ISFSVOL_FLAG_HMAC | ISFSVOL_FLAG_READBACK,
+                                     hmacs[0], sizeof(hmacs[0]), data);
+        if(res < 0) {
+            printf("ISFS: Failed to write clusters %d-%lu (%d)\n", start, start + got - 1, res);
+            // A NAND block that failed to erase or program is bad. Anything else, like
+            // an unreadable page or a failed SD write on redNAND, may go away again,
+            // those clusters are only skipped for a while.
+            bool bad = !(ctx->bank & 0x80000000) &&
+                (res == ISFSVOL_ERROR_ERASE || res == ISFSVOL_ERROR_WRITE);
+            for(u32 i = 0; i < got; i++) {
+                if(bad)
+                    fat[start + i] = FAT_CLUSTER_BAD;
+                else
+                    _isfs_hold_cluster(ctx, start + i);
+            }
+            if(bad)
+                ctx->dirty = true;
+            if(++tries >= ISFS_WRITE_RETRIES)
+                return -EIO;
+            continue;
+        }
+
+        ctx->dirty = true;
+        for(u32 i = 0; i < got; i++, n++) {
+            u16 cluster = start + i;
+            if(n < length) {
+                fat[cluster] = fat[chain[n]];
+                fat[chain[n]] = FAT_CLUSTER_EMPTY;
+                _isfs_hold_cluster(ctx, chain[n]);
+            } else {
+                fat[cluster] = FAT_CLUSTER_LAST;
+                length = n + 1;
+            }
+
+            if(n)
+                fat[chain[n - 1]] = cluster;
+            else
+                fst->sub = cluster;
+            chain[n] = cluster;
+        }
+
+        data += got * CLUSTER_SIZE;
+        count -= got;
+    }
+
+    return length;
+}
+
+// Copies cluster n of a file to dst, with zeros after the end of the file.
+static int _isfs_read_file_cluster(isfs_ctx* ctx, const isfs_fst* fst, const u16* chain, u32 length, u32 n, u8* dst)
+{
+    if(n >= length) {
+        memset(dst, 0, CLUSTER_SIZE);
+        return 0;
+    }
+
+    u8* data = _isfs_cache_get(ctx, chain[n], false);
+    if(!data)
+        return -EIO;
+    memcpy(dst, data, CLUSTER_SIZE);
+
+    u32 valid = fst->size - n * CLUSTER_SIZE;
+    if(valid < CLUSTER_SIZE)
+        memset(dst + valid, 0, CLUSTER_SIZE - valid);
+    return 0;
+}
+
+// The HMAC of a data cluster covers the name of its file, a renamed file has
+// to be written again.
+static int _isfs_rewrite_file(isfs_ctx* ctx, isfs_fst* fst)
+{
+    u32 length = (fst->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    u16* chain = _isfs_build_index(ctx, fst, length, length);
+    if(!chain)
+        return -EIO;
+
+    int res = 0;
+    for(u32 n = 0; n < length && res >= 0; n += BLOCK_CLUSTERS) {
+        u32 count = min(length - n, (u32)BLOCK_CLUSTERS);
+        for(u32 i = 0; i < count && res >= 0; i++)
+            res = _isfs_read_file_cluster(ctx, fst, chain, length, n + i, isfs_write_buf + i * CLUSTER_SIZE);
+        if(res >= 0)
+            res = _isfs_write_file_clusters(ctx, fst, chain, length, n, count, isfs_write_buf);
+    }
+
+    free(chain);
+    return res < 0 ? res : 0;
+}
+
+// Finds the directory a new entry at path goes to and the name of the entry.
+static int _isfs_find_parent(isfs_ctx* ctx, const char* path, isfs_fst** parent, const char** name, size_t* len)
+{
+    char dir[0x100];
+    const char* slash = strrchr(path, '/');
+
+    *name = slash ? slash + 1 : path;
+    *len = strlen(*name);
+    if(!*len)
+        return -EINVAL;
+    if(*len > sizeof((*parent)->name))
+        return -ENAMETOOLONG;
+
+    size_t dir_len = slash ? slash - path : 0;
+    if(dir_len >= sizeof(dir))
+        return -ENAMETOOLONG;
+    memcpy(dir, path, dir_len);
+    dir[dir_len] = '\0';
+
+    *parent = strspn(dir, "/") == dir_len ? _isfs_get_fst(ctx) : _isfs_find_fst(ctx, dir, NULL);
+    if(!*parent)
+        return -ENOENT;
+    if(!_isfs_fst_is_dir(*parent))
+        return -ENOTDIR;
+    return 0;
+}
+
+static void _isfs_set_name(isfs_fst* fst, const char* name, size_t len)
+{
+    memset(fst->name, 0, sizeof(fst->name));
+    memcpy(fst->name, name, len);
+}
+
+// Adds an empty entry to the directory, it gets the permissions and owner of the
+// directory.
+static int _isfs_create(isfs_ctx* ctx, const char* path, int type, isfs_fst** out)
+{
+    isfs_fst* parent;
+    const char* name;
+    size_t len;
+    int res = _isfs_find_parent(ctx, path, &parent, &name, &len);
+    if(res)
+        return res;
+    if(_isfs_find_fst(ctx, path, NULL))
+        return -EEXIST;
+
+    isfs_fst* root = _isfs_get_fst(ctx);
+    u32 i;
+    for(i = 1; i < ISFS_FST_COUNT; i++)
+        if(!_isfs_fst_get_type(&root[i]))
+            break;
+    if(i == ISFS_FST_COUNT)
+        return -ENOSPC;
+
+    isfs_fst* fst = &root[i];
+    memset(fst, 0, sizeof(isfs_fst));
+    _isfs_set_name(fst, name, len);
+    fst->mode = (parent->mode & ~3) | type;
+    fst->sub = type == ISFS_FST_TYPE_DIR ? 0xFFFF : FAT_CLUSTER_LAST;
+    fst->sib = parent->sub;
+    fst->x1 = parent->x1;
+    fst->uid = parent->uid;
+    fst->gid = parent->gid;
+    parent->sub = i;
+
+    _isfs_index_invalidate(ctx);
+    if(out)
+        *out = fst;
+    return 0;
+}
+
+// Takes a file out of its directory, link is what points to it.
+static void _isfs_remove(isfs_ctx* ctx, isfs_fst* fst, void* link)
+{
+    //link might be unaligned
+    memcpy(link, &fst->sib, sizeof(fst->sib));
+    _isfs_free_chain(ctx, fst->sub);
+    memset(fst, 0, sizeof(isfs_fst));
+    _isfs_index_invalidate(ctx);
+}
+
+static isfs_ctx* _isfs_writable_volume(const char** path, int* res)
+{
+    isfs_ctx* ctx = NULL;
+    *path = _isfs_do_volume(*path, &ctx);
+    if(!ctx || !*path) {
+        *res = -ENOENT;
+        return NULL;
+    }
+    *res = _isfs_prepare_write(ctx);
+    return *res ? NULL : ctx;
+}
+
+int isfs_unlink(const char* path){
+    int res;
+    isfs_ctx* ctx = _isfs_writable_volume(&path, &res);
+    ISFS_debug("volume found: %p\n", ctx);
+    if(!ctx) return res;
+
+    void *parent;
+    isfs_fst* fst = _isfs_find_fst(ctx, path, &parent);
+    ISFS_debug("fst found: %p\n", fst);
+    if(!fst) return -ENOENT;
+
+    if(!_isfs_fst_is_file(fst)) return -EISDIR;
+
+    _isfs_remove(ctx, fst, parent);
+    return _isfs_done(ctx, 0);
+}
+
+int isfs_create(const char* path)
+{
+    int res;
+    isfs_ctx* ctx = _isfs_writable_volume(&path, &res);
+    if(!ctx) return res;
+
+    res = _isfs_create(ctx, path, ISFS_FST_TYPE_FILE, NULL);
+    if(res) return res;
+    return _isfs_done(ctx, 0);
+}
+
+int isfs_mkdir(const char* path)
+{
+    int res;
+    isfs_ctx* ctx = _isfs_writable_volume(&path, &res);
+    if(!ctx) return res;
+
+    res = _isfs_create(ctx, path, ISFS_FST_TYPE_DIR, NULL);
+    if(res) return res;
+    return _isfs_done(ctx, 0);
+}
+
+// Moves an entry, a file that's at new_path already is replaced. Open files
+// of a renamed file have to be opened again.
+int isfs_rename(const char* old_path, const char* new_path)
+{
+    int res;
+    isfs_ctx* ctx = _isfs_writable_volume(&old_path, &res);
+    if(!ctx) return res;
+
+    isfs_ctx* new_ctx = NULL;
+    new_path = _isfs_do_volume(new_path, &new_ctx);
+    if(!new_path) return -ENOENT;
+    if(new_ctx != ctx) return -EXDEV;
+
+    isfs_fst* fst = _isfs_find_fst(ctx, old_path, NULL);
+    if(!fst) return -ENOENT;
+    if(fst == _isfs_get_fst(ctx)) return -EBUSY;
+
+    isfs_fst* parent;
+    const char* name;
+    size_t len;
+    res = _isfs_find_parent(ctx, new_path, &parent, &name, &len);
+    if(res) return res;
+
+    // a directory can't go into itself
+    size_t old_len = strlen(old_path);
+    if(_isfs_fst_is_dir(fst) && !strncmp(old_path, new_path, old_len) && new_path[old_len] == '/')
+        return -EINVAL;
+
+    void* link;
+    isfs_fst* target = _isfs_find_fst(ctx, new_path, &link);
+    if(target == fst) return 0;
+    if(target) {
+        if(!_isfs_fst_is_file(target) || !_isfs_fst_is_file(fst))
+            return -EEXIST;
+        _isfs_remove(ctx, target, link);
+    }
+
+    // the link can't be looked up before, removing the target may change it
+    _isfs_find_fst(ctx, old_path, &link);
+    memcpy(link, &fst->sib, sizeof(fst->sib));
+    fst->sib = parent->sub;
+    parent->sub = _isfs_fst_num(ctx, fst);
+
+    bool renamed = !_isfs_name_equal(fst, name, len);
+    _isfs_set_name(fst, name, len);
+    _isfs_index_invalidate(ctx);
+
+    if(renamed && _isfs_fst_is_file(fst) && fst->size)
+        res = _isfs_rewrite_file(ctx, fst);
+
+    return _isfs_done(ctx, res);
+}
+
+// Writes size bytes at the file offset, zeros if buffer is NULL.
+static int _isfs_write(isfs_ctx* ctx, isfs_file* file, const u8* buffer, size_t size, size_t* bytes_written)
+{
+    isfs_fst* fst = file->fst;
+    size_t total = size;
+
+    u32 length = (fst->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    u32 end = (file->offset + size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    u16* chain = _isfs_build_index(ctx, fst, length, max(length, end));
+    if(!chain)
+        return -EIO;
+
+    int res = 0;
+    while(size) {
+        u32 n = file->offset / CLUSTER_SIZE;
+        size_t pos = file->offset % CLUSTER_SIZE;
+        u32 count = min((pos + size + CLUSTER_SIZE - 1) / CLUSTER_SIZE, (size_t)BLOCK_CLUSTERS);
+        size_t copy = min(size, count * CLUSTER_SIZE - pos);
+        u8* last = isfs_write_buf + (count - 1) * CLUSTER_SIZE;
+
+        // clusters that are only partly written keep the rest of their data
+        if(pos)
+            res = _isfs_read_file_cluster(ctx, fst, chain, length, n, isfs_write_buf);
+        if(!res && ((pos + copy) % CLUSTER_SIZE) && (count > 1 || !pos))
+            res = _isfs_read_file_cluster(ctx, fst, chain, length, n + count - 1, last);
+        if(res)
+            break;
+
+        if(buffer)
+            memcpy(isfs_write_buf + pos, buffer, copy);
+        else
+            memset(isfs_write_buf + pos, 0, copy);
+
+        res = _isfs_write_file_clusters(ctx, fst, chain, length, n, count, isfs_write_buf);
+        if(res < 0)
+            break;
+        length = res;
+        res = 0;
+
+        file->offset += copy;
+        if(buffer)
+            buffer += copy;
+        size -= copy;
+        if(file->offset > fst->size)
+            fst->size = file->offset;
+
+        ctx->dirty = true;
+        file->dirty = true;
+    }
+
+    // the chain is the index of the file now
+    if(file->index)
+        free(file->index);
+    file->index = chain;
+    file->cluster = file->offset / CLUSTER_SIZE < length ? chain[file->offset / CLUSTER_SIZE] : FAT_CLUSTER_LAST;
+
+    if(bytes_written)
+        *bytes_written = total - size;
+    return res;
+}
+
+static isfs_ctx* _isfs_writable_file(isfs_file* file, int* res)
+{
+    isfs_ctx* ctx = file ? isfs_get_volume(file->volume) : NULL;
+    if(!ctx || !file->fst || !file->write) {
+        *res = -EBADF;
+        return NULL;
+    }
+    *res = _isfs_prepare_write(ctx);
+    return *res ? NULL : ctx;
+}
+
+// Other files open on the same file don't see the new clusters, they have to
+// be opened again.
+int isfs_write(isfs_file* file, const void* buffer, size_t size, size_t* bytes_written)
+{
+    if(!buffer) return -EINVAL;
+
+    int res;
+    isfs_ctx* ctx = _isfs_writable_file(file, &res);
+    if(!ctx) return res;
+
+    if(file->append)
+        file->offset = file->fst->size;
+
+    return _isfs_write(ctx, file, buffer, size, bytes_written);
+}
+
+int isfs_truncate(isfs_file* file, size_t size)
+{
+    int res;
+    isfs_ctx* ctx = _isfs_writable_file(file, &res);
+    if(!ctx) return res;
+
+    isfs_fst* fst = file->fst;
+    size_t offset = file->offset;
+
+    if(size > fst->size) {
+        file->offset = fst->size;
+        res = _isfs_write(ctx, file, NULL, size - fst->size, NULL);
+        file->offset = offset;
+        if(res)
+            return res;
+    } else if(size < fst->size) {
+        u16* fat = _isfs_get_fat(ctx);
+        u32 keep = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+        if(keep) {
+            u16 cluster = fst->sub;
+            for(u32 i = 1; i < keep && cluster < FAT_CLUSTER_LAST; i++)
+                cluster = fat[cluster];
+            if(cluster >= FAT_CLUSTER_LAST)
+                return -EIO;
+            _isfs_free_chain(ctx, fat[cluster]);
+            fat[cluster] = FAT_CLUSTER_LAST;
+        } else {
+            _isfs_free_chain(ctx, fst->sub);
+            fst->sub = FAT_CLUSTER_LAST;
+        }
+        fst->size = size;
+        ctx->dirty = true;
+        file->dirty = true;
+    }
+
+    if(file->index) {
+        free(file->index);
+        file->index = NULL;
+    }
+    return isfs_seek(file, min(offset, size), SEEK_SET) ? -EIO : 0;
+}
+
+int isfs_sync(isfs_file* file)
+{
+    if(!file || !file->dirty) return 0;
+
+    isfs_ctx* ctx = isfs_get_volume(file->volume);
+    if(!ctx) return -EBADF;
+
+    file->dirty = false;
+    return _isfs_done(ctx, 0);
+}
+
+// Collects the changes until the matching isfs_transaction_end into a single
+// commit of the superblock. Transactions can be nested.
+int isfs_transaction_begin(int volume)
+{
+    isfs_ctx* ctx = isfs_get_volume(volume);
+    if(!ctx || !ctx->mounted) return -ENODEV;
+
+    ctx->transaction++;
+    return 0;
+}
+
+int isfs_transaction_end(int volume)
+{
+    isfs_ctx* ctx = isfs_get_volume(volume);
+    if(!ctx || !ctx->mounted) return -ENODEV;
+    if(!ctx->transaction) return -EINVAL;
+
+    if(--ctx->transaction)
+        return 0;
+    return _isfs_commit(ctx);
+}
+
+// Drops all changes since the last commit and ends the transaction. Files of
+// the volume should be closed before.
+int isfs_transaction_abort(int volume)
+{
+    isfs_ctx* ctx = isfs_get_volume(volume);
+    if(!ctx || !ctx->mounted) return -ENODEV;
+
+    ctx->transaction = 0;
+    return _isfs_revert(ctx);
+}
+#endif //NAND_WRITE_ENABLED
+
+int isfs_diropen(isfs_dir* dir, const char* path)
+{
+    if(!dir || !path) return -1;
+
+    isfs_ctx* ctx = NULL;
+    path = _isfs_do_volume(path, &ctx);
+    if(!ctx) return -2;
+
+    isfs_fst* fst = _isfs_find_fst(ctx, path, NULL);
+    if(!fst) return -3;
+
+    if(!_isfs_fst_is_dir(fst)) return -4;
+    if(fst->sub == 0xFFFF) return -2;
+
+    isfs_fst* root = _isfs_get_fst(ctx);
+
+    memset(dir, 0, sizeof(isfs_dir));
+    dir->volume = ctx->volume;
+    dir->dir = fst;
+    dir->child = &root[fst->sub];
+
+    return 0;
+}
+
+int isfs_dirread(isfs_dir* dir, isfs_fst** info)
+{
+    if(!dir) return -1;
+
+    isfs_ctx* ctx = isfs_get_volume(dir->volume);
+    isfs_fst* fst = dir->dir;
+    if(!ctx || !fst) return -2;
+
+    isfs_fst* root = _isfs_get_fst(ctx);
+
+    if(!info) {
+        dir->child = &root[fst->sub];
+        return 0;
+    }
+
+    *info = dir->child;
+
+    if(dir->child != NULL) {
+        if(dir->child->sib == 0xFFFF)
+            dir->child = NULL;
+        else
+            dir->child = &root[dir->child->sib];
+    }
+
+    return 0;
+}
+
+int isfs_dirreset(isfs_dir* dir)
+{
+    return isfs_dirread(dir, NULL);
+}
+
+int isfs_dirclose(isfs_dir* dir)
+{
+    if(!dir) return -1;
+    memset(dir, 0, sizeof(isfs_dir));
+
     return 0;
 }
 
@@ -986,10 +2040,29 @@ int isfs_unmount(int volume){
     if(!ctx->mounted)
         return 1;
 
+#ifdef NAND_WRITE_ENABLED
+    // The changes are still in ctx->super, commit them before it goes away.
+    ctx->transaction = 0;
+    if(ctx->dirty && _isfs_commit(ctx))
+        printf("ISFS: Failed to commit the changes to %s!\n", ctx->name);
+    ctx->dirty = false;
+    if(ctx->pending_free) {
+        free(ctx->pending_free);
+        ctx->pending_free = NULL;
+    }
+#endif
+
     if(ctx->super) {
         free(ctx->super);
         ctx->super = NULL;
     }
+    _isfs_cache_invalidate(ctx->volume, 0, 0);
+
+    if(ctx->fst_index) {
+        free(ctx->fst_index);
+        ctx->fst_index = NULL;
+    }
+    _isfs_index_invalidate(ctx);
 
     RemoveDevice(ctx->name);
     ctx->mounted = false;
@@ -1063,21 +2136,100 @@ static ssize_t _isfsdev_read_r(struct _reent* r, void* fd, char* ptr, size_t len
 static int _isfsdev_open_r(struct _reent* r, void* fileStruct, const char* path, int flags, int mode)
 {
     isfs_file* fp = (isfs_file*) fileStruct;
+    bool write = (flags & O_ACCMODE) != O_RDONLY;
 
-    if (flags & (O_WRONLY | O_RDWR | O_CREAT | O_EXCL | O_TRUNC)) {
+#ifdef NAND_WRITE_ENABLED
+    // A new file is committed together with what's written to it.
+    bool created = false;
+    if (flags & O_CREAT) {
+        const char* vpath = path;
+        int res;
+        isfs_ctx* ctx = _isfs_writable_volume(&vpath, &res);
+        if(ctx) {
+            res = _isfs_create(ctx, vpath, ISFS_FST_TYPE_FILE, NULL);
+            if(res == -EEXIST && !(flags & O_EXCL))
+                res = 0;
+            else if(!res)
+                created = ctx->dirty = true;
+        }
+        if(res) {
+            r->_errno = -res;
+            return -1;
+        }
+    }
+#else
+    if (write || (flags & (O_CREAT | O_TRUNC))) {
         r->_errno = ENOSYS;
         return -1;
     }
+#endif
 
     int res = isfs_open(fp, path);
     if(res) {
-        r->_errno = EIO;
+        r->_errno = res == -3 ? ENOENT : res == -4 ? EISDIR : EIO;
         return -1;
     }
 
+#ifdef NAND_WRITE_ENABLED
+    fp->write = write;
+    fp->append = !!(flags & O_APPEND);
+    fp->dirty = created;
+
+    if (write && (flags & O_TRUNC)) {
+        res = isfs_truncate(fp, 0);
+        if(res) {
+            isfs_close(fp);
+            r->_errno = -res;
+            return -1;
+        }
+    }
+#endif
+
     return 0;
 }
 
+#ifdef NAND_WRITE_ENABLED
+static ssize_t _isfsdev_write_r(struct _reent* r, void* fd, const char* ptr, size_t len)
+{
+    isfs_file* fp = (isfs_file*) fd;
+
+    size_t written = 0;
+    int res = isfs_write(fp, ptr, len, &written);
+    if(res && !written) {
+        r->_errno = -res;
+        return -1;
+    }
+
+    return written;
+}
+
+static int _isfsdev_ftruncate_r(struct _reent* r, void* fd, off_t len)
+{
+    isfs_file* fp = (isfs_file*) fd;
+
+    int res = len < 0 ? -EINVAL : isfs_truncate(fp, len);
+    if(res) {
+        r->_errno = -res;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _isfsdev_fsync_r(struct _reent* r, void* fd)
+{
+    isfs_file* fp = (isfs_file*) fd;
+
+    int res = isfs_sync(fp);
+    if(res) {
+        r->_errno = -res;
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
 static off_t _isfsdev_seek_r(struct _reent* r, void* fd, off_t pos, int dir)
 {
     isfs_file* fp = (isfs_file*) fd;
@@ -1174,6 +2326,24 @@ static int _isfsdev_unlink_r(struct _reent* r, const char* path){
     }
     return 0;
 }
+
+static int _isfsdev_mkdir_r(struct _reent* r, const char* path, int mode){
+    int res = isfs_mkdir(path);
+    if(res) {
+        r->_errno = -res;
+        return -1;
+    }
+    return 0;
+}
+
+static int _isfsdev_rename_r(struct _reent* r, const char* oldName, const char* newName){
+    int res = isfs_rename(oldName, newName);
+    if(res) {
+        r->_errno = -res;
+        return -1;
+    }
+    return 0;
+}
 #endif
 
 int _isfsdev_init(isfs_ctx* ctx)
@@ -1192,14 +2362,9 @@ int _isfsdev_init(isfs_ctx* ctx)
     dotab->chmod_r = _isfsdev_stub_r;
     dotab->fchmod_r = _isfsdev_stub_r;
     dotab->fstat_r = _isfsdev_stub_r;
-    dotab->fsync_r = _isfsdev_stub_r;
-    dotab->ftruncate_r = _isfsdev_stub_r;
     dotab->link_r = _isfsdev_stub_r;
-    dotab->mkdir_r = _isfsdev_stub_r;
-    dotab->rename_r = _isfsdev_stub_r;
     dotab->rmdir_r = _isfsdev_stub_r;
     dotab->statvfs_r = _isfsdev_stub_r;
-    dotab->write_r = _isfsdev_stub_r;
 
     dotab->close_r = _isfsdev_close_r;
     dotab->open_r = _isfsdev_open_r;
@@ -1212,8 +2377,18 @@ int _isfsdev_init(isfs_ctx* ctx)
     dotab->dirreset_r = _isfsdev_dirreset_r;
 #ifdef NAND_WRITE_ENABLED
     dotab->unlink_r = _isfsdev_unlink_r;
+    dotab->write_r = _isfsdev_write_r;
+    dotab->ftruncate_r = _isfsdev_ftruncate_r;
+    dotab->fsync_r = _isfsdev_fsync_r;
+    dotab->mkdir_r = _isfsdev_mkdir_r;
+    dotab->rename_r = _isfsdev_rename_r;
 #else
     dotab->unlink_r = _isfsdev_stub_r;
+    dotab->write_r = _isfsdev_stub_r;
+    dotab->ftruncate_r = _isfsdev_stub_r;
+    dotab->fsync_r = _isfsdev_stub_r;
+    dotab->mkdir_r = _isfsdev_stub_r;
+    dotab->rename_r = _isfsdev_stub_r;
 #endif
 
     AddDevice(dotab);
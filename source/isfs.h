@@ -14,6 +14,7 @@
 #include "types.h"
 #include "nand.h"
 #include "fatfs/ff.h"
+#include "hmac.h"
 #include <sys/iosupport.h>
 
 #define ISFSVOL_SLC             0
@@ -60,6 +61,11 @@ typedef struct {
 
 #include "isfshax.h"
 
+typedef struct {
+    u16 parent;
+    u16 fst;
+} isfs_fst_slot;
+
 typedef struct {
     int volume;
     const char name[0x10];
@@ -74,6 +80,13 @@ typedef struct {
     u8 isfshax_slots[ISFSHAX_REDUNDANCY];
     u32 aes[0x10/sizeof(u32)];
     u8 hmac[0x14];
+    hmac_key hmac_key;
+    isfs_fst_slot* fst_index;   // path lookup table, see _isfs_index_fst
+    u8* fst_index_super;        // super and generation the table was built for
+    u32 fst_index_generation;
+    int transaction;            // nesting depth of isfs_transaction_begin
+    bool dirty;                 // super has changes that aren't committed yet
+    u8* pending_free;           // bitmaps of clusters freed by the last commits
     devoptab_t devoptab;
     FIL* file;
 } isfs_ctx;
@@ -83,6 +96,10 @@ typedef struct {
     isfs_fst* fst;
     size_t offset;
     u16 cluster;
+    u16* index; // cluster chain of the file, built by the first seek
+    bool write;
+    bool append;
+    bool dirty; // written to since the last commit
 } isfs_file;
 
 typedef struct {
@@ -141,6 +158,18 @@ int isfs_write_volume(const isfs_ctx* ctx, u32 start_cluster, u32 cluster_count,
 int isfs_write_super(isfs_ctx *ctx, void *super, int index);
 int isfs_commit_super(isfs_ctx* ctx);
 int isfs_super_mark_slot(isfs_ctx *ctx, u32 index, u16 marker);
+
+int isfs_unlink(const char* path);
+int isfs_create(const char* path);
+int isfs_mkdir(const char* path);
+int isfs_rename(const char* old_path, const char* new_path);
+int isfs_write(isfs_file* file, const void* buffer, size_t size, size_t* bytes_written);
+int isfs_truncate(isfs_file* file, size_t size);
+int isfs_sync(isfs_file* file);
+
+int isfs_transaction_begin(int volume);
+int isfs_transaction_end(int volume);
+int isfs_transaction_abort(int volume);
 #endif
 
 u16* _isfs_get_fat(isfs_ctx* ctx);
@@ -53,6 +53,7 @@
 #include "isfshax.h"
 #include "rednand.h"
 #include "isfshax_patch.h"
+#include "bench.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -595,6 +596,7 @@ menu menu_main = {
         {"Backup and Restore", &dump_menu_show},
         {"Interactive debug console", &main_interactive_console},
         {"PRSH tweaks", &prsh_menu},
+        {"Benchmarks", &bench_menu_show},
         {"Display crash log", &main_get_crash},
         {"Clear crash log", &main_reset_crash},
         {"Restart minute", &main_reload},
@@ -603,7 +605,7 @@ menu menu_main = {
         {"Credits", &main_credits},
         //{"ISFS test", &isfs_test},
     },
-    18, // number of options
+    19, // number of options
     0,
     0
 };
@@ -0,0 +1,275 @@
+/*
+ *  minute - a port of the "mini" IOS replacement for the Wii U.
+ *
+ *  Copyright (C) 2016          SALT
+ *  Copyright (C) 2016          Daz Jones <daz@dazzozo.com>
+ *
+ *  This code is licensed to you under the terms of the GNU GPL, version 2;
+ *  see file COPYING or http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt
+ */
+
+#ifndef MINUTE_BOOT1
+#ifndef FASTBOOT
+
+#include "manifest.h"
+#include "utils.h"
+#include "crc32.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MANIFEST_ENTRY_LEN  (18) // "%08lX %08lX\n"
+#define MANIFEST_CRC_LEN    (15) // "CRC32 %08lX\n"
+#define MANIFEST_SHA_LEN    (5 + SHA_HASH_SIZE * 2 + 1) // "SHA1 <hex>\n"
+
+static u32 _manifest_header(char* buf, size_t len, u64 size)
+{
+    return snprintf(buf, len, "MINUTE-MANIFEST 1 SIZE %016llX CHUNK %08lX\n", size, (u32)MANIFEST_CHUNK_SIZE);
+}
+
+static void _manifest_end(manifest* mft)
+{
+    f_close(&mft->file);
+    mft->open = 0;
+}
+
+static int _manifest_open(manifest* mft, const char* path, u64 size, u64 start, int verify)
+{
+    char header[64], line[64];
+    UINT btx = 0;
+    FRESULT fres;
+
+    memset(mft, 0, sizeof(*mft));
+    strncpy(mft->path, path, sizeof(mft->path) - 1);
+    if(start % MANIFEST_CHUNK_SIZE)
+        return -1;
+
+    BYTE mode = FA_READ;
+    if(!verify)
+        mode = start ? (FA_READ | FA_WRITE | FA_OPEN_ALWAYS) : (FA_WRITE | FA_CREATE_ALWAYS);
+
+    fres = f_open(&mft->file, path, mode);
+    if(fres != FR_OK)
+        return -1;
+
+    mft->header_len = _manifest_header(header, sizeof(header), size);
+
+    if(verify || start) {
+        // The header has to match exactly, otherwise it belongs to another image.
+        fres = f_read(&mft->file, line, mft->header_len, &btx);
+        DWORD offset = mft->header_len + (start / MANIFEST_CHUNK_SIZE) * MANIFEST_ENTRY_LEN;
+        if(fres != FR_OK || btx != mft->header_len || memcmp(line, header, mft->header_len) ||
+           f_size(&mft->file) < offset) {
+            f_close(&mft->file);
+            printf("%s doesn't match the image.\n", path);
+            return -2;
+        }
+
+        // Pick up the image CRC of the chunks before start.
+        for(u32 i = 0; i < start / MANIFEST_CHUNK_SIZE; i++) {
+            fres = f_read(&mft->file, line, MANIFEST_ENTRY_LEN, &btx);
+            if(fres != FR_OK || btx != MANIFEST_ENTRY_LEN) {
+                f_close(&mft->file);
+                printf("Failed to read %s (%d).\n", path, fres);
+                return -2;
+            }
+            mft->image_crc = crc32_combine(mft->image_crc, strtoul(line + 9, NULL, 16), MANIFEST_CHUNK_SIZE);
+        }
+    } else {
+        fres = f_write(&mft->file, header, mft->header_len, &btx);
+        if(fres != FR_OK || btx != mft->header_len) {
+            f_close(&mft->file);
+            printf("Failed to write %s (%d).\n", path, fres);
+            return -3;
+        }
+    }
+
+    mft->open = 1;
+    mft->verify = verify;
+    mft->whole = (start == 0);
+    mft->size = size;
+    mft->pos = start;
+    if(mft->whole)
+        sha_init(&mft->sha);
+
+    return 0;
+}
+
+// start (a multiple of MANIFEST_CHUNK_SIZE) continues the manifest of an interrupted
+// dump. The SHA-1 of the whole image is only available when starting from 0.
+int manifest_create(manifest* mft, const char* path, u64 size, u64 start)
+{
+    return _manifest_open(mft, path, size, start, 0);
+}
+
+int manifest_verify(manifest* mft, const char* path, u64 size, u64 start)
+{
+    return _manifest_open(mft, path, size, start, 1);
+}
+
+static int _manifest_chunk(manifest* mft)
+{
+    char line[MANIFEST_ENTRY_LEN + 1];
+    u32 index = (mft->pos - 1) / MANIFEST_CHUNK_SIZE;
+    UINT btx = 0;
+    FRESULT fres;
+
+    mft->image_crc = crc32_combine(mft->image_crc, mft->chunk_crc, (mft->pos - 1) % MANIFEST_CHUNK_SIZE + 1);
+
+    if(!mft->verify) {
+        snprintf(line, sizeof(line), "%08lX %08lX\n", index, mft->chunk_crc);
+        fres = f_write(&mft->file, line, MANIFEST_ENTRY_LEN, &btx);
+        if(fres != FR_OK || btx != MANIFEST_ENTRY_LEN) {
+            printf("Failed to write %s (%d), continuing without it.\n", mft->path, fres);
+            _manifest_end(mft);
+        }
+        return 0;
+    }
+
+    fres = f_read(&mft->file, line, MANIFEST_ENTRY_LEN, &btx);
+    if(fres != FR_OK || btx != MANIFEST_ENTRY_LEN) {
+        printf("%s ends at chunk 0x%lX, the rest is not verified.\n", mft->path, index);
+        _manifest_end(mft);
+        return 0;
+    }
+    line[MANIFEST_ENTRY_LEN] = '\0';
+
+    u32 expected_index = strtoul(line, NULL, 16);
+    u32 expected_crc = strtoul(line + 9, NULL, 16);
+    if(expected_index != index || expected_crc != mft->chunk_crc) {
+        printf("Chunk 0x%lX: CRC32 %08lX, %s has %08lX!\n", index, mft->chunk_crc, mft->path, expected_crc);
+        mft->mismatches++;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Hashes the next len bytes of the image. Returns -1 if a finished chunk doesn't
+// match the manifest that is being verified.
+int manifest_update(manifest* mft, const void* data, u32 len)
+{
+    const u8* ptr = data;
+    int res = 0;
+
+    if(!mft->open)
+        return 0;
+
+    if(mft->pos + len > mft->size)
+        len = mft->size - mft->pos;
+    // The SHA engine works on the data while the CPU does the CRCs.
+    if(mft->whole)
+        sha_start_update(&mft->sha, ptr, len);
+
+    while(len && mft->open) {
+        u32 count = min(len, MANIFEST_CHUNK_SIZE - (u32)(mft->pos % MANIFEST_CHUNK_SIZE));
+        mft->chunk_crc = crc32_update(mft->chunk_crc, ptr, count);
+        mft->pos += count;
+        ptr += count;
+        len -= count;
+
+        if((mft->pos % MANIFEST_CHUNK_SIZE) == 0 || mft->pos == mft->size) {
+            if(_manifest_chunk(mft))
+                res = -1;
+            mft->chunk_crc = 0;
+        }
+    }
+
+    if(mft->whole)
+        sha_end_update(&mft->sha);
+
+    return res;
+}
+
+// Makes the entries so far survive a power loss, for resuming.
+int manifest_sync(manifest* mft)
+{
+    if(!mft->open || mft->verify)
+        return 0;
+
+    return f_sync(&mft->file) == FR_OK ? 0 : -1;
+}
+
+// Checks or writes one of the trailer lines.
+static int _manifest_trailer(manifest* mft, const char* line, u32 len)
+{
+    char expected[MANIFEST_SHA_LEN];
+    UINT btx = 0;
+
+    if(!mft->verify)
+        return (f_write(&mft->file, line, len, &btx) == FR_OK && btx == len) ? 0 : -1;
+
+    // A resumed dump has no SHA-1 line, that's not a mismatch.
+    if(f_read(&mft->file, expected, len, &btx) != FR_OK || btx != len)
+        return 0;
+    if(memcmp(expected, line, len))
+        return -2;
+
+    return 1;
+}
+
+int manifest_close(manifest* mft)
+{
+    char line[MANIFEST_SHA_LEN + 1];
+    char hex[SHA_HASH_SIZE * 2 + 1];
+    u8 digest[SHA_HASH_SIZE];
+    int res = 0;
+
+    if(!mft->open)
+        return mft->mismatches ? -1 : 0;
+
+    if(mft->pos == mft->size) {
+        snprintf(line, sizeof(line), "CRC32 %08lX\n", mft->image_crc);
+        int tres = _manifest_trailer(mft, line, MANIFEST_CRC_LEN);
+        if(tres == -2)
+            printf("CRC32 %08lX doesn't match %s!\n", mft->image_crc, mft->path);
+        if(tres < 0)
+            res = -1;
+    }
+
+    if(mft->whole && mft->pos == mft->size && !res) {
+        sha_final(&mft->sha, digest);
+        for(int i = 0; i < SHA_HASH_SIZE; i++)
+            sprintf(&hex[i * 2], "%02X", digest[i]);
+        snprintf(line, sizeof(line), "SHA1 %s\n", hex);
+
+        int tres = _manifest_trailer(mft, line, MANIFEST_SHA_LEN);
+        if(tres == -2)
+            printf("SHA-1 %s doesn't match %s!\n", hex, mft->path);
+        else if(tres == 1)
+            printf("SHA-1 %s verified.\n", hex);
+        else if(tres == 0 && !mft->verify)
+            printf("%s: SHA-1 %s\n", mft->path, hex);
+        if(tres < 0)
+            res = -1;
+    }
+
+    // Cut off what a longer, earlier dump left behind.
+    if(!mft->verify)
+        f_truncate(&mft->file);
+
+    if(f_close(&mft->file) != FR_OK && !mft->verify)
+        res = -1;
+    mft->open = 0;
+
+    if(mft->mismatches)
+        res = -1;
+
+    return res;
+}
+
+// Writes the manifest of a small image that is dumped in one piece.
+int manifest_write(const char* path, const void* data, u32 len)
+{
+    manifest mft;
+
+    if(manifest_create(&mft, path, len, 0))
+        return -1;
+    manifest_update(&mft, data, len);
+
+    return manifest_close(&mft);
+}
+
+#endif // FASTBOOT
+#endif // MINUTE_BOOT1
@@ -0,0 +1,58 @@
+/*
+ *  minute - a port of the "mini" IOS replacement for the Wii U.
+ *
+ *  Copyright (C) 2016          SALT
+ *  Copyright (C) 2016          Daz Jones <daz@dazzozo.com>
+ *
+ *  This code is licensed to you under the terms of the GNU GPL, version 2;
+ *  see file COPYING or http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt
+ */
+
+#ifndef _MANIFEST_H
+#define _MANIFEST_H
+
+#include "types.h"
+#include "sha.h"
+#include "ff.h"
+
+// Hash manifests for dumps. A manifest is a text file next to the image with a CRC32
+// for every 1 MiB chunk and a CRC32 and SHA-1 of the whole image, computed while the
+// image is being dumped. Restores read it back and check the image chunk by chunk.
+//
+//   MINUTE-MANIFEST 1 SIZE 0000000021000000 CHUNK 00100000
+//   00000000 1A2B3C4D
+//   ...
+//   CRC32 89ABCDEF
+//   SHA1 0123456789ABCDEF0123456789ABCDEF01234567
+//
+// All lines have a fixed width, so an interrupted dump can continue its manifest.
+// The image CRC32 is combined from the chunk CRCs, so it survives that, the SHA-1
+// line is only present if the image was hashed in one go.
+
+#define MANIFEST_CHUNK_SIZE     (0x100000)
+#define MANIFEST_CHUNK_SECTORS  (MANIFEST_CHUNK_SIZE / 512)
+
+typedef struct {
+    FIL file;
+    char path[64];
+    int open;
+    int verify;     // checking an existing manifest instead of writing one
+    int whole;      // hashed from the start, so the SHA-1 covers the whole image
+    u32 header_len;
+    u64 size;
+    u64 pos;
+    u32 chunk_crc;
+    u32 image_crc;
+    u32 mismatches;
+    sha_ctx sha;
+} manifest;
+
+int manifest_create(manifest* mft, const char* path, u64 size, u64 start);
+int manifest_verify(manifest* mft, const char* path, u64 size, u64 start);
+int manifest_update(manifest* mft, const void* data, u32 len);
+int manifest_sync(manifest* mft);
+int manifest_close(manifest* mft);
+
+int manifest_write(const char* path, const void* data, u32 len);
+
+#endif
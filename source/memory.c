@@ -17,8 +17,11 @@
 #include "latte.h"
 #include "irq.h"
 
+#include <string.h>
+
 void _dc_inval_entries(void *start, int count);
 void _dc_flush_entries(const void *start, int count);
+void _dc_flush_inval_entries(const void *start, int count);
 void _dc_flush(void);
 void _ic_inval(void);
 void _drain_write_buffer(void);
@@ -319,6 +322,210 @@ u32 can_sdcard_dma_addr(void *p)
     return 1;
 }
 
+// Line-aligned ranges that are handed to a device and not taken back yet. The
+// CPU keeps its hands off them meanwhile, so the cache holds no dirty lines for
+// them, and no lines at all if a device writes to them.
+#define DMA_OWNED_MAX   16
+
+static struct {
+    u32 start;
+    u32 end;
+    int dir;
+} dma_owned[DMA_OWNED_MAX];
+static int dma_owned_count = 0;
+
+dma_stats dma_counters;
+
+static int _dma_find(u32 start, u32 end)
+{
+    for (int i = 0; i < dma_owned_count; i++)
+        if (dma_owned[i].start <= start && end <= dma_owned[i].end)
+            return i;
+    return -1;
+}
+
+static void _dma_drop(int i)
+{
+    dma_owned[i] = dma_owned[--dma_owned_count];
+}
+
+// Cuts [start, end) out of the owned ranges. A piece that doesn't fit anymore is
+// just forgotten, that only costs a flush later.
+static void _dma_forget(u32 start, u32 end)
+{
+    for (int i = 0; i < dma_owned_count; i++) {
+        u32 s = dma_owned[i].start, e = dma_owned[i].end;
+        if (e <= start || end <= s)
+            continue;
+
+        if (s < start && end < e && dma_owned_count < DMA_OWNED_MAX) {
+            dma_owned[dma_owned_count].start = end;
+            dma_owned[dma_owned_count].end = e;
+            dma_owned[dma_owned_count].dir = dma_owned[i].dir;
+            dma_owned_count++;
+        }
+
+        if (s < start) {
+            dma_owned[i].end = start;
+        } else if (end < e) {
+            dma_owned[i].start = end;
+        } else {
+            _dma_drop(i--);
+        }
+    }
+}
+
+// Adds a range, merging it with adjacent ones in the same state.
+static void _dma_remember(u32 start, u32 end, int dir)
+{
+    for (int i = 0; i < dma_owned_count; i++) {
+        if (dma_owned[i].dir != dir || dma_owned[i].end < start || end < dma_owned[i].start)
+            continue;
+        start = min(start, dma_owned[i].start);
+        end = max(end, dma_owned[i].end);
+        _dma_drop(i--);
+    }
+
+    if (dma_owned_count == DMA_OWNED_MAX)
+        _dma_drop(0);
+
+    dma_owned[dma_owned_count].start = start;
+    dma_owned[dma_owned_count].end = end;
+    dma_owned[dma_owned_count].dir = dir;
+    dma_owned_count++;
+}
+
+// Hands a buffer to a device. Until dma_take, only the device may touch it. The
+// cache work is skipped for a range that is owned by a device already, so a buffer
+// can go from one engine to the next without a round trip through the cache.
+// dev is the device that reads the buffer, RB_NONE if the driver flushes it itself.
+void dma_give(const void *start, u32 size, int dir, enum rb_client dev)
+{
+    u32 cookie = irq_kill();
+    u32 s = (u32)ALIGN_BACKWARD(start, LINESIZE);
+    u32 e = (u32)ALIGN_FORWARD((u8*)start + size, LINESIZE);
+    u32 lines = (e - s) / LINESIZE;
+    int i = _dma_find(s, e);
+    int owned_dir = i >= 0 ? dma_owned[i].dir : 0;
+    bool cleaned = false;
+
+    dma_counters.gives++;
+
+    if (i >= 0 && ((owned_dir & DMA_FROM_DEVICE) || !(dir & DMA_FROM_DEVICE))) {
+        dma_counters.skipped_bytes += e - s;
+    } else if (i >= 0) {
+        // The device only read it so far, but partial lines may have picked up
+        // writes to whatever shares them since.
+        _dc_flush_inval_entries((void*)s, lines);
+        dma_counters.clean_bytes += e - s;
+        dma_counters.inval_bytes += e - s;
+        cleaned = true;
+    } else if (e - s > CACHESIZE) {
+        _dc_flush();
+        if (dir & DMA_FROM_DEVICE)
+            _dc_inval();
+        dma_counters.full_flushes++;
+        cleaned = true;
+    } else if (dir == DMA_FROM_DEVICE) {
+        // The device overwrites the whole lines, only partial ones have to be written back.
+        if ((u32)start != s) {
+            _dc_flush_entries((void*)s, 1);
+            dma_counters.clean_bytes += LINESIZE;
+            cleaned = true;
+        }
+        if ((u32)start + size != e && (e - LINESIZE != s || (u32)start == s)) {
+            _dc_flush_entries((void*)(e - LINESIZE), 1);
+            dma_counters.clean_bytes += LINESIZE;
+            cleaned = true;
+        }
+        _dc_inval_entries((void*)s, lines);
+        dma_counters.inval_bytes += e - s;
+    } else if (dir & DMA_FROM_DEVICE) {
+        _dc_flush_inval_entries((void*)s, lines);
+        dma_counters.clean_bytes += e - s;
+        dma_counters.inval_bytes += e - s;
+        cleaned = true;
+    } else {
+        _dc_flush_entries((void*)s, lines);
+        dma_counters.clean_bytes += e - s;
+        cleaned = true;
+    }
+
+    if (cleaned) {
+        _drain_write_buffer();
+        ahb_flush_from(WB_AIM);
+        dma_counters.ahb_flushes++;
+    }
+
+    _dma_forget(s, e);
+    _dma_remember(s, e, dir | owned_dir);
+
+    if ((dir & DMA_TO_DEVICE) && dev != RB_NONE) {
+        ahb_flush_to(dev);
+        dma_counters.ahb_flushes++;
+    }
+    irq_restore(cookie);
+}
+
+// Drops a cache line the device wrote [start, end) of. The CPU may have written
+// the rest of it in the meantime, neither a clean nor an invalidate alone would
+// keep both, so the rest is copied back over what the device left in memory.
+static void _dma_take_line(u32 line, u32 start, u32 end)
+{
+    u8 cached[LINESIZE];
+    memcpy(cached, (void*)line, LINESIZE);
+    _dc_inval_entries((void*)line, 1);
+    memcpy((void*)line, cached, start - line);
+    memcpy((void*)end, &cached[end - line], line + LINESIZE - end);
+    dma_counters.inval_bytes += LINESIZE;
+}
+
+// Takes a buffer back from a device, once the device is done with it. dev is the
+// device that wrote it, WB_NONE if the driver did the AHB flushes already.
+void dma_take(const void *start, u32 size, int dir, enum wb_client dev)
+{
+    u32 cookie = irq_kill();
+    u32 s = (u32)ALIGN_BACKWARD(start, LINESIZE);
+    u32 e = (u32)ALIGN_FORWARD((u8*)start + size, LINESIZE);
+
+    dma_counters.takes++;
+
+    if ((dir & DMA_FROM_DEVICE) && dev != WB_NONE) {
+        ahb_flush_from(dev);
+        ahb_flush_to(RB_IOD);
+        dma_counters.ahb_flushes += 2;
+    }
+
+    if (dir & DMA_FROM_DEVICE) {
+        int i = _dma_find(s, e);
+        u32 head = (u32)start != s ? s + LINESIZE : s;
+        u32 tail = (u32)start + size != e ? e - LINESIZE : e;
+
+        // Partial lines are shared with something else.
+        if (head != s)
+            _dma_take_line(s, (u32)start, min((u32)start + size, head));
+        if (tail != e && tail >= head)
+            _dma_take_line(tail, max((u32)start, tail), (u32)start + size);
+
+        // The ARM926 doesn't fetch ahead, so the whole lines of a buffer the device
+        // owned can't have been loaded in the meantime.
+        if (!(i >= 0 && (dma_owned[i].dir & DMA_FROM_DEVICE)) && head < tail) {
+            _dc_inval_entries((void*)head, (tail - head) / LINESIZE);
+            dma_counters.inval_bytes += tail - head;
+        }
+    }
+
+    _dma_forget(s, e);
+    irq_restore(cookie);
+}
+
+void dma_stats_reset(void)
+{
+    u32 cookie = irq_kill();
+    memset(&dma_counters, 0, sizeof(dma_counters));
+    irq_restore(cookie);
+}
+
 #define SECTION             0x012
 
 #define NONBUFFERABLE       0x000
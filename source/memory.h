@@ -32,7 +32,8 @@ enum rb_client {
     RB_OHCI20 = 16,
     RB_SATA = 17,
     RB_AESS = 18,
-    RB_SHAS = 19
+    RB_SHAS = 19,
+    RB_NONE = -1 // see dma_give()
 };
 
 enum wb_client {
@@ -58,7 +59,8 @@ enum wb_client {
     WB_DMAA = 19,
     WB_DMAB = 20,
     WB_DMAC = 21,
-    WB_ALL = 22
+    WB_ALL = 22,
+    WB_NONE = -1 // see dma_take()
 };
 
 void dc_flushrange(const void *start, u32 size);
@@ -76,6 +78,27 @@ void mem_shutdown(void);
 u32 dma_addr(void *);
 u32 can_sdcard_dma_addr(void *p);
 
+/* DMA buffer ownership, see dma_give() */
+#define DMA_TO_DEVICE       1 // the device reads the buffer
+#define DMA_FROM_DEVICE     2 // the device writes the buffer
+#define DMA_BIDIRECTIONAL   (DMA_TO_DEVICE | DMA_FROM_DEVICE)
+
+typedef struct {
+    u32 gives;
+    u32 takes;
+    u32 clean_bytes;    // written back
+    u32 inval_bytes;    // invalidated, including the lines that were written back
+    u32 skipped_bytes;  // still owned by a device, nothing to do
+    u32 full_flushes;   // whole cache instead of a range
+    u32 ahb_flushes;
+} dma_stats;
+
+extern dma_stats dma_counters;
+
+void dma_give(const void *start, u32 size, int dir, enum rb_client dev);
+void dma_take(const void *start, u32 size, int dir, enum wb_client dev);
+void dma_stats_reset(void);
+
 static inline u32 get_cr(void)
 {
     u32 data;
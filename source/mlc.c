@@ -47,6 +47,9 @@ struct mlc_ctx {
     u32 num_sectors;
     u16 rca;
 
+    u32 erase_group;    // in sectors, 0 if unknown
+    u8 erased_value;    // what erased sectors read back as
+
     bool is_sd;
 };
 
@@ -259,6 +262,11 @@ static void _discover_emmc(void){
     card.num_sectors = (u32)ext_csd[0xD4] | ext_csd[0xD5] << 8 | ext_csd[0xD6] << 16 | ext_csd[0xD7] << 24;
     printf("mlc: card_type=0x%x sec_count=0x%lx\n", card_type, card.num_sectors);
 
+    // HC_ERASE_GRP_SIZE is in 512 KiB units. It only applies with ERASE_GROUP_DEF set,
+    // but the legacy erase group is smaller and divides it, so aligning to it is safe.
+    card.erase_group = ext_csd[224] * (0x80000 / SDMMC_DEFAULT_BLOCKLEN);
+    card.erased_value = ext_csd[181] ? 0xFF : 0x00; // ERASED_MEM_CONT
+
     if(!(card_type & 0xE)){
         printf("mlc: no SDR25 support\n");
         return;
@@ -645,6 +653,20 @@ int mlc_ack_card(void)
     return -1;
 }
 
+/*
+ * A request with more blocks than the host takes in one command (ADMA got
+ * disabled after an error, or the buffer can't be used for DMA) is done right
+ * away in several commands, the end call only reports the result.
+ */
+static int _mlc_split_command(int res, u16 opcode, struct sdmmc_command* cmdbuf)
+{
+    memset(cmdbuf, 0, sizeof(struct sdmmc_command));
+    cmdbuf->c_opcode = opcode;
+    cmdbuf->c_flags = SCF_ITSDONE;
+    cmdbuf->c_error = res ? EIO : 0;
+    return res;
+}
+
 int mlc_start_read(u32 blk_start, u32 blk_count, void *data, struct sdmmc_command* cmdbuf)
 {
 //  printf("%s(%u, %u, %p)\n", __FUNCTION__, blk_start, blk_count, data);
@@ -665,6 +687,9 @@ int mlc_start_read(u32 blk_start, u32 blk_count, void *data, struct sdmmc_comman
         return -1;
     }
 
+    if (blk_count > sdhc_max_block_count(card.handle, data))
+        return _mlc_split_command(mlc_read(blk_start, blk_count, data), MMC_READ_BLOCK_MULTIPLE, cmdbuf);
+
     memset(cmdbuf, 0, sizeof(struct sdmmc_command));
 
     if(blk_count > 1) {
@@ -682,7 +707,7 @@ int mlc_start_read(u32 blk_start, u32 blk_count, void *data, struct sdmmc_comman
     cmdbuf->c_datalen = blk_count * SDMMC_DEFAULT_BLOCKLEN;
     cmdbuf->c_blklen = SDMMC_DEFAULT_BLOCKLEN;
     cmdbuf->c_flags = SCF_RSP_R1 | SCF_CMD_READ;
-    sdhc_async_command(card.handle, cmdbuf);
+    sdhc_queue_command(card.handle, cmdbuf);
 
     if (cmdbuf->c_error) {
         printf("mlc: MMC_READ_BLOCK_%s failed with %d\n", blk_count > 1 ? "MULTIPLE" : "SINGLE", cmdbuf->c_error);
@@ -716,7 +741,7 @@ int mlc_end_read(struct sdmmc_command* cmdbuf)
         return -1;
     }
 
-    sdhc_async_response(card.handle, cmdbuf);
+    sdhc_queue_wait(card.handle, cmdbuf);
 
     if (cmdbuf->c_error) {
         printf("mlc: MMC_READ_BLOCK_%s failed with %d\n", cmdbuf->c_opcode == MMC_READ_BLOCK_MULTIPLE ? "MULTIPLE" : "SINGLE", cmdbuf->c_error);
@@ -755,33 +780,41 @@ int mlc_read(u32 blk_start, u32 blk_count, void *data)
         return -1;
     }
 
-    memset(&cmd, 0, sizeof(cmd));
+    u32 max_blocks = sdhc_max_block_count(card.handle, data);
+    while(blk_count) {
+        u32 cmd_blk_count = min(blk_count, max_blocks);
+        memset(&cmd, 0, sizeof(cmd));
 
-    if(blk_count > 1) {
-        DPRINTF(2, ("mlc: MMC_READ_BLOCK_MULTIPLE\n"));
-        cmd.c_opcode = MMC_READ_BLOCK_MULTIPLE;
-    } else {
-        DPRINTF(2, ("mlc: MMC_READ_BLOCK_SINGLE\n"));
-        cmd.c_opcode = MMC_READ_BLOCK_SINGLE;
-    }
-    if (card.sdhc_blockmode)
-        cmd.c_arg = blk_start;
-    else
-        cmd.c_arg = blk_start * SDMMC_DEFAULT_BLOCKLEN;
-    cmd.c_data = data;
-    cmd.c_datalen = blk_count * SDMMC_DEFAULT_BLOCKLEN;
-    cmd.c_blklen = SDMMC_DEFAULT_BLOCKLEN;
-    cmd.c_flags = SCF_RSP_R1 | SCF_CMD_READ;
-    sdhc_exec_command(card.handle, &cmd);
+        if(cmd_blk_count > 1) {
+            DPRINTF(2, ("mlc: MMC_READ_BLOCK_MULTIPLE\n"));
+            cmd.c_opcode = MMC_READ_BLOCK_MULTIPLE;
+        } else {
+            DPRINTF(2, ("mlc: MMC_READ_BLOCK_SINGLE\n"));
+            cmd.c_opcode = MMC_READ_BLOCK_SINGLE;
+        }
+        if (card.sdhc_blockmode)
+            cmd.c_arg = blk_start;
+        else
+            cmd.c_arg = blk_start * SDMMC_DEFAULT_BLOCKLEN;
+        cmd.c_data = data;
+        cmd.c_datalen = cmd_blk_count * SDMMC_DEFAULT_BLOCKLEN;
+        cmd.c_blklen = SDMMC_DEFAULT_BLOCKLEN;
+        cmd.c_flags = SCF_RSP_R1 | SCF_CMD_READ;
+        sdhc_exec_command(card.handle, &cmd);
 
-    if (cmd.c_error) {
-        printf("mlc: MMC_READ_BLOCK_%s failed with %d\n", blk_count > 1 ? "MULTIPLE" : "SINGLE", cmd.c_error);
-        return -1;
+        if (cmd.c_error) {
+            printf("mlc: MMC_READ_BLOCK_%s failed with %d\n", cmd_blk_count > 1 ? "MULTIPLE" : "SINGLE", cmd.c_error);
+            return -1;
+        }
+        if(cmd_blk_count > 1)
+            DPRINTF(2, ("mlc: MMC_READ_BLOCK_MULTIPLE done\n"));
+        else
+            DPRINTF(2, ("mlc: MMC_READ_BLOCK_SINGLE done\n"));
+
+        blk_count -= cmd_blk_count;
+        blk_start += cmd_blk_count;
+        data += cmd.c_datalen;
     }
-    if(blk_count > 1)
-        DPRINTF(2, ("mlc: MMC_READ_BLOCK_MULTIPLE done\n"));
-    else
-        DPRINTF(2, ("mlc: MMC_READ_BLOCK_SINGLE done\n"));
 
     return 0;
 }
@@ -808,6 +841,9 @@ int mlc_start_write(u32 blk_start, u32 blk_count, void *data, struct sdmmc_comma
         return -1;
     }
 
+    if (blk_count > sdhc_max_block_count(card.handle, data))
+        return _mlc_split_command(mlc_write(blk_start, blk_count, data), MMC_WRITE_BLOCK_MULTIPLE, cmdbuf);
+
     memset(cmdbuf, 0, sizeof(struct sdmmc_command));
 
     if(blk_count > 1) {
@@ -825,7 +861,7 @@ int mlc_start_write(u32 blk_start, u32 blk_count, void *data, struct sdmmc_comma
     cmdbuf->c_datalen = blk_count * SDMMC_DEFAULT_BLOCKLEN;
     cmdbuf->c_blklen = SDMMC_DEFAULT_BLOCKLEN;
     cmdbuf->c_flags = SCF_RSP_R1;
-    sdhc_async_command(card.handle, cmdbuf);
+    sdhc_queue_command(card.handle, cmdbuf);
 
     if (cmdbuf->c_error) {
         printf("mlc: MMC_WRITE_BLOCK_%s failed with %d\n", blk_count > 1 ? "MULTIPLE" : "SINGLE", cmdbuf->c_error);
@@ -862,7 +898,7 @@ int mlc_end_write(struct sdmmc_command* cmdbuf)
         return -1;
     }
 
-    sdhc_async_response(card.handle, cmdbuf);
+    sdhc_queue_wait(card.handle, cmdbuf);
 
     if (cmdbuf->c_error) {
         printf("mlc: MMC_WRITE_BLOCK_%s failed with %d\n", cmdbuf->c_opcode == MMC_WRITE_BLOCK_MULTIPLE ? "MULTIPLE" : "SINGLE", cmdbuf->c_error);
@@ -904,33 +940,41 @@ int mlc_write(u32 blk_start, u32 blk_count, void *data)
         return -1;
     }
 
-    memset(&cmd, 0, sizeof(cmd));
+    u32 max_blocks = sdhc_max_block_count(card.handle, data);
+    while(blk_count) {
+        u32 cmd_blk_count = min(blk_count, max_blocks);
+        memset(&cmd, 0, sizeof(cmd));
 
-    if(blk_count > 1) {
-        DPRINTF(2, ("mlc: MMC_WRITE_BLOCK_MULTIPLE\n"));
-        cmd.c_opcode = MMC_WRITE_BLOCK_MULTIPLE;
-    } else {
-        DPRINTF(2, ("mlc: MMC_WRITE_BLOCK_SINGLE\n"));
-        cmd.c_opcode = MMC_WRITE_BLOCK_SINGLE;
-    }
-    if (card.sdhc_blockmode)
-        cmd.c_arg = blk_start;
-    else
-        cmd.c_arg = blk_start * SDMMC_DEFAULT_BLOCKLEN;
-    cmd.c_data = data;
-    cmd.c_datalen = blk_count * SDMMC_DEFAULT_BLOCKLEN;
-    cmd.c_blklen = SDMMC_DEFAULT_BLOCKLEN;
-    cmd.c_flags = SCF_RSP_R1;
-    sdhc_exec_command(card.handle, &cmd);
+        if(cmd_blk_count > 1) {
+            DPRINTF(2, ("mlc: MMC_WRITE_BLOCK_MULTIPLE\n"));
+            cmd.c_opcode = MMC_WRITE_BLOCK_MULTIPLE;
+        } else {
+            DPRINTF(2, ("mlc: MMC_WRITE_BLOCK_SINGLE\n"));
+            cmd.c_opcode = MMC_WRITE_BLOCK_SINGLE;
+        }
+        if (card.sdhc_blockmode)
+            cmd.c_arg = blk_start;
+        else
+            cmd.c_arg = blk_start * SDMMC_DEFAULT_BLOCKLEN;
+        cmd.c_data = data;
+        cmd.c_datalen = cmd_blk_count * SDMMC_DEFAULT_BLOCKLEN;
+        cmd.c_blklen = SDMMC_DEFAULT_BLOCKLEN;
+        cmd.c_flags = SCF_RSP_R1;
+        sdhc_exec_command(card.handle, &cmd);
 
-    if (cmd.c_error) {
-        printf("mlc: MMC_WRITE_BLOCK_%s failed with %d\n", blk_count > 1 ? "MULTIPLE" : "SINGLE", cmd.c_error);
-        return -1;
+        if (cmd.c_error) {
+            printf("mlc: MMC_WRITE_BLOCK_%s failed with %d\n", cmd_blk_count > 1 ? "MULTIPLE" : "SINGLE", cmd.c_error);
+            return -1;
+        }
+        if(cmd_blk_count > 1)
+            DPRINTF(2, ("mlc: MMC_WRITE_BLOCK_MULTIPLE done\n"));
+        else
+            DPRINTF(2, ("mlc: MMC_WRITE_BLOCK_SINGLE done\n"));
+
+        blk_count -= cmd_blk_count;
+        blk_start += cmd_blk_count;
+        data += cmd.c_datalen;
     }
-    if(blk_count > 1)
-        DPRINTF(2, ("mlc: MMC_WRITE_BLOCK_MULTIPLE done\n"));
-    else
-        DPRINTF(2, ("mlc: MMC_WRITE_BLOCK_SINGLE done\n"));
 
     return 0;
 #endif
@@ -975,6 +1019,11 @@ u32 mlc_get_sectors(void)
     return card.num_sectors;
 }
 
+u32 mlc_get_max_blocks(void)
+{
+    return sdhc_max_block_count(card.handle, NULL);
+}
+
 void mlc_irq(void)
 {
     sdhc_intr(&mlc_host);
@@ -1069,6 +1118,33 @@ int mlc_erase(void){
 #endif
 }
 
+u32 mlc_get_erase_group(void)
+{
+    if (card.is_sd)
+        return 0;
+
+    return card.erase_group;
+}
+
+u8 mlc_get_erased_value(void)
+{
+    return card.erased_value;
+}
+
+int mlc_erase_range(u32 start, u32 count)
+{
+    if (!count)
+        return 0;
+
+    // Erase works on whole erase groups, anything else would take out neighbours.
+    if (!card.erase_group || card.is_sd || (start % card.erase_group) || (count % card.erase_group)) {
+        printf("mlc: erase range 0x%08lx+0x%lx not aligned to erase group\n", start, count);
+        return -1;
+    }
+
+    return mlc_do_erase(start, start + count - 1);
+}
+
 static void _mlc_do_init(void){
     struct sdhc_host_params params = {
         .attach = &mlc_attach,
@@ -28,6 +28,7 @@ int mlc_select(void);
 int mlc_check_card(void);
 int mlc_ack_card(void);
 u32 mlc_get_sectors(void);
+u32 mlc_get_max_blocks(void);
 
 int mlc_read(u32 blk_start, u32 blk_count, void *data);
 int mlc_write(u32 blk_start, u32 blk_count, void *data);
@@ -39,5 +40,8 @@ int mlc_start_write(u32 blk_start, u32 blk_count, void *data, struct sdmmc_comma
 int mlc_end_write(struct sdmmc_command* cmdbuf);
 
 int mlc_erase(void);
+int mlc_erase_range(u32 start, u32 count);
+u32 mlc_get_erase_group(void);
+u8 mlc_get_erased_value(void);
 
 #endif
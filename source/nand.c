@@ -70,17 +70,43 @@ static u8 nand_status_buf[STATUS_BUF_SIZE] ALIGNED(NAND_DATA_ALIGN);
 static u8 nand_spare_buf[96] ALIGNED(NAND_DATA_ALIGN);
 #endif
 
+// Requests are queued here and issued one after another, the next one is
+// started from nand_irq as soon as the current one completes.
+static nand_request *nand_queue_head = NULL;
+static nand_request *nand_queue_tail = NULL;
+static volatile int nand_queue_active = 0;
+
+static void __nand_issue(nand_request *req);
+static int nand_check_error(void);
+
 void nand_irq(void)
 {
-    //int code, tag, err = 0;
+    int err = 0;
     if(read32(NAND_CTRL) & NAND_ERROR) {
         printf("NAND: Error on IRQ\n");
-        //err = -1;
+        err = -1;
     }
     ahb_flush_from(WB_FLA);
     ahb_flush_to(RB_IOD);
 
     irq_flag = 1;
+
+    // Anything but a queued request (reset, status, erase) only needs irq_flag.
+    if(!nand_queue_active) return;
+
+    nand_request *req = nand_queue_head;
+#ifdef NAND_SUPPORT_WRITE
+    if(!err && req->op == NAND_REQ_WRITE)
+        err = nand_check_error();
+#endif
+    req->status = err;
+
+    nand_queue_active = 0;
+    nand_queue_head = req->next;
+    if(!nand_queue_head)
+        nand_queue_tail = NULL;
+    else
+        __nand_issue(nand_queue_head);
 }
 
 static void __nand_wait(void) {
@@ -168,6 +194,7 @@ int nand_reset(u32 bank) {
 }
 
 void nand_get_id(u8 *idbuf) {
+    nand_drain();
     irq_flag = 0;
     __nand_set_address(0,0);
 
@@ -184,7 +211,8 @@ void nand_get_status(u8 *status_buf) {
     dc_invalidaterange(status_buf, 0x40);
 
     __nand_setup_dma(status_buf, (u8 *)-1);
-    nand_send_command(NAND_GETSTATUS, 0, NAND_FLAGS_IRQ | NAND_FLAGS_RD, 0x40);
+    // polled, so it can be used from nand_irq without raising another IRQ
+    nand_send_command(NAND_GETSTATUS, 0, NAND_FLAGS_RD, 0x40);
 
     while(read32(NAND_CTRL) & NAND_CMD_EXEC);
 
@@ -216,30 +244,139 @@ void nand_wait(void) {
     }
 }
 
-int nand_read_page(u32 pageno, void *data, void *ecc) {
-    irq_flag = 0;
-    last_page_read = pageno;  // needed for error reporting
-    __nand_set_address(0, pageno);
+static void __nand_issue_read(nand_request *req) {
+    last_page_read = req->pageno;  // needed for error reporting
+    __nand_set_address(0, req->pageno);
     nand_send_command(NAND_READ_PRE, 0x1f, 0, 0);
+    __nand_wait();
+    __nand_setup_dma(req->data, req->ecc);
+    nand_send_command(NAND_READ_POST, 0, NAND_FLAGS_IRQ | NAND_FLAGS_WAIT | NAND_FLAGS_RD | NAND_FLAGS_ECC, 0x840);
+}
 
-    if (((s32)data) != -1) dc_invalidaterange(data, PAGE_SIZE);
-    if (((s32)ecc) != -1)  dc_invalidaterange(ecc, ECC_BUFFER_SIZE);
+#ifdef NAND_SUPPORT_WRITE
+static void __nand_issue_write(nand_request *req) {
+    ahb_flush_to(RB_FLA);
+    dc_invalidaterange(nand_spare_buf + ECC_CALC_OFFS, ECC_SIZE);
 
+    __nand_set_address(0, req->pageno);
+    __nand_setup_dma(req->data, nand_spare_buf);
+    nand_send_command(NAND_WRITE_PRE, 0x1f, NAND_FLAGS_WR | NAND_FLAGS_ECC, 0x800);
     __nand_wait();
-    __nand_setup_dma(data, ecc);
-    nand_send_command(NAND_READ_POST, 0, NAND_FLAGS_IRQ | NAND_FLAGS_WAIT | NAND_FLAGS_RD | NAND_FLAGS_ECC, 0x840);
-    nand_wait();
-    write32(NAND_CTRL, 0);
+
+    /* prepare page spare */
     ahb_flush_from(WB_FLA);
-    dc_invalidaterange(data, PAGE_SIZE);
-    dc_invalidaterange(ecc, ECC_BUFFER_ALLOC);
-    if (read32(NAND_CTRL) & NAND_ERROR)
-        return -1;
+    if (req->ecc) {
+        memcpy(nand_spare_buf, req->ecc, PAGE_SPARE_SIZE);
+    } else {
+        memset(nand_spare_buf, 0, PAGE_SPARE_SIZE);
+    }
+    nand_spare_buf[0] = 0xff;
+    memcpy(nand_spare_buf + ECC_STOR_OFFS, nand_spare_buf + ECC_CALC_OFFS, ECC_SIZE);
+    dc_flushrange(nand_spare_buf, PAGE_SPARE_SIZE);
+
+    /* setup irq */
+    write32(NAND_CTRL, 0);
+    irq_flag = 0;
+    irq_enable(IRQ_NAND);
+
+    /* send spare content */
+    write32(NAND_ADDR0, PAGE_SIZE);
+    write32(NAND_ADDR1, 0);
+    write32(NAND_DATA, dma_addr(nand_spare_buf));
+    write32(NAND_ECC, 0);
+    write32(NAND_CTRL,
+        NAND_BUSY_MASK |
+        CTRL_ADDR(0x3) |
+        CTRL_CMD(NAND_RANDOMDATA_IN) |
+        NAND_FLAGS_WR |
+        CTRL_SIZE(PAGE_SPARE_SIZE));
+    __nand_wait();
+
+    /* program page, completion is signaled by nand_irq */
+    nand_send_command(NAND_WRITE_POST, 0, NAND_FLAGS_IRQ | NAND_FLAGS_WAIT, 0);
+}
+#endif
+
+// Called with IRQs disabled or from nand_irq.
+static void __nand_issue(nand_request *req) {
+    irq_flag = 0;
+    nand_queue_active = 1;
+#ifdef NAND_SUPPORT_WRITE
+    if (req->op == NAND_REQ_WRITE) {
+        __nand_issue_write(req);
+        return;
+    }
+#endif
+    __nand_issue_read(req);
+}
+
+static void __nand_submit(nand_request *req) {
+    req->next = NULL;
+    req->status = NAND_REQ_PENDING;
+
+    u32 cookie = irq_kill();
+    if (nand_queue_tail)
+        nand_queue_tail->next = req;
+    else
+        nand_queue_head = req;
+    nand_queue_tail = req;
+
+    if (!nand_queue_active)
+        __nand_issue(nand_queue_head);
+    irq_restore(cookie);
+}
+
+static int __nand_complete(nand_request *req) {
+// power-saving IRQ wait
+    while(req->status == NAND_REQ_PENDING) {
+        u32 cookie = irq_kill();
+        if(req->status == NAND_REQ_PENDING)
+            irq_wait();
+        irq_restore(cookie);
+    }
+    return req->status;
+}
+
+void nand_drain(void) {
+    while(nand_queue_head) {
+        u32 cookie = irq_kill();
+        if(nand_queue_head)
+            irq_wait();
+        irq_restore(cookie);
+    }
+}
+
+int nand_start_read(u32 pageno, void *data, void *ecc, nand_request *req) {
+    req->op = NAND_REQ_READ;
+    req->pageno = pageno;
+    req->data = data;
+    req->ecc = ecc;
+
+    if (((s32)data) != -1) dma_give(data, PAGE_SIZE, DMA_FROM_DEVICE, RB_NONE);
+    if (((s32)ecc) != -1)  dma_give(ecc, ECC_BUFFER_ALLOC, DMA_FROM_DEVICE, RB_NONE);
+
+    __nand_submit(req);
     return 0;
 }
 
+int nand_end_read(nand_request *req) {
+    int res = __nand_complete(req);
+
+    /* nand_irq did the AHB flushes */
+    if (((s32)req->data) != -1) dma_take(req->data, PAGE_SIZE, DMA_FROM_DEVICE, WB_NONE);
+    if (((s32)req->ecc) != -1)  dma_take(req->ecc, ECC_BUFFER_ALLOC, DMA_FROM_DEVICE, WB_NONE);
+    return res;
+}
+
+int nand_read_page(u32 pageno, void *data, void *ecc) {
+    nand_request req;
+    nand_start_read(pageno, data, ecc, &req);
+    return nand_end_read(&req);
+}
+
 #ifdef NAND_SUPPORT_WRITE
 int nand_write_page_raw(u32 pageno, void *data, void *ecc) {
+    nand_drain();
     irq_flag = 0;
     NAND_debug("nand_write_page_raw(%u, %p, %p)\n", pageno, data, ecc);
 
@@ -265,9 +402,8 @@ int nand_write_page_raw(u32 pageno, void *data, void *ecc) {
     return 0;
 }
 
-int nand_write_page(u32 pageno, void *data, void *spare) {
-    irq_flag = 0;
-    NAND_debug("nand_write_page(%u, %p, %p)\n", pageno, data, spare);
+int nand_start_write(u32 pageno, void *data, void *spare, nand_request *req) {
+    NAND_debug("nand_start_write(%u, %p, %p)\n", pageno, data, spare);
 
 #if 0
     // this is a safety check to prevent you from accidentally wiping out boot1 or boot2.
@@ -276,58 +412,40 @@ int nand_write_page(u32 pageno, void *data, void *spare) {
         return -2;
     }
 #endif
-    if (((s32)data) != -1) dc_flushrange(data, PAGE_SIZE);
-    ahb_flush_to(RB_FLA);
-    dc_invalidaterange(nand_spare_buf + ECC_CALC_OFFS, ECC_SIZE);
-
-    __nand_set_address(0, pageno);
-    __nand_setup_dma(data, nand_spare_buf);
-    nand_send_command(NAND_WRITE_PRE, 0x1f, NAND_FLAGS_WR | NAND_FLAGS_ECC, 0x800);
-    __nand_wait();
-
-    /* prepare page spare */
-    ahb_flush_from(WB_FLA);
-    if (spare) {
-        memcpy(nand_spare_buf, spare, PAGE_SPARE_SIZE);
-    } else {
-        memset(nand_spare_buf, 0, PAGE_SPARE_SIZE);
-    }
-    nand_spare_buf[0] = 0xff;
-    memcpy(nand_spare_buf + ECC_STOR_OFFS, nand_spare_buf + ECC_CALC_OFFS, ECC_SIZE);
-    dc_flushrange(nand_spare_buf, PAGE_SPARE_SIZE);
+    req->op = NAND_REQ_WRITE;
+    req->pageno = pageno;
+    req->data = data;
+    req->ecc = spare;
 
-    /* setup irq */
-    write32(NAND_CTRL, 0);
-    irq_flag = 0;
-    irq_enable(IRQ_NAND);
+    /* __nand_issue_write flushes the AHB */
+    if (((s32)data) != -1) dma_give(data, PAGE_SIZE, DMA_TO_DEVICE, RB_NONE);
 
-    /* send spare content */
-    write32(NAND_ADDR0, PAGE_SIZE);
-    write32(NAND_ADDR1, 0);
-    write32(NAND_DATA, dma_addr(nand_spare_buf));
-    write32(NAND_ECC, 0);
-    write32(NAND_CTRL,
-        NAND_BUSY_MASK |
-        CTRL_ADDR(0x3) |
-        CTRL_CMD(NAND_RANDOMDATA_IN) |
-        NAND_FLAGS_WR |
-        CTRL_SIZE(PAGE_SPARE_SIZE));
-    __nand_wait();
+    __nand_submit(req);
+    return 0;
+}
 
-    /* program page*/
-    nand_send_command(NAND_WRITE_POST, 0, NAND_FLAGS_IRQ | NAND_FLAGS_WAIT, 0);
-    nand_wait();
-    if(nand_check_error()){
-        NAND_debug("nand_write_page(%d) failed\n", pageno);
+int nand_end_write(nand_request *req) {
+    int res = __nand_complete(req);
+    if (((s32)req->data) != -1) dma_take(req->data, PAGE_SIZE, DMA_TO_DEVICE, WB_NONE);
+    if (res) {
+        NAND_debug("nand_write_page(%d) failed\n", req->pageno);
         return -1;
     }
     return 0;
 }
 
+int nand_write_page(u32 pageno, void *data, void *spare) {
+    nand_request req;
+    int res = nand_start_write(pageno, data, spare, &req);
+    if (res) return res;
+    return nand_end_write(&req);
+}
+
 #endif
 
 #ifdef NAND_SUPPORT_ERASE
 int nand_erase_block(u32 pageno) {
+    nand_drain();
     irq_flag = 0;
     NAND_debug("nand_erase_block(%d)\n", pageno);
 
@@ -355,6 +473,7 @@ void nand_initialize(u32 bank)
 {
     if(initialized == bank) return;
 
+    nand_drain();
     irq_disable(IRQ_NAND);
     nand_reset(bank);
     irq_enable(IRQ_NAND);
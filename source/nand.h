@@ -38,6 +38,20 @@
 #define CLUSTER_SIZE        (PAGE_SIZE * CLUSTER_PAGES)
 #define CLUSTER_COUNT       (PAGE_COUNT / CLUSTER_PAGES)
 
+/* split-phase requests, see nand_start_read() */
+#define NAND_REQ_READ       0
+#define NAND_REQ_WRITE      1
+#define NAND_REQ_PENDING    1
+
+typedef struct nand_request {
+    struct nand_request *next;
+    u32 op;
+    u32 pageno;
+    void *data;
+    void *ecc;
+    volatile int status;
+} nand_request;
+
 void nand_irq(void);
 
 void nand_send_command(u32 command, u32 bitmask, u32 flags, u32 num_bytes);
@@ -50,6 +64,12 @@ int nand_write_page(u32 pageno, void *data, void *ecc);
 int nand_erase_block(u32 pageno);
 void nand_wait(void);
 
+int nand_start_read(u32 pageno, void *data, void *ecc, nand_request *req);
+int nand_end_read(nand_request *req);
+int nand_start_write(u32 pageno, void *data, void *spare, nand_request *req);
+int nand_end_write(nand_request *req);
+void nand_drain(void);
+
 #define NAND_ECC_OK 0
 #define NAND_ECC_CORRECTED 1
 #define NAND_ECC_UNCORRECTABLE -1
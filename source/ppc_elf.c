@@ -19,6 +19,7 @@
 #include <sys/errno.h>
 #include "elf.h"
 #include "memory.h"
+#include "crypto.h"
 #include <string.h>
 
 #define PHDR_MAX 10
@@ -202,7 +203,10 @@ int ppc_load_mem(const u8 *addr, u32 len, u32* entry)
             printf("ELF: LOAD 0x%lX @0x%08lX [0x%lX]\n", phdr->p_offset, phdr->p_paddr, phdr->p_filesz);
 
             void *dst = (void *) _translate_physaddr(phdr->p_paddr);
-            memcpy(dst, &addr[phdr->p_offset], phdr->p_filesz);
+            if (dma_memcpy(dst, &addr[phdr->p_offset], phdr->p_filesz)) {
+                printf("ELF: failed to copy PHDR to 0x%08lX\n", phdr->p_paddr);
+                return -107;
+            }
         }
         phdr++;
     }
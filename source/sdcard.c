@@ -478,6 +478,25 @@ int sdcard_ack_card(void)
     return -1;
 }
 
+/*
+ * A request with more blocks than the host takes in one command (ADMA got
+ * disabled after an error, or the buffer can't be used for DMA) is done right
+ * away in several commands, the end call only reports the result.
+ */
+static int _sdcard_split_command(int res, u16 opcode, struct sdmmc_command* cmdbuf)
+{
+    memset(cmdbuf, 0, sizeof(struct sdmmc_command));
+    cmdbuf->c_opcode = opcode;
+    cmdbuf->c_flags = SCF_ITSDONE;
+    cmdbuf->c_error = res ? EIO : 0;
+    return res;
+}
+
+static u32 _sdcard_max_blocks(void *data)
+{
+    return card.multiple_fallback ? 1 : sdhc_max_block_count(card.handle, data);
+}
+
 int sdcard_start_read(u32 blk_start, u32 blk_count, void *data, struct sdmmc_command* cmdbuf)
 {
 //  printf("%s(%u, %u, %p)\n", __FUNCTION__, blk_start, blk_count, data);
@@ -498,6 +517,9 @@ int sdcard_start_read(u32 blk_start, u32 blk_count, void *data, struct sdmmc_com
         return -1;
     }
 
+    if (blk_count > _sdcard_max_blocks(data))
+        return _sdcard_split_command(sdcard_read(blk_start, blk_count, data), MMC_READ_BLOCK_MULTIPLE, cmdbuf);
+
     memset(cmdbuf, 0, sizeof(struct sdmmc_command));
 
     if(blk_count > 1) {
@@ -515,7 +537,7 @@ int sdcard_start_read(u32 blk_start, u32 blk_count, void *data, struct sdmmc_com
     cmdbuf->c_datalen = blk_count * SDMMC_DEFAULT_BLOCKLEN;
     cmdbuf->c_blklen = SDMMC_DEFAULT_BLOCKLEN;
     cmdbuf->c_flags = SCF_RSP_R1 | SCF_CMD_READ;
-    sdhc_async_command(card.handle, cmdbuf);
+    sdhc_queue_command(card.handle, cmdbuf);
 
     if (cmdbuf->c_error) {
         printf("sdcard: MMC_READ_BLOCK_%s failed with %d\n", blk_count > 1 ? "MULTIPLE" : "SINGLE", cmdbuf->c_error);
@@ -549,7 +571,7 @@ int sdcard_end_read(struct sdmmc_command* cmdbuf)
         return -1;
     }
 
-    sdhc_async_response(card.handle, cmdbuf);
+    sdhc_queue_wait(card.handle, cmdbuf);
 
     if (cmdbuf->c_error) {
         printf("sdcard: MMC_READ_BLOCK_%s failed with %d\n", cmdbuf->c_opcode == MMC_READ_BLOCK_MULTIPLE ? "MULTIPLE" : "SINGLE", cmdbuf->c_error);
@@ -569,10 +591,12 @@ int sdcard_end_read(struct sdmmc_command* cmdbuf)
 int sdcard_read(u32 blk_start, u32 blk_count, void *data)
 {
     struct sdmmc_command cmd;
+    u32 max_blocks;
 
 retry_single:
     // TODO: wtf is this bug
-    if ((!can_sdcard_dma_addr(data) || card.multiple_fallback) && blk_count > 1) { // 
+    max_blocks = _sdcard_max_blocks(data);
+    if (max_blocks == 1 && blk_count > 1) {
         int ret = 0;
         for (int i = 0; i < blk_count; i++)
         {
@@ -604,7 +628,7 @@ retry_single:
     }
 
     while(blk_count){
-        u32 cmd_blk_count = min(blk_count, SDHC_BLOCK_COUNT_MAX);
+        u32 cmd_blk_count = min(blk_count, max_blocks);
         memset(&cmd, 0, sizeof(cmd));
 
         if(blk_count > 1) {
@@ -678,6 +702,9 @@ int sdcard_start_write(u32 blk_start, u32 blk_count, void *data, struct sdmmc_co
         return -1;
     }
 
+    if (blk_count > _sdcard_max_blocks(data))
+        return _sdcard_split_command(sdcard_write(blk_start, blk_count, data), MMC_WRITE_BLOCK_MULTIPLE, cmdbuf);
+
     memset(cmdbuf, 0, sizeof(struct sdmmc_command));
 
     if(blk_count > 1) {
@@ -695,7 +722,7 @@ int sdcard_start_write(u32 blk_start, u32 blk_count, void *data, struct sdmmc_co
     cmdbuf->c_datalen = blk_count * SDMMC_DEFAULT_BLOCKLEN;
     cmdbuf->c_blklen = SDMMC_DEFAULT_BLOCKLEN;
     cmdbuf->c_flags = SCF_RSP_R1;
-    sdhc_async_command(card.handle, cmdbuf);
+    sdhc_queue_command(card.handle, cmdbuf);
 
     if (cmdbuf->c_error) {
         printf("sdcard: MMC_WRITE_BLOCK_%s failed with %d\n", blk_count > 1 ? "MULTIPLE" : "SINGLE", cmdbuf->c_error);
@@ -728,7 +755,7 @@ int sdcard_end_write(struct sdmmc_command* cmdbuf)
         return -1;
     }
 
-    sdhc_async_response(card.handle, cmdbuf);
+    sdhc_queue_wait(card.handle, cmdbuf);
 
     if (cmdbuf->c_error) {
         printf("sdcard: MMC_WRITE_BLOCK_%s failed with %d\n", cmdbuf->c_opcode == MMC_WRITE_BLOCK_MULTIPLE ? "MULTIPLE" : "SINGLE", cmdbuf->c_error);
@@ -748,6 +775,7 @@ int sdcard_end_write(struct sdmmc_command* cmdbuf)
 int sdcard_write(u32 blk_start, u32 blk_count, void *data)
 {
     struct sdmmc_command cmd;
+    u32 max_blocks;
 
     if (sdcard_host.no_dma) {
         panic(0);
@@ -755,7 +783,8 @@ int sdcard_write(u32 blk_start, u32 blk_count, void *data)
 
 retry_single:
     // TODO: wtf is this bug
-    if ((!can_sdcard_dma_addr(data) || card.multiple_fallback) && blk_count > 1) { // !can_sdcard_dma_addr(data) && 
+    max_blocks = _sdcard_max_blocks(data);
+    if (max_blocks == 1 && blk_count > 1) {
         int ret = 0;
         for (int i = 0; i < blk_count; i++)
         {
@@ -784,7 +813,7 @@ retry_single:
     }
 
     while(blk_count){
-        u32 cmd_blk_count = min(blk_count, SDHC_BLOCK_COUNT_MAX);
+        u32 cmd_blk_count = min(blk_count, max_blocks);
         memset(&cmd, 0, sizeof(cmd));
 
         if(blk_count > 1) {
@@ -834,6 +863,71 @@ retry_single:
     return 0;
 }
 
+int sdcard_erase(u32 blk_start, u32 blk_count)
+{
+    struct sdmmc_command cmd;
+    u32 blk_end = blk_start + blk_count - 1;
+
+    if (!blk_count)
+        return 0;
+
+    if (card.inserted == 0) {
+        printf("sdcard: ERASE: no card inserted.\n");
+        return -1;
+    }
+
+    if (card.selected == 0) {
+        if (sdcard_select() < 0) {
+            printf("sdcard: ERASE: cannot select card.\n");
+            return -1;
+        }
+    }
+
+    if (!card.sdhc_blockmode) {
+        blk_start *= SDMMC_DEFAULT_BLOCKLEN;
+        blk_end *= SDMMC_DEFAULT_BLOCKLEN;
+    }
+
+    DPRINTF(2, ("sdcard: SD_ERASE_WR_BLK_START\n"));
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.c_opcode = SD_ERASE_WR_BLK_START;
+    cmd.c_arg = blk_start;
+    cmd.c_flags = SCF_RSP_R1;
+    sdhc_exec_command(card.handle, &cmd);
+    if (cmd.c_error) {
+        printf("sdcard: SD_ERASE_WR_BLK_START failed with %d\n", cmd.c_error);
+        return -1;
+    }
+
+    DPRINTF(2, ("sdcard: SD_ERASE_WR_BLK_END\n"));
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.c_opcode = SD_ERASE_WR_BLK_END;
+    cmd.c_arg = blk_end;
+    cmd.c_flags = SCF_RSP_R1;
+    sdhc_exec_command(card.handle, &cmd);
+    if (cmd.c_error) {
+        printf("sdcard: SD_ERASE_WR_BLK_END failed with %d\n", cmd.c_error);
+        return -1;
+    }
+
+    DPRINTF(2, ("sdcard: SD_ERASE\n"));
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.c_opcode = SD_ERASE;
+    cmd.c_arg = 0;
+    cmd.c_flags = SCF_RSP_R1B;
+    sdhc_exec_command(card.handle, &cmd);
+    if (cmd.c_error) {
+        printf("sdcard: SD_ERASE failed with %d\n", cmd.c_error);
+        return -1;
+    } else if(MMC_R1(cmd.c_resp) & MMC_R1_ANY_ERROR){
+        printf("sdcard: erase reported error. status: %08lx\n", MMC_R1(cmd.c_resp));
+        return -2;
+    }
+
+    // The card stays busy (not ready for data) until the erase is done.
+    return sdcard_wait_data();
+}
+
 int sdcard_wait_data(void)
 {
     struct sdmmc_command cmd;
@@ -856,6 +950,14 @@ int sdcard_wait_data(void)
     return 0;
 }
 
+u32 sdcard_get_max_blocks(void)
+{
+    if (card.multiple_fallback)
+        return 1;
+
+    return sdhc_max_block_count(card.handle, NULL);
+}
+
 int sdcard_get_sectors(void)
 {
     if (card.inserted == 0) {
@@ -28,9 +28,11 @@ int sdcard_select(void);
 int sdcard_check_card(void);
 int sdcard_ack_card(void);
 int sdcard_get_sectors(void);
+u32 sdcard_get_max_blocks(void);
 
 int sdcard_read(u32 blk_start, u32 blk_count, void *data);
 int sdcard_write(u32 blk_start, u32 blk_count, void *data);
+int sdcard_erase(u32 blk_start, u32 blk_count);
 
 int sdcard_start_read(u32 blk_start, u32 blk_count, void *data, struct sdmmc_command* cmdbuf);
 int sdcard_end_read(struct sdmmc_command* cmdbuf);
@@ -95,6 +95,12 @@ static inline void bus_space_write_1(bus_space_handle_t ioh, u32 r, u8 v)
 
 /* flag values */
 #define SHF_USE_DMA     0x0001
+#define SHF_USE_ADMA2   0x0002
+
+/* dma_mode values */
+#define SDHC_XFER_PIO   0
+#define SDHC_XFER_SDMA  1
+#define SDHC_XFER_ADMA2 2
 
 #define HREAD1(hp, reg)                         \
     (bus_space_read_1((hp)->ioh, (reg)))
@@ -123,6 +129,7 @@ int sdhc_soft_reset(struct sdhc_host *, int);
 void sdhc_reset_intr_status(struct sdhc_host *hp);
 int sdhc_wait_intr_debug(const char *func, int line, struct sdhc_host *, int, int);
 void    sdhc_transfer_data(struct sdhc_host *, struct sdmmc_command *);
+static void    sdhc_dma_take(struct sdhc_host *, struct sdmmc_command *);
 void    sdhc_read_data(struct sdhc_host *, u_char *, int);
 void    sdhc_write_data(struct sdhc_host *, u_char *, int);
 #ifdef SDHC_DEBUG
@@ -182,6 +189,8 @@ sdhc_host_found(struct sdhc_host *hp, struct sdhc_host_params *pa, bus_space_tag
     /* Use DMA if the host system and the controller support it. */
     if (usedma && ISSET(caps, SDHC_DMA_SUPPORT))
         SET(hp->flags, SHF_USE_DMA);
+    if (usedma && ISSET(caps, SDHC_ADMA2_SUPPORT))
+        SET(hp->flags, SHF_USE_ADMA2);
 
     /*
      * Determine the base clock frequency. (2.2.24)
@@ -577,12 +586,14 @@ sdhc_async_response(struct sdhc_host *hp, struct sdmmc_command *cmd)
     if (ISSET(status, SDHC_ERROR_TIMEOUT)){
         cmd->c_error = ETIMEDOUT;
         printf("timeout dump: error_intr: 0x%x intr: 0x%x\n", hp->intr_error_status, hp->intr_status);
+        sdhc_dma_take(hp, cmd);
         return;
     }
 
     if (ISSET(status, SDHC_ERROR_INTERRUPT)){
         printf("sdhc: ERROR interrupt, status=0x%X\n", status);
         cmd->c_error = 1;
+        sdhc_dma_take(hp, cmd);
         return;
     }
 
@@ -620,6 +631,9 @@ sdhc_async_response(struct sdhc_host *hp, struct sdmmc_command *cmd)
 void
 sdhc_exec_command(struct sdhc_host *hp, struct sdmmc_command *cmd)
 {
+    /* Don't interleave with queued commands. */
+    sdhc_queue_drain(hp);
+
 #ifdef CAN_HAZ_IRQ
     u32 cookie = irq_kill();
 #endif
@@ -633,6 +647,179 @@ sdhc_exec_command(struct sdhc_host *hp, struct sdmmc_command *cmd)
 #endif
 }
 
+/*
+ * Small command queue on top of the async interface. Only the head of the
+ * queue is running on the controller; as soon as its response has been
+ * collected the next queued command is started, before control returns to
+ * the caller waiting on it.
+ */
+static void
+sdhc_queue_advance(struct sdhc_host *hp)
+{
+    struct sdmmc_command *cmd = hp->queue[hp->queue_head];
+
+    if (!ISSET(cmd->c_flags, SCF_ITSDONE))
+        sdhc_async_response(hp, cmd);
+
+    hp->queue_head = (hp->queue_head + 1) % SDHC_QUEUE_DEPTH;
+    hp->queue_count--;
+
+    /* Start the next command, commands that fail to start are done. */
+    while (hp->queue_count) {
+        cmd = hp->queue[hp->queue_head];
+        sdhc_async_command(hp, cmd);
+        if (!ISSET(cmd->c_flags, SCF_ITSDONE))
+            break;
+        hp->queue_head = (hp->queue_head + 1) % SDHC_QUEUE_DEPTH;
+        hp->queue_count--;
+    }
+}
+
+void
+sdhc_queue_command(struct sdhc_host *hp, struct sdmmc_command *cmd)
+{
+    /* Make room by completing the oldest command. */
+    if (hp->queue_count == SDHC_QUEUE_DEPTH)
+        sdhc_queue_advance(hp);
+
+    cmd->c_flags &= ~SCF_ITSDONE;
+    hp->queue[(hp->queue_head + hp->queue_count) % SDHC_QUEUE_DEPTH] = cmd;
+    hp->queue_count++;
+
+    if (hp->queue_count == 1) {
+        sdhc_async_command(hp, cmd);
+        if (ISSET(cmd->c_flags, SCF_ITSDONE)) {
+            hp->queue_head = (hp->queue_head + 1) % SDHC_QUEUE_DEPTH;
+            hp->queue_count--;
+        }
+    }
+}
+
+void
+sdhc_queue_wait(struct sdhc_host *hp, struct sdmmc_command *cmd)
+{
+    while (!ISSET(cmd->c_flags, SCF_ITSDONE) && hp->queue_count)
+        sdhc_queue_advance(hp);
+}
+
+void
+sdhc_queue_drain(struct sdhc_host *hp)
+{
+    while (hp->queue_count)
+        sdhc_queue_advance(hp);
+}
+
+/*
+ * ADMA2 only needs word aligned segments, which is enough for writes: the
+ * partial lines are cleaned before the transfer. A read has to cover whole
+ * cache lines, invalidating a partial one afterwards would drop whatever the
+ * CPU wrote to the rest of it in the meantime.
+ */
+static int
+sdhc_can_adma_addr(void *addr, u_int32_t len, int read)
+{
+    u32 mask = read ? 31 : 3;
+
+    if (((u32)addr & mask) || (len & mask))
+        return 0;
+    return can_sdcard_dma_addr(ALIGN_BACKWARD(addr, 32));
+}
+
+static int
+sdhc_can_adma(struct sdhc_host *hp, struct sdmmc_command *cmd)
+{
+    int desc = 0;
+
+    if (hp->no_dma || !ISSET(hp->flags, SHF_USE_ADMA2))
+        return 0;
+
+    int read = ISSET(cmd->c_flags, SCF_CMD_READ);
+
+    if (cmd->c_sg == NULL)
+        return sdhc_can_adma_addr(cmd->c_data, cmd->c_datalen, read) &&
+            cmd->c_datalen <= SDHC_ADMA_DESC_MAX * SDHC_ADMA_DESC_LEN_MAX;
+
+    for (int i = 0; i < cmd->c_sgcount; i++) {
+        if (!sdhc_can_adma_addr(cmd->c_sg[i].sg_addr, cmd->c_sg[i].sg_len, read))
+            return 0;
+        desc += (cmd->c_sg[i].sg_len + SDHC_ADMA_DESC_LEN_MAX - 1) / SDHC_ADMA_DESC_LEN_MAX;
+    }
+
+    return desc <= SDHC_ADMA_DESC_MAX;
+}
+
+/* Goes by the rules for reads, the same buffer may be used for both. */
+u_int32_t
+sdhc_max_block_count(struct sdhc_host *hp, void *data)
+{
+    if (!hp->no_dma && ISSET(hp->flags, SHF_USE_ADMA2) &&
+        (data == NULL || sdhc_can_adma_addr(data, SDMMC_DEFAULT_BLOCKLEN, 1)))
+        return SDHC_ADMA_BLOCK_COUNT_MAX;
+
+    if (data == NULL || can_sdcard_dma_addr(data))
+        return SDHC_BLOCK_COUNT_MAX;
+
+    return 1;
+}
+
+/* Hands the data buffers of a DMA command back to the CPU. */
+static void
+sdhc_dma_take(struct sdhc_host *hp, struct sdmmc_command *cmd)
+{
+    int read = ISSET(cmd->c_flags, SCF_CMD_READ);
+    int dir = read ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+    /* a read has to be flushed out of the AHB before the CPU looks at it */
+    enum wb_client wb = read ? hp->pa.wb : WB_NONE;
+
+    if (hp->dma_mode == SDHC_XFER_PIO || cmd->c_datalen == 0)
+        return;
+
+    if (cmd->c_sg != NULL) {
+        /* one AHB flush covers all segments */
+        for (int i = 0; i < cmd->c_sgcount; i++)
+            dma_take(cmd->c_sg[i].sg_addr, cmd->c_sg[i].sg_len, dir, i ? WB_NONE : wb);
+    } else
+        dma_take(cmd->c_data, cmd->c_datalen, dir, wb);
+}
+
+static void
+sdhc_adma_segment(struct sdhc_host *hp, int *desc, void *addr, u_int32_t len, int read)
+{
+    /* the descriptors are flushed to the controller afterwards */
+    dma_give(addr, len, read ? DMA_FROM_DEVICE : DMA_TO_DEVICE, RB_NONE);
+
+    while (len) {
+        u_int32_t chunk = MIN(len, SDHC_ADMA_DESC_LEN_MAX);
+        struct sdhc_adma_desc *d = &hp->adma_desc[(*desc)++];
+
+        d->attr_len = __builtin_bswap32((chunk << 16) | SDHC_ADMA_ACT_TRAN | SDHC_ADMA_VALID);
+        d->addr = __builtin_bswap32(dma_addr(addr));
+
+        addr = (u_char *)addr + chunk;
+        len -= chunk;
+    }
+}
+
+static void
+sdhc_adma_setup(struct sdhc_host *hp, struct sdmmc_command *cmd)
+{
+    int read = ISSET(cmd->c_flags, SCF_CMD_READ);
+    int desc = 0;
+
+    if (cmd->c_sg == NULL) {
+        sdhc_adma_segment(hp, &desc, cmd->c_data, cmd->c_datalen, read);
+    } else {
+        for (int i = 0; i < cmd->c_sgcount; i++)
+            sdhc_adma_segment(hp, &desc, cmd->c_sg[i].sg_addr, cmd->c_sg[i].sg_len, read);
+    }
+    hp->adma_desc[desc - 1].attr_len |= __builtin_bswap32(SDHC_ADMA_END);
+
+    dc_flushrange(hp->adma_desc, desc * sizeof(struct sdhc_adma_desc));
+    ahb_flush_to(hp->pa.rb);
+
+    HWRITE4(hp, SDHC_ADMA_SYSTEM_ADDR, dma_addr(hp->adma_desc));
+}
+
 int
 sdhc_start_command(struct sdhc_host *hp, struct sdmmc_command *cmd)
 {
@@ -661,8 +848,23 @@ sdhc_start_command(struct sdhc_host *hp, struct sdmmc_command *cmd)
         }
     }
 
+    if (cmd->c_sg != NULL && cmd->c_sgcount > 0)
+        cmd->c_data = cmd->c_sg[0].sg_addr;
+
+    hp->dma_mode = SDHC_XFER_PIO;
+    if (cmd->c_datalen > 0) {
+        if (sdhc_can_adma(hp, cmd))
+            hp->dma_mode = SDHC_XFER_ADMA2;
+        else if (cmd->c_sg == NULL && !hp->no_dma && can_sdcard_dma_addr(cmd->c_data) && ISSET(hp->flags, SHF_USE_DMA))
+            hp->dma_mode = SDHC_XFER_SDMA;
+        else if (cmd->c_sg != NULL) {
+            printf("sdhc: segment list needs ADMA\n");
+            return EINVAL;
+        }
+    }
+
     /* Check limit imposed by 9-bit block count. (1.7.2) */
-    if (blkcount > SDHC_BLOCK_COUNT_MAX) {
+    if (blkcount > ((hp->dma_mode == SDHC_XFER_ADMA2) ? SDHC_ADMA_BLOCK_COUNT_MAX : SDHC_BLOCK_COUNT_MAX)) {
         printf("sdhc: too much data\n");
         return EINVAL;
     }
@@ -679,7 +881,7 @@ sdhc_start_command(struct sdhc_host *hp, struct sdmmc_command *cmd)
             mode |= SDHC_AUTO_CMD12_ENABLE;
         }
     }
-    if (!hp->no_dma && can_sdcard_dma_addr(cmd->c_data) && ISSET(hp->flags, SHF_USE_DMA))
+    if (hp->dma_mode != SDHC_XFER_PIO)
         mode |= SDHC_DMA_ENABLE;
 
     /*
@@ -709,17 +911,26 @@ sdhc_start_command(struct sdhc_host *hp, struct sdmmc_command *cmd)
     if ((error = sdhc_wait_state(hp, SDHC_CMD_INHIBIT_MASK, 0)) != 0)
         return error;
 
-    if ((mode & SDHC_DMA_ENABLE) && cmd->c_datalen > 0) 
+    if (hp->dma_mode == SDHC_XFER_ADMA2)
     {
         cmd->c_resid = blkcount;
         cmd->c_buf = cmd->c_data;
 
-        if (ISSET(cmd->c_flags, SCF_CMD_READ)) {
-            dc_invalidaterange(cmd->c_data, cmd->c_datalen);
-        } else {
-            dc_flushrange(cmd->c_data, cmd->c_datalen);
-            ahb_flush_to(hp->pa.rb);
-        }
+        sdhc_adma_setup(hp, cmd);
+        HWRITE1(hp, SDHC_HOST_CTL, (HREAD1(hp, SDHC_HOST_CTL) & ~SDHC_DMA_SELECT_MASK) | SDHC_DMA_SELECT_ADMA2);
+    }
+    else if (hp->dma_mode == SDHC_XFER_SDMA)
+    {
+        /* ADMA may have been selected before it got disabled. */
+        HWRITE1(hp, SDHC_HOST_CTL, (HREAD1(hp, SDHC_HOST_CTL) & ~SDHC_DMA_SELECT_MASK) | SDHC_DMA_SELECT_SDMA);
+
+        cmd->c_resid = blkcount;
+        cmd->c_buf = cmd->c_data;
+
+        if (ISSET(cmd->c_flags, SCF_CMD_READ))
+            dma_give(cmd->c_data, cmd->c_datalen, DMA_FROM_DEVICE, RB_NONE);
+        else
+            dma_give(cmd->c_data, cmd->c_datalen, DMA_TO_DEVICE, hp->pa.rb);
         HWRITE4(hp, SDHC_DMA_ADDR, (u32)cmd->c_data);
     }
 
@@ -749,7 +960,7 @@ sdhc_transfer_data(struct sdhc_host *hp, struct sdmmc_command *cmd)
     error = 0;
 
     DPRINTF(1,("resp=%#x datalen=%d\n", MMC_R1(cmd->c_resp), cmd->c_datalen));
-    if (!hp->no_dma && can_sdcard_dma_addr(cmd->c_data) && ISSET(hp->flags, SHF_USE_DMA)) {
+    if (hp->dma_mode != SDHC_XFER_PIO) {
         for(;;) {
             status = sdhc_wait_intr(hp, SDHC_TRANSFER_COMPLETE |
                     SDHC_DMA_INTERRUPT,
@@ -765,7 +976,7 @@ sdhc_transfer_data(struct sdhc_host *hp, struct sdmmc_command *cmd)
                 break;
             }
         }
-        dc_invalidaterange(cmd->c_data, cmd->c_datalen);
+        sdhc_dma_take(hp, cmd);
     } else {
         //printf("fail.\n");
 
@@ -931,6 +1142,9 @@ sdhc_intr(struct sdhc_host *hp)
 
     /* Service error interrupts. */
     if (ISSET(status, SDHC_ERROR_INTERRUPT)) {
+        /* The reset clears the ADMA error state. */
+        u_int8_t adma_status = HREAD1(hp, SDHC_ADMA_ERROR_STATUS);
+
         /* Acknowledge error interrupts. */
         HWRITE2(hp, SDHC_EINTR_SIGNAL_EN, 0);
         (void)sdhc_soft_reset(hp, SDHC_RESET_DAT|SDHC_RESET_CMD);
@@ -948,6 +1162,17 @@ sdhc_intr(struct sdhc_host *hp)
             hp->intr_error_status |= error;
             hp->intr_status |= status;
         }
+
+        /*
+         * Don't trust ADMA anymore, the retry will use SDMA. sdcard and mlc
+         * split requests above the SDMA block count into several commands.
+         */
+        if (ISSET(error, SDHC_ADMA_ERROR)) {
+            printf("sdhc: ADMA error 0x%x, disabling ADMA\n", adma_status);
+            hp->flags &= ~SHF_USE_ADMA2;
+            hp->intr_error_status |= error;
+            hp->intr_status |= status;
+        }
     }
 
     /*
@@ -32,6 +32,16 @@ struct sdhc_host_params {
     enum wb_client wb;
 };
 
+/* ADMA2 descriptor, fetched by the controller in little endian */
+struct sdhc_adma_desc {
+    u_int32_t attr_len;
+    u_int32_t addr;
+};
+
+#define SDHC_ADMA_DESC_MAX          64
+#define SDHC_ADMA_DESC_LEN_MAX      0x8000
+#define SDHC_QUEUE_DEPTH            4
+
 struct sdhc_host {
     bus_space_tag_t iot;        /* host register set tag */
     bus_space_handle_t ioh;     /* host register set handle */
@@ -44,8 +54,15 @@ struct sdhc_host {
     volatile u_int16_t intr_error_status;    /* soft error status */
     int data_command;
     int no_dma;
+    int dma_mode;           /* DMA mode of the running command */
 
     struct sdhc_host_params pa;
+
+    struct sdmmc_command *queue[SDHC_QUEUE_DEPTH]; /* queue[queue_head] is running */
+    int queue_head;
+    int queue_count;
+
+    struct sdhc_adma_desc adma_desc[SDHC_ADMA_DESC_MAX] ALIGNED(32);
 };
 
 /* Host controller functions called by the attachment driver. */
@@ -63,6 +80,7 @@ int sdhc_intr(struct sdhc_host *);
 #else
 #define SDHC_BLOCK_COUNT_MAX        256
 #endif
+#define SDHC_ADMA_BLOCK_COUNT_MAX   (SDHC_ADMA_DESC_MAX * SDHC_ADMA_DESC_LEN_MAX / SDMMC_DEFAULT_BLOCKLEN)
 #define SDHC_ARGUMENT           0x08
 #define SDHC_TRANSFER_MODE      0x0c
 #define SDHC_MULTI_BLOCK_MODE       (1<<5)
@@ -111,6 +129,9 @@ int sdhc_intr(struct sdhc_host *);
 #define SDHC_CMD_INHIBIT_MASK       0x0003
 #define SDHC_HOST_CTL           0x28
 #define SDHC_8BIT_MODE          (1<<5)
+#define SDHC_DMA_SELECT_MASK        (3<<3)
+#define SDHC_DMA_SELECT_SDMA        (0<<3)
+#define SDHC_DMA_SELECT_ADMA2       (2<<3)
 #define SDHC_HIGH_SPEED         (1<<2)
 #define SDHC_4BIT_MODE          (1<<1)
 #define SDHC_LED_ON         (1<<0)
@@ -177,6 +198,7 @@ int sdhc_intr(struct sdhc_host *);
 #define SDHC_VOLTAGE_SUPP_3_0V      (1<<25)
 #define SDHC_VOLTAGE_SUPP_3_3V      (1<<24)
 #define SDHC_DMA_SUPPORT        (1<<22)
+#define SDHC_ADMA2_SUPPORT      (1<<19)
 #define SDHC_HIGH_SPEED_SUPP        (1<<21)
 #define SDHC_BASE_FREQ_SHIFT        8
 #define SDHC_BASE_FREQ_MASK     0x3f
@@ -185,6 +207,15 @@ int sdhc_intr(struct sdhc_host *);
 #define SDHC_TIMEOUT_FREQ_SHIFT     0
 #define SDHC_TIMEOUT_FREQ_MASK      0x1f
 #define SDHC_MAX_CAPABILITIES       0x48
+#define SDHC_ADMA_ERROR_STATUS      0x54
+#define SDHC_ADMA_SYSTEM_ADDR       0x58
+
+/* ADMA2 descriptor attributes */
+#define SDHC_ADMA_VALID         (1<<0)
+#define SDHC_ADMA_END           (1<<1)
+#define SDHC_ADMA_INT           (1<<2)
+#define SDHC_ADMA_ACT_TRAN      (2<<4)
+#define SDHC_ADMA_ACT_LINK      (3<<4)
 #define SDHC_SLOT_INTR_STATUS       0xfc
 #define SDHC_HOST_CTL_VERSION       0xfe
 #define SDHC_SPEC_VERS_SHIFT        0
@@ -235,4 +266,10 @@ void sdhc_exec_command(struct sdhc_host *hp, struct sdmmc_command *);
 void sdhc_async_command(struct sdhc_host *hp, struct sdmmc_command *);
 void sdhc_async_response(struct sdhc_host *hp, struct sdmmc_command *);
 
+void sdhc_queue_command(struct sdhc_host *hp, struct sdmmc_command *);
+void sdhc_queue_wait(struct sdhc_host *hp, struct sdmmc_command *);
+void sdhc_queue_drain(struct sdhc_host *hp);
+
+u_int32_t sdhc_max_block_count(struct sdhc_host *hp, void *data);
+
 #endif
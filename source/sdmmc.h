@@ -67,6 +67,12 @@ struct sdmmc_task {
 
 #define sdmmc_task_pending(xtask) ((xtask)->onqueue)
 
+/* scatter/gather segment, see c_sg */
+struct sdmmc_sg {
+    void        *sg_addr;
+    u_int32_t    sg_len;
+};
+
 struct sdmmc_command {
 //  struct sdmmc_task c_task;   /* task queue entry */
     u_int16_t    c_opcode;  /* SD or MMC command index */
@@ -103,6 +109,9 @@ struct sdmmc_command {
 
     int     c_timeout;
 
+    struct sdmmc_sg *c_sg;  /* segment list used instead of c_data (ADMA only) */
+    int     c_sgcount;
+
     /* Host controller owned fields for data xfer in progress */
     int c_resid;            /* remaining I/O */
     u_char *c_buf;          /* remaining data */
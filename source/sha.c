@@ -16,59 +16,255 @@ A million repetitions of "a"
 
 #include <string.h>
 #include <stdlib.h>
-#include <malloc.h>
 
 #include "sha.h"
 #include "irq.h"
 #include "memory.h"
 #include "latte.h"
 
-//should be divisible by four
-#define BLOCKSIZE 32
-
 #define SHA_CMD_FLAG_EXEC (1<<31)
 #define SHA_CMD_FLAG_IRQ  (1<<30)
 #define SHA_CMD_FLAG_ERR  (1<<29)
 #define SHA_CMD_AREA_BLOCK ((1<<10) - 1)
 
-static void sha_transform(u32 state[SHA_HASH_WORDS], u8 buffer[SHA_BLOCK_SIZE], u32 blocks)
-{
-    if(blocks == 0) return;
+// The engine reads its input with DMA, straight from the caller's buffer if it
+// is aligned like this. Everything else goes through sha_scratch.
+#define SHA_DMA_ALIGN       (64)
+#define SHA_MAX_BLOCKS      (SHA_CMD_AREA_BLOCK + 1)
+#define SHA_SCRATCH_BLOCKS  (32)
+
+// Below this, polling SHA_CTRL is cheaper than taking an IRQ.
+#define SHA_IRQ_MIN_BLOCKS  (64)
+
+// Transforms shorter than this are done in software, the register setup, cache
+// flush and AHB flush cost more than the few blocks of work. See sha_set_hw_threshold.
+#define SHA_HW_MIN_BLOCKS   (4)
+
+static u32 sha_hw_min_blocks = SHA_HW_MIN_BLOCKS;
+
+static u8 sha_scratch[SHA_SCRATCH_BLOCKS * SHA_BLOCK_SIZE] ALIGNED(SHA_DMA_ALIGN);
+
+// The background job started by sha_start_update. Long inputs are split into
+// SHA_MAX_BLOCKS runs, sha_irq issues the next one.
+static struct {
+    sha_ctx* ctx;
+    const u8* start;
+    u32 size;
+    const u8* data;
+    u32 blocks;
+    volatile int busy;
+} sha_job;
 
-    /* Copy ctx->state[] to working vars */
+static void sha_load_state(const u32 state[SHA_HASH_WORDS])
+{
     write32(SHA_H0, state[0]);
     write32(SHA_H1, state[1]);
     write32(SHA_H2, state[2]);
     write32(SHA_H3, state[3]);
     write32(SHA_H4, state[4]);
+}
 
-    // assign block to local copy which is 64-byte aligned
-    u8 *block = memalign(128, SHA_BLOCK_SIZE * blocks);
-    memcpy(block, buffer, SHA_BLOCK_SIZE * blocks);
+static void sha_store_state(u32 state[SHA_HASH_WORDS])
+{
+    state[0] = read32(SHA_H0);
+    state[1] = read32(SHA_H1);
+    state[2] = read32(SHA_H2);
+    state[3] = read32(SHA_H3);
+    state[4] = read32(SHA_H4);
+}
 
-    // royal flush :)
-    dc_flushrange(block, SHA_BLOCK_SIZE * blocks);
-    ahb_flush_to(RB_SHA);
+// Issues one command, the data has to be flushed already.
+static void sha_run(const void* data, u32 blocks, u32 flags)
+{
+    write32(SHA_SRC, dma_addr((void*)data));
+    write32(SHA_CTRL, (read32(SHA_CTRL) & ~(SHA_CMD_AREA_BLOCK | SHA_CMD_FLAG_IRQ)) | flags | (blocks - 1));
+    write32(SHA_CTRL, read32(SHA_CTRL) | SHA_CMD_FLAG_EXEC);
+}
 
-    // tell sha1 controller the block source address
-    write32(SHA_SRC, dma_addr(block));
+static void sha_poll(void)
+{
+    while (read32(SHA_CTRL) & SHA_CMD_FLAG_EXEC);
+}
 
-    // tell sha1 controller number of blocks
-    write32(SHA_CTRL, (read32(SHA_CTRL) & ~(SHA_CMD_AREA_BLOCK)) | (blocks - 1));
+void sha_irq(void)
+{
+    if (!sha_job.busy)
+        return;
 
-    // fire up hashing and wait till its finished
-    write32(SHA_CTRL, read32(SHA_CTRL) | SHA_CMD_FLAG_EXEC);
-    while (read32(SHA_CTRL) & SHA_CMD_FLAG_EXEC);
+    if (sha_job.blocks) {
+        u32 blocks = min(sha_job.blocks, (u32)SHA_MAX_BLOCKS);
+        sha_run(sha_job.data, blocks, SHA_CMD_FLAG_IRQ);
+        sha_job.data += blocks * SHA_BLOCK_SIZE;
+        sha_job.blocks -= blocks;
+    } else {
+        sha_job.busy = 0;
+    }
+}
 
-    // free the aligned data
-    free(block);
+// Finishes the background job, if any, and hands its state back to its context.
+static void sha_wait_job(void)
+{
+    if (!sha_job.ctx)
+        return;
 
-    /* Add the working vars back into ctx.state[] */
-    state[0] = read32(SHA_H0);
-    state[1] = read32(SHA_H1);
-    state[2] = read32(SHA_H2);
-    state[3] = read32(SHA_H3);
-    state[4] = read32(SHA_H4);
+#ifdef CAN_HAZ_IRQ
+    while (sha_job.busy) {
+        u32 cookie = irq_kill();
+        if (sha_job.busy)
+            irq_wait();
+        irq_restore(cookie);
+    }
+#endif
+
+    sha_store_state(sha_job.ctx->state);
+    dma_take(sha_job.start, sha_job.size, DMA_TO_DEVICE, WB_NONE);
+    sha_job.ctx = NULL;
+}
+
+// Starts a job on aligned data, the engine is idle and loaded with ctx->state.
+static void sha_submit(sha_ctx* ctx, const u8* data, u32 blocks)
+{
+    dma_give(data, blocks * SHA_BLOCK_SIZE, DMA_TO_DEVICE, RB_SHA);
+
+#ifdef CAN_HAZ_IRQ
+    if (irq_active()) {
+        u32 first = min(blocks, (u32)SHA_MAX_BLOCKS);
+
+        sha_job.ctx = ctx;
+        sha_job.start = data;
+        sha_job.size = blocks * SHA_BLOCK_SIZE;
+        sha_job.data = data + first * SHA_BLOCK_SIZE;
+        sha_job.blocks = blocks - first;
+        sha_job.busy = 1;
+
+        irq_enable(IRQ_SHA1);
+        sha_run(data, first, SHA_CMD_FLAG_IRQ);
+        return;
+    }
+#endif
+
+    const u8* start = data;
+    u32 size = blocks * SHA_BLOCK_SIZE;
+    while (blocks) {
+        u32 run = min(blocks, (u32)SHA_MAX_BLOCKS);
+        sha_run(data, run, 0);
+        sha_poll();
+        data += run * SHA_BLOCK_SIZE;
+        blocks -= run;
+    }
+    sha_store_state(ctx->state);
+    dma_take(start, size, DMA_TO_DEVICE, WB_NONE);
+}
+
+static inline int sha_can_dma(const void* data)
+{
+    return ((u32)data & (SHA_DMA_ALIGN - 1)) == 0;
+}
+
+#define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+/* blk0() and blk() perform the initial expand. */
+#define blk0(i) (block[i] = ((u32)data[(i)*4] << 24) | ((u32)data[(i)*4+1] << 16) | \
+                            ((u32)data[(i)*4+2] << 8) | data[(i)*4+3])
+#define blk(i) (block[(i)&15] = rol(block[((i)+13)&15]^block[((i)+8)&15] \
+    ^block[((i)+2)&15]^block[(i)&15],1))
+
+/* (R0+R1), R2, R3, R4 are the different operations used in SHA1 */
+#define R0(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk0(i)+0x5A827999+rol(v,5);w=rol(w,30);
+#define R1(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk(i)+0x5A827999+rol(v,5);w=rol(w,30);
+#define R2(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0x6ED9EBA1+rol(v,5);w=rol(w,30);
+#define R3(v,w,x,y,z,i) z+=(((w|x)&y)|(w&x))+blk(i)+0x8F1BBCDC+rol(v,5);w=rol(w,30);
+#define R4(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0xCA62C1D6+rol(v,5);w=rol(w,30);
+
+// Software path, works on any alignment and leaves the engine alone.
+static void sha_transform_sw(u32 state[SHA_HASH_WORDS], const u8* data, u32 blocks)
+{
+    u32 block[16];
+
+    for (; blocks; blocks--, data += SHA_BLOCK_SIZE) {
+        u32 a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+        /* 4 rounds of 20 operations each. Loop unrolled. */
+        R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3);
+        R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7);
+        R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11);
+        R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15);
+        R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19);
+        R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23);
+        R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27);
+        R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31);
+        R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35);
+        R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39);
+        R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43);
+        R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47);
+        R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51);
+        R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55);
+        R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59);
+        R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63);
+        R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67);
+        R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71);
+        R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75);
+        R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+// Sets the number of blocks from which on the engine is used. 0 forces the engine,
+// ~0 forces software. Returns the previous value.
+u32 sha_set_hw_threshold(u32 blocks)
+{
+    u32 old = sha_hw_min_blocks;
+    sha_hw_min_blocks = blocks;
+    return old;
+}
+
+static void sha_transform(u32 state[SHA_HASH_WORDS], const u8* data, u32 blocks)
+{
+    if(blocks == 0) return;
+
+    if (blocks < sha_hw_min_blocks) {
+        sha_transform_sw(state, data, blocks);
+        return;
+    }
+
+    // The registers may still hold a background job.
+    sha_wait_job();
+    sha_load_state(state);
+
+    if (sha_can_dma(data)) {
+        const u8* start = data;
+        u32 size = blocks * SHA_BLOCK_SIZE;
+        dma_give(start, size, DMA_TO_DEVICE, RB_SHA);
+
+        while (blocks) {
+            u32 run = min(blocks, (u32)SHA_MAX_BLOCKS);
+            sha_run(data, run, 0);
+            sha_poll();
+            data += run * SHA_BLOCK_SIZE;
+            blocks -= run;
+        }
+
+        dma_take(start, size, DMA_TO_DEVICE, WB_NONE);
+    } else {
+        while (blocks) {
+            u32 run = min(blocks, (u32)SHA_SCRATCH_BLOCKS);
+            memcpy(sha_scratch, data, run * SHA_BLOCK_SIZE);
+            dma_give(sha_scratch, run * SHA_BLOCK_SIZE, DMA_TO_DEVICE, RB_SHA);
+
+            sha_run(sha_scratch, run, 0);
+            sha_poll();
+            dma_take(sha_scratch, run * SHA_BLOCK_SIZE, DMA_TO_DEVICE, WB_NONE);
+            data += run * SHA_BLOCK_SIZE;
+            blocks -= run;
+        }
+    }
+
+    sha_store_state(state);
 }
 
 void sha_init(sha_ctx* ctx)
@@ -82,51 +278,118 @@ void sha_init(sha_ctx* ctx)
     ctx->state[4] = 0xC3D2E1F0;
 }
 
-void sha_update(sha_ctx* ctx, const void* inbuf, size_t size)
+// Adds size bytes to the message length, returns how much of ctx->buffer is in use.
+static u32 sha_count(sha_ctx* ctx, size_t size)
 {
-    unsigned int i, j;
-    u8* data = (u8*)inbuf;
-
-    j = (ctx->count[0] >> 3) & 63;
+    u32 j = (ctx->count[0] >> 3) & 63;
     if ((ctx->count[0] += size << 3) < (size << 3))
         ctx->count[1]++;
     ctx->count[1] += (size >> 29);
-    if ((j + size) > 63) {
-        memcpy(&ctx->buffer[j], data, (i = 64-j));
-        sha_transform(ctx->state, ctx->buffer, 1);
-        // try bigger blocks at once
-        for ( ; i + 63 + ((BLOCKSIZE-1)*64) < size; i += (64 + (BLOCKSIZE-1)*64)) {
-            sha_transform(ctx->state, &data[i], BLOCKSIZE);
-        }
-        for ( ; i + 63 + (((BLOCKSIZE/2)-1)*64) < size; i += (64 + ((BLOCKSIZE/2)-1)*64)) {
-            sha_transform(ctx->state, &data[i], BLOCKSIZE/2);
-        }
-        for ( ; i + 63 + (((BLOCKSIZE/4)-1)*64) < size; i += (64 + ((BLOCKSIZE/4)-1)*64)) {
-            sha_transform(ctx->state, &data[i], BLOCKSIZE/4);
-        }
-        for ( ; i + 63 < size; i += 64) {
-            sha_transform(ctx->state, &data[i], 1);
+    return j;
+}
+
+// Completes a partially filled ctx->buffer, returns how many bytes of data it took.
+static size_t sha_fill(sha_ctx* ctx, u32 j, const u8* data, size_t size)
+{
+    if (j == 0 || j + size < SHA_BLOCK_SIZE)
+        return 0;
+
+    size_t i = SHA_BLOCK_SIZE - j;
+    memcpy(&ctx->buffer[j], data, i);
+    sha_transform(ctx->state, ctx->buffer, 1);
+    return i;
+}
+
+void sha_update(sha_ctx* ctx, const void* inbuf, size_t size)
+{
+    const u8* data = inbuf;
+
+    // ctx->state is only valid once a background job on it is done.
+    sha_end_update(ctx);
+
+    u32 j = sha_count(ctx, size);
+    size_t i = sha_fill(ctx, j, data, size);
+    if (i) j = 0;
+
+    // All whole blocks in one go, one command per SHA_MAX_BLOCKS.
+    if (j == 0) {
+        u32 blocks = (size - i) / SHA_BLOCK_SIZE;
+#ifdef CAN_HAZ_IRQ
+        if (blocks >= max(sha_hw_min_blocks, (u32)SHA_IRQ_MIN_BLOCKS) && sha_can_dma(&data[i])) {
+            sha_wait_job();
+            sha_load_state(ctx->state);
+            sha_submit(ctx, &data[i], blocks);
+            sha_wait_job();
+        } else
+#endif
+        sha_transform(ctx->state, &data[i], blocks);
+        i += blocks * SHA_BLOCK_SIZE;
+    }
+
+    memcpy(&ctx->buffer[j], &data[i], size - i);
+}
+
+// Like sha_update, but the engine works through the aligned middle part of the data
+// in the background (IRQ driven) while the caller does something else. The data must
+// stay untouched until sha_end_update, the next update or sha_final on ctx, which
+// all finish the job first.
+void sha_start_update(sha_ctx* ctx, const void* inbuf, size_t size)
+{
+    const u8* data = inbuf;
+
+    sha_end_update(ctx);
+
+    u32 j = sha_count(ctx, size);
+    size_t i = sha_fill(ctx, j, data, size);
+    if (i) j = 0;
+
+    if (j == 0) {
+        u32 blocks = (size - i) / SHA_BLOCK_SIZE;
+        const u8* blocks_data = &data[i];
+        i += blocks * SHA_BLOCK_SIZE;
+
+        // The tail is buffered up front, so the job is all that's left to do.
+        memcpy(ctx->buffer, &data[i], size - i);
+
+        if (blocks && blocks >= sha_hw_min_blocks && sha_can_dma(blocks_data)) {
+            sha_wait_job();
+            sha_load_state(ctx->state);
+            sha_submit(ctx, blocks_data, blocks);
+        } else {
+            sha_transform(ctx->state, blocks_data, blocks);
         }
-        j = 0;
+        return;
     }
-    else i = 0;
+
     memcpy(&ctx->buffer[j], &data[i], size - i);
 }
 
+void sha_end_update(sha_ctx* ctx)
+{
+    if (sha_job.ctx == ctx)
+        sha_wait_job();
+}
+
 void sha_final(sha_ctx* ctx, void* outbuf)
 {
-    u8 final_count[8];
     u8* digest = outbuf;
 
+    sha_end_update(ctx);
+
+    // Pad in place: 0x80, zeroes up to 56 bytes into a block, then the length in bits.
+    u32 j = (ctx->count[0] >> 3) & 63;
+    ctx->buffer[j++] = 0x80;
+    if (j > SHA_BLOCK_SIZE - 8) {
+        memset(&ctx->buffer[j], 0, SHA_BLOCK_SIZE - j);
+        sha_transform(ctx->state, ctx->buffer, 1);
+        j = 0;
+    }
+    memset(&ctx->buffer[j], 0, SHA_BLOCK_SIZE - 8 - j);
     for (int i = 0; i < 8; i++) {
-        final_count[i] = ((ctx->count[(i >= 4 ? 0 : 1)] >> ((3-(i & 3)) * 8) ) & 255);  /* Endian independent */
+        ctx->buffer[SHA_BLOCK_SIZE - 8 + i] = ((ctx->count[(i >= 4 ? 0 : 1)] >> ((3-(i & 3)) * 8) ) & 255);  /* Endian independent */
     }
+    sha_transform(ctx->state, ctx->buffer, 1);
 
-    sha_update(ctx, "\200", 1);
-    while ((ctx->count[0] & 504) != 448) {
-        sha_update(ctx, "\0", 1);
-    }
-    sha_update(ctx, final_count, sizeof(final_count));  /* Should cause a sha_transform() */
     for (int i = 0; i < SHA_HASH_SIZE; i++) {
         digest[i] = ((ctx->state[i>>2] >> ((3-(i & 3)) * 8) ) & 255);
     }
@@ -135,8 +398,8 @@ void sha_final(sha_ctx* ctx, void* outbuf)
     memset(ctx->buffer, 0, sizeof(ctx->buffer));
     memset(ctx->state, 0, sizeof(ctx->state));
     memset(ctx->count, 0, sizeof(ctx->count));
-    memset(final_count, 0, sizeof(final_count));
-    sha_transform(ctx->state, ctx->buffer, 1);
+    if (!sha_job.ctx)
+        sha_load_state(ctx->state);
 }
 
 void sha_hash(const void* inbuf, void* outbuf, size_t size)
@@ -147,3 +410,46 @@ void sha_hash(const void* inbuf, void* outbuf, size_t size)
     sha_update(&ctx, inbuf, size);
     sha_final(&ctx, outbuf);
 }
+
+// Known answers from FIPS PUB 180-1, through both the engine and the software path.
+int sha_selftest(void)
+{
+    static const struct {
+        const char* msg;
+        u32 repeat;
+        u8 hash[SHA_HASH_SIZE];
+    } vectors[] = {
+        { "abc", 1,
+          { 0xA9, 0x99, 0x3E, 0x36, 0x47, 0x06, 0x81, 0x6A, 0xBA, 0x3E,
+            0x25, 0x71, 0x78, 0x50, 0xC2, 0x6C, 0x9C, 0xD0, 0xD8, 0x9D } },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+          { 0x84, 0x98, 0x3E, 0x44, 0x1C, 0x3B, 0xD2, 0x6E, 0xBA, 0xAE,
+            0x4A, 0xA1, 0xF9, 0x51, 0x29, 0xE5, 0xE5, 0x46, 0x70, 0xF1 } },
+        { "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 1000000 / 64,
+          { 0x34, 0xAA, 0x97, 0x3C, 0xD4, 0xC4, 0xDA, 0xA4, 0xF6, 0x1E,
+            0xEB, 0x2B, 0xDB, 0xAD, 0x27, 0x31, 0x65, 0x34, 0x01, 0x6F } },
+    };
+    const u32 thresholds[2] = { 0, ~0 };
+    u32 old = sha_hw_min_blocks;
+    int res = 0;
+
+    for (int t = 0; t < 2; t++) {
+        sha_hw_min_blocks = thresholds[t];
+
+        for (int v = 0; v < sizeof(vectors) / sizeof(vectors[0]); v++) {
+            sha_ctx ctx;
+            u8 hash[SHA_HASH_SIZE];
+
+            sha_init(&ctx);
+            for (u32 i = 0; i < vectors[v].repeat; i++)
+                sha_update(&ctx, vectors[v].msg, strlen(vectors[v].msg));
+            sha_final(&ctx, hash);
+
+            if (memcmp(hash, vectors[v].hash, SHA_HASH_SIZE))
+                res = -1 - v;
+        }
+    }
+
+    sha_hw_min_blocks = old;
+    return res;
+}
@@ -31,6 +31,14 @@ void sha_init(sha_ctx* ctx);
 void sha_update(sha_ctx* ctx, const void* inbuf, size_t size);
 void sha_final(sha_ctx* ctx, void* outbuf);
 
+void sha_start_update(sha_ctx* ctx, const void* inbuf, size_t size);
+void sha_end_update(sha_ctx* ctx);
+
+void sha_irq(void);
+
+u32 sha_set_hw_threshold(u32 blocks);
+int sha_selftest(void);
+
 void sha_hash(const void* inbuf, void* outbuf, size_t size);
 
 #endif